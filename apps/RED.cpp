@@ -83,9 +83,9 @@ static void _cb(
          {
             if (self->mode == RED_MODE_DETENT)
             {
-               if (detent != (self->step / STEPS)) (self->cb)(self->step / STEPS);
+               if (detent != (self->step / STEPS)) (self->cb)(self->step / STEPS, tick);
             }
-            else (self->cb)(self->step);
+            else (self->cb)(self->step, tick);
          }
       }
    }
@@ -7,7 +7,10 @@ Public Domain
 #ifndef RED_H
 #define RED_H
 
-typedef void (*RED_CB_t)(int);
+#include <stdint.h>
+
+/* The callback gets the position, and the pigpio tick of the edge that moved it. */
+typedef void (*RED_CB_t)(int, uint32_t);
 
 struct _RED_s;
 
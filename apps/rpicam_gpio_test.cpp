@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rpicam_gpio_test.cpp - print the events from knobs on a GPIO character device.
+ */
+
+// Example: rpicam-gpio-test --gpio-chip /dev/gpiochip0 --knob 10,22,27 --knob 26,19,13 -t 10000
+//
+// No camera is needed, and nor is a Pi, as the lines can come from the gpio-sim module. Each
+// knob is given as the line offsets of its two encoder pins and its button (leave the button
+// off if there isn't one). Every event is printed as "turn <knob> <counts> <amount>", "press
+// <knob>" or "release <knob>", where the amount is how far the turn moves a setting once the
+// --acceleration curve (as for rpicam-hello's --knob-acceleration) is applied.
+//
+// Or: rpicam-gpio-test --replay edges.txt --acceleration 6,3,15
+//
+// feeds a recording of one knob's edges through the same decoding instead. Each line of the
+// file is "<tick> <pin> <level>", the tick being in microseconds, as pigpio gives them, and
+// the pin a or b.
+//
+// Or: rpicam-gpio-test --queue-test
+//
+// checks the event queues that the knobs post to, and prints "queue test passed".
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "core/gpio_input.hpp"
+#include "core/knob_acceleration.hpp"
+#include "core/logging.hpp"
+#include "core/quadrature_decoder.hpp"
+
+static GpioInput::Knob parse_knob(std::string const &text)
+{
+	GpioInput::Knob knob = { -1, -1, -1 };
+	char comma;
+	std::istringstream stream(text);
+	if (!(stream >> knob.a >> comma >> knob.b) || comma != ',')
+		throw std::runtime_error("bad knob " + text);
+	if (stream >> comma && (comma != ',' || !(stream >> knob.button)))
+		throw std::runtime_error("bad knob " + text);
+	return knob;
+}
+
+static void print_event(InputEvent const &event, KnobAcceleration &acceleration)
+{
+	if (event.type == InputEvent::TURN)
+		std::cout << "turn " << event.control << " " << event.steps << " " << acceleration.Turned(event).amount
+				  << std::endl;
+	else
+		std::cout << (event.type == InputEvent::PRESS ? "press " : "release ") << event.control << std::endl;
+}
+
+static void replay(std::string const &filename, KnobAcceleration &acceleration)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error("failed to open " + filename);
+
+	QuadratureDecoder decoder;
+	std::string line;
+	bool first = true;
+	uint32_t first_tick = 0;
+	while (std::getline(file, line))
+	{
+		std::istringstream stream(line);
+		uint32_t tick;
+		char pin;
+		int level;
+		if (!(stream >> tick >> pin >> level) || (pin != 'a' && pin != 'b'))
+			throw std::runtime_error("bad edge \"" + line + "\" in " + filename);
+		if (first)
+			first_tick = tick, first = false;
+
+		InputEvent event;
+		event.type = InputEvent::TURN;
+		event.control = 0;
+		event.steps = decoder.Changed(pin == 'b', level);
+		// Ticks wrap round, so only their differences mean anything.
+		event.timestamp = std::chrono::steady_clock::time_point(std::chrono::hours(1)) +
+						  std::chrono::microseconds(uint32_t(tick - first_tick));
+		if (event.steps)
+			print_event(event, acceleration);
+	}
+}
+
+static void check(bool ok, std::string const &what)
+{
+	if (!ok)
+		throw std::runtime_error("queue test: " + what);
+}
+
+static void queue_test()
+{
+	// Go round a small queue many times, filling it each time.
+	SpscQueue<int, 4> queue;
+	int item, next = 0, expected = 0;
+	check(!queue.Pop(item) && !queue.Front(), "new queue not empty");
+	for (int round = 0; round < 10; round++)
+	{
+		while (queue.Push(next))
+			next++;
+		check(next == 4 * (round + 1) - round * 2, "queue holds the wrong number of items when full");
+		check(*queue.Front() == expected, "full queue changed");
+		// Leave two behind, so that the next round fills it from part way round.
+		for (int i = 0; i < (round == 9 ? 4 : 2); i++)
+			check(queue.Pop(item) && item == expected++, "items out of order");
+	}
+	check(!queue.Pop(item), "emptied queue not empty");
+
+	// One thread pushing as fast as it can, and this one taking them out.
+	static constexpr int COUNT = 200000;
+	SpscQueue<int, 256> shared;
+	std::thread producer([&shared] {
+		for (int i = 0; i < COUNT; i++)
+		{
+			while (!shared.Push(i))
+				std::this_thread::yield();
+		}
+	});
+	for (expected = 0; expected < COUNT;)
+	{
+		if (shared.Pop(item))
+			check(item == expected++, "item " + std::to_string(item) + " out of order between threads");
+		else
+			std::this_thread::yield();
+	}
+	producer.join();
+
+	// Several sources' events come out in time order, each source's in the order it posted.
+	InputEvents events;
+	unsigned int sources[3] = { events.AddSource(), events.AddSource(), events.AddSource() };
+	auto start = std::chrono::steady_clock::now();
+	std::vector<int> times = { 1, 2, 3, 4, 5, 7, 8, 6, 9 };
+	for (unsigned int i = 0; i < times.size(); i++)
+		events.Post(sources[i % 3], InputEvent::TURN, i % 3, times[i], start + std::chrono::milliseconds(times[i]));
+	InputEvent event;
+	for (int t = 1; t <= 9; t++)
+	{
+		check(events.Next(event) && event.steps == t && event.timestamp == start + std::chrono::milliseconds(t),
+			  "event at " + std::to_string(t) + "ms out of order");
+		check(event.control == (unsigned int)(std::find(times.begin(), times.end(), t) - times.begin()) % 3,
+			  "event at " + std::to_string(t) + "ms came from the wrong source");
+	}
+	check(!events.Next(event), "events left over");
+
+	// A full source drops what's posted after it fills, without upsetting the others.
+	for (int i = 0; i < 300; i++)
+		events.Post(sources[0], InputEvent::TURN, 0, i, start + std::chrono::milliseconds(i));
+	events.Post(sources[1], InputEvent::PRESS, 1, 0, start + std::chrono::microseconds(100500));
+	for (int i = 0; i < 256; i++)
+	{
+		if (i == 101)
+			check(events.Next(event) && event.type == InputEvent::PRESS, "other source's event not in order");
+		check(events.Next(event) && event.type == InputEvent::TURN && event.steps == i, "lost events from full source");
+	}
+	check(!events.Next(event), "dropped events came out");
+	std::cout << "queue test passed" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		using namespace boost::program_options;
+		GpioInput::Config config;
+		std::vector<std::string> knobs;
+		std::string curve_text, replay_file;
+		unsigned int timeout;
+		options_description options("Valid options are");
+		options.add_options()
+			("help,h", "Print this help message")
+			("gpio-chip", value<std::string>(&config.chip)->default_value("/dev/gpiochip0"), "GPIO character device")
+			("knob", value<std::vector<std::string>>(&knobs), "Encoder and button lines of a knob, as a,b[,button]")
+			("debounce", value<unsigned int>(&config.debounce_us)->default_value(1000), "Debounce period in us")
+			("timeout,t", value<unsigned int>(&timeout)->default_value(5000), "Time to run for in ms")
+			("acceleration", value<std::string>(&curve_text)->default_value("1,3,15"),
+			 "Knob acceleration curve as gain,slow,fast")
+			("replay", value<std::string>(&replay_file), "Decode a file of recorded edges instead of a GPIO chip")
+			("queue-test", "Check the event queues instead")
+			;
+		variables_map vm;
+		store(parse_command_line(argc, argv, options), vm);
+		notify(vm);
+		if (vm.count("help"))
+		{
+			std::cout << options;
+			return 0;
+		}
+
+		if (vm.count("queue-test"))
+		{
+			queue_test();
+			return 0;
+		}
+
+		KnobAcceleration::Curve curve;
+		if (sscanf(curve_text.c_str(), "%f,%f,%f", &curve.max_gain, &curve.slow_speed, &curve.fast_speed) != 3 ||
+			!(curve.fast_speed > curve.slow_speed))
+			throw std::runtime_error("bad acceleration " + curve_text);
+		KnobAcceleration acceleration(curve);
+		if (!replay_file.empty())
+		{
+			replay(replay_file, acceleration);
+			return 0;
+		}
+
+		if (knobs.empty())
+			throw std::runtime_error("no knobs given");
+		for (auto const &knob : knobs)
+			config.knobs.push_back(parse_knob(knob));
+
+		InputEvents events;
+		GpioInput gpio(config, events);
+		auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+		while (std::chrono::steady_clock::now() < end)
+		{
+			InputEvent event;
+			while (events.Next(event))
+				print_event(event, acceleration);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
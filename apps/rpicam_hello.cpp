@@ -7,13 +7,19 @@
 
 #include <chrono>
 
+#include "core/focus_memory.hpp"
+#include "core/gpio_input.hpp"
+#include "core/input_events.hpp"
+#include "core/knob_acceleration.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/settings_store.hpp"
+#include "preview/preview.hpp"
 
 #include <iostream>
+#include <mutex>
 #include <pigpio.h>
 #include "rotary_encoder.hpp"
-#include <thread>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,10 +43,29 @@ const int ENCODER1_A = 10;
 const int ENCODER1_B = 22;
 const int ENCODER1_SW = 27;
 
+// The knobs, as InputEvent controls. Encoder 1 chooses the display mode, and encoder 2 zooms.
+enum Knob { SHADER_KNOB, ZOOM_KNOB };
+
+// All the knobs' events come through here to the event loop, which is the only thread that
+// changes any of the settings below.
+static InputEvents inputEvents;
+static unsigned int gpioSource;
+// Turns the knobs' counts into how far to move things, going further the faster they spin.
+static KnobAcceleration knobAcceleration;
+// With --input-script, this stands in for the knobs.
+static InputScript *inputScript;
+
 static float contrastA = 0.7;
 static float contrastB = 0.2;
 static float contrastC = 0.2;
 static float contrast = 1.0;
+static float sharpenStrength = 1.0;
+
+// The threshold from the auto_threshold post-processing stage, if it's running. The
+// binarisation band then follows it, and contrastA and contrastB move the band relative
+// to it rather than setting it outright.
+static const float defaultBandCentre = (0.7 + 0.2) / 2;
+static float autoThreshold = -1;
 
 using namespace std::placeholders;
 
@@ -49,21 +74,44 @@ static RPiCamApp app;
 static float maxZoom = 0.25;
 static float zoom = 1.0;
 
-static bool started = false;
-static bool running = true;
 static libcamera::Rectangle scalerCropMaximum;
 static libcamera::Rectangle scalerCrop;
-static int pi;
+static int pi = -1;
 
 //auto lastAutofocusTextDraw = std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds>(std::chrono::milliseconds(0));
 //auto lastZoomTextDraw = std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds>(std::chrono::milliseconds(0));
 
 auto lastAutofocusTextDraw = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
 auto lastZoomTextDraw = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
-auto lastShaderButtonPress = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
-auto lastZoomButtonPress = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+static std::chrono::steady_clock::time_point lastShaderButtonPress;
+static std::chrono::steady_clock::time_point lastZoomButtonPress;
 
 static bool autofocusLocked = false;
+
+// Starting the lens from where it last settled at a zoom, and timing how long autofocus
+// then takes. See updateFocus().
+static FocusMemory *focusMemory;
+static float lensPosition = -1;
+static int focusBand = 0;
+static std::chrono::steady_clock::time_point zoomChanged;
+static unsigned int seedFrames = 0;
+static bool focusTiming = false;
+static bool focusSeeded = false;
+static bool focusScanned = false;
+static bool focusLocked = false;
+static std::chrono::steady_clock::time_point focusStart;
+
+// Freeze-frame. A long press of the zoom button freezes the display. While frozen, turning
+// the zoom knob zooms the frozen frame, and holding and turning it pans across or up and
+// down, or steps back through the recent frames. A short press chooses which.
+enum FreezeAdjust { FREEZE_PAN_X, FREEZE_PAN_Y, FREEZE_FRAME, FREEZE_ADJUST_COUNT };
+static bool frozen = false;
+static float freezeZoom = 1.0;
+static float freezePanX = 0.0;
+static float freezePanY = 0.0;
+static int freezeAdjust = FREEZE_PAN_X;
+static const char *freezeAdjustNames[FREEZE_ADJUST_COUNT] = { "Pan across", "Pan up/down", "Frame" };
+
 static bool shaderButtonHeld = false;
 static bool zoomButtonHeld = false;
 
@@ -71,40 +119,59 @@ static bool zoomButtonHeld = false;
 static bool shaderCallbackActivated = false;
 static bool zoomCallbackActivated = false;
 
-static void loadShaderValues() {
-	std::ifstream shaderFile("shaderValues.txt");
-	std::string text;
-
-	getline (shaderFile, text);
-	contrastA = std::stof(text);
-	
-	getline (shaderFile, text);
-	contrastB = std::stof(text);
-	
-	getline (shaderFile, text);
-	contrastC = std::stof(text);
-	
-	getline (shaderFile, text);
-	contrast = std::stof(text);
-
-	std::cout << "Loaded Shader Values: A=" << contrastA << " B=" << contrastB << " C=" << contrastC << " Contrast=" << contrast << std::endl;
-
-	shaderFile.close();
+// What onDraw needs to know. It's called from the preview thread, so the event loop hands
+// it a copy whenever it has dealt with some input.
+struct OverlayState {
+	float zoom = 1.0;
+	bool autofocusLocked = false;
+	bool frozen = false;
+	int freezeAdjust = FREEZE_PAN_X;
+	std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> lastZoomTextDraw;
+	std::chrono::time_point<std::chrono::system_clock, std::chrono::milliseconds> lastAutofocusTextDraw;
+};
+static std::mutex overlayMutex;
+static OverlayState overlay;
+
+static void publishOverlay() {
+	std::lock_guard<std::mutex> lock(overlayMutex);
+	overlay.zoom = zoom;
+	overlay.autofocusLocked = autofocusLocked;
+	overlay.frozen = frozen;
+	overlay.freezeAdjust = freezeAdjust;
+	overlay.lastZoomTextDraw = lastZoomTextDraw;
+	overlay.lastAutofocusTextDraw = lastAutofocusTextDraw;
+}
+
+// The settings are kept in memory, and the store writes them out later from its own thread,
+// so saving them costs the input handling nothing. There's no store when a script drives the
+// input, so that a test run neither starts from nor leaves behind the user's settings.
+static SettingsStore *settings;
+
+static void loadSettings() {
+	if(!settings)
+		return;
+	contrastA = settings->Get("contrast_a", 0.7, 0.0, 1.0);
+	contrastB = settings->Get("contrast_b", 0.2, 0.0, 1.0);
+	contrastC = settings->Get("contrast_c", 0.2, -1.0, 0.5);
+	contrast = settings->Get("contrast", 1.0, 1.0, 4.0);
+	sharpenStrength = settings->Get("sharpen", 1.0, 0.0, 4.0);
+	zoom = settings->Get("zoom", 1.0, maxZoom, 1.0);
+	autofocusLocked = settings->Get("autofocus_locked", 0, 0, 1) > 0.5;
+
+	std::cout << "Loaded Shader Values: A=" << contrastA << " B=" << contrastB << " C=" << contrastC << " Contrast=" << contrast << " Sharpen=" << sharpenStrength << std::endl;
 }
 
-static void saveShaderValues() {
-	std::ofstream shaderFile("shaderValues.txt");
-	
-	shaderFile << std::to_string(contrastA);
-	shaderFile << "\n";
-	shaderFile << std::to_string(contrastB);
-	shaderFile << "\n";
-	shaderFile << std::to_string(contrastC);
-	shaderFile << "\n";
-	shaderFile << std::to_string(contrast);
-	shaderFile << "\n";
-	
-	shaderFile.close();
+static void saveSettings() {
+	if(!settings)
+		return;
+	settings->Set("contrast_a", contrastA);
+	settings->Set("contrast_b", contrastB);
+	settings->Set("contrast_c", contrastC);
+	settings->Set("contrast", contrast);
+	settings->Set("sharpen", sharpenStrength);
+	settings->Set("zoom", zoom);
+	settings->Set("mode", app.getShaderIndex());
+	settings->Set("autofocus_locked", autofocusLocked);
 }
 
 static float clamp(float num, float min, float max) {
@@ -113,21 +180,44 @@ static float clamp(float num, float min, float max) {
 	return num;
 }
 
-static void toggleAutofocus() {
+static void applyShaderValues() {
+	float a = contrastA, b = contrastB;
+	if(autoThreshold >= 0) {
+		// The threshold is on the camera's luma, before the contrast setting stretches it.
+		float offset = (autoThreshold - 0.5) * contrast + 0.5 - defaultBandCentre;
+		a += offset;
+		b += offset;
+	}
+	app.setShaderValues(a, b, contrastC, contrast);
+}
+
+static void setAutofocusLocked(bool locked) {
 	libcamera::ControlList controls;
 
-	if(autofocusLocked) {
-		controls.set(libcamera::controls::AfMode, libcamera::controls::AfModeEnum::AfModeContinuous);
-		autofocusLocked = false;
-	} else {
+	if(locked) {
 		controls.set(libcamera::controls::AfMode, libcamera::controls::AfModeEnum::AfModeManual);
-		autofocusLocked = true;
+	} else {
+		controls.set(libcamera::controls::AfMode, libcamera::controls::AfModeEnum::AfModeContinuous);
 	}
+	autofocusLocked = locked;
  
 	app.SetControls(controls);
+}
+
+static void toggleAutofocus() {
+	setAutofocusLocked(!autofocusLocked);
 	lastAutofocusTextDraw = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
 }
 
+static void toggleFreeze() {
+	frozen = !frozen;
+	freezeZoom = 1.0;
+	freezePanX = freezePanY = 0.0;
+	freezeAdjust = FREEZE_PAN_X;
+	app.setFreezeView(freezeZoom, freezePanX, freezePanY);
+	app.setFreeze(frozen);
+}
+
 static void setZoom() {
 	const int DENOMINATOR = 100;
 	libcamera::Rectangle scaledRectangle = scalerCropMaximum.scaledBy(libcamera::Size(zoom*zoom*DENOMINATOR, zoom*zoom*DENOMINATOR), libcamera::Size(DENOMINATOR, DENOMINATOR));
@@ -143,75 +233,180 @@ static void setZoom() {
 	libcamera::ControlList controls;
 	controls.set(controls::AfMetering, controls::AfMeteringWindows);
 	controls.set(controls::AfWindows, afwindows_rectangle);
-	controls.set(libcamera::controls::ScalerCrop, scaledRectangle);
  
 	app.SetControls(controls);
+	app.setZoom(scaledRectangle);
+	zoomChanged = std::chrono::steady_clock::now();
 	lastZoomTextDraw = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
 }
 
+// Called with each frame's metadata. Once the zoom knob has come to rest in a new band, the
+// lens is moved to where autofocus last settled in that band, for a few frames while it gets
+// there, and then continuous autofocus carries on from there. Either way, we time how long
+// it takes autofocus to lock again, so that the two can be compared (with --focus-memory=0).
+static void updateFocus(libcamera::ControlList const &metadata) {
+	auto now = std::chrono::steady_clock::now();
+	auto lens = metadata.get(libcamera::controls::LensPosition);
+	if(lens) {
+		lensPosition = *lens;
+	}
+
+	// Locking the focus while the lens was held at the seed position leaves it there.
+	if(seedFrames && --seedFrames == 0 && !autofocusLocked) {
+		libcamera::ControlList controls;
+		controls.set(libcamera::controls::AfMode, libcamera::controls::AfModeEnum::AfModeContinuous);
+		app.SetControls(controls);
+	}
+
+	if(zoomChanged != std::chrono::steady_clock::time_point() && now - zoomChanged > std::chrono::milliseconds(150)) {
+		int band = FocusMemory::Band(zoom);
+		if(band != focusBand && !autofocusLocked && lensPosition >= 0) {
+			float seed;
+			focusSeeded = focusMemory && focusMemory->Seed(band, lensPosition, seed);
+			if(focusSeeded) {
+				libcamera::ControlList controls;
+				controls.set(libcamera::controls::AfMode, libcamera::controls::AfModeEnum::AfModeManual);
+				controls.set(libcamera::controls::LensPosition, seed);
+				app.SetControls(controls);
+				seedFrames = 3;
+			}
+			focusTiming = true;
+			focusScanned = false;
+			focusLocked = false;
+			focusStart = zoomChanged;
+		}
+		focusBand = band;
+		zoomChanged = std::chrono::steady_clock::time_point();
+	}
+
+	auto afState = metadata.get(libcamera::controls::AfState);
+	if(!afState || seedFrames || autofocusLocked) {
+		return;
+	}
+	if(*afState != libcamera::controls::AfStateFocused) {
+		focusScanned = true;
+		focusLocked = false;
+		if(*afState == libcamera::controls::AfStateFailed) {
+			focusTiming = false;
+		}
+		return;
+	}
 
-static void shaderRotaryCallback(int newPos) {
-	if(!started) return;
-   	static int pos = 0;
-   	int direction = pos - newPos;
+	// It only counts once autofocus has had another look. If it hasn't bothered, the old
+	// position was still good.
+	long ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - focusStart).count();
+	if(focusTiming && (focusScanned || ms > 1000)) {
+		focusTiming = false;
+		if(focusScanned) {
+			LOG(1, "Autofocus locked in " << ms << "ms" << (focusSeeded ? " from the remembered position" : ""));
+			app.WriteMetrics("{ \"event\": \"focus\", \"ms\": " + std::to_string(ms) + ", \"band\": " +
+							 std::to_string(focusBand) + ", \"seeded\": " + (focusSeeded ? "true" : "false") + " }");
+		}
+	}
+	// Remember the position once each time autofocus locks, not on every frame after.
+	if(!focusTiming && !focusLocked && focusMemory) {
+		focusMemory->Converged(focusBand, lensPosition);
+	}
+	focusLocked = !focusTiming;
+}
 
+static void shaderKnobTurned(KnobAcceleration::Turn const &turn) {
 	if(shaderButtonHeld) {
 		shaderCallbackActivated = true;
-		if(app.getShaderIndex() == 0) {
-			if(direction > 0) {
-				contrast -= 0.03; 
-			} else {
-				contrast += 0.03; 
-			}
+		int shaderIndex = app.getShaderIndex();
+		if(shaderIndex == 0) {
+			contrast += 0.03 * turn.amount;
+		} else if(shaderIndex == Preview::SHARPEN_SHADER || shaderIndex == Preview::EDGE_SHADER) {
+			sharpenStrength += 0.1 * turn.amount;
 		} else {
-			if(direction > 0) {
-				contrastA += 0.03; 
-			} else {
-				contrastA -= 0.03; 
-			}
+			contrastA -= 0.03 * turn.amount;
 		}
 		
 		contrastA = clamp(contrastA, contrastB+0.01, 1.0);
 		contrast = clamp(contrast, 1.0, 4.0);
-		app.setShaderValues(contrastA, contrastB, contrastC, contrast);
-		saveShaderValues();
+		sharpenStrength = clamp(sharpenStrength, 0.0, 4.0);
+		applyShaderValues();
+		app.setSharpenStrength(sharpenStrength);
 	} else {
-		if(direction > 0) {
+		// The modes go by one to a detent, however fast the knob turns.
+		for(int i = 0; i < -turn.detents; i++) {
 			app.nextShader();
-		} else {
+		}
+		for(int i = 0; i < turn.detents; i++) {
 			app.prevShader();
 		}
 	}
-
-	pos = newPos;
 }
 
-static void zoomRotaryCallback(int newPos) {
-	if(!started) return;
-   	static int pos = 0;
-   	int direction = pos - newPos;
-   
-	if(zoomButtonHeld) {
-		zoomCallbackActivated = true;
-		if(direction > 0) {
-			contrastC += 0.03; 
+static void zoomKnobTurned(KnobAcceleration::Turn const &turn) {
+	if(frozen) {
+		if(zoomButtonHeld) {
+			zoomCallbackActivated = true;
+			float step = 0.05 * turn.amount;
+			if(freezeAdjust == FREEZE_PAN_X) {
+				freezePanX = clamp(freezePanX + step, -1.0, 1.0);
+			} else if(freezeAdjust == FREEZE_PAN_Y) {
+				freezePanY = clamp(freezePanY + step, -1.0, 1.0);
+			} else if(turn.detents) {
+				app.stepFreezeFrame(-turn.detents);
+			}
 		} else {
-			contrastC -= 0.03; 
+			freezeZoom = clamp(freezeZoom + 0.1 * turn.amount, 1.0, 8.0);
 		}
-		
+		app.setFreezeView(freezeZoom, freezePanX, freezePanY);
+	} else if(zoomButtonHeld) {
+		zoomCallbackActivated = true;
+		contrastC -= 0.03 * turn.amount;
 		contrastC = clamp(contrastC, -1.0, 0.5);
-		app.setShaderValues(contrastA, contrastB, contrastC, contrast);
-		saveShaderValues();
+		applyShaderValues();
 	} else {
-		if(direction > 0) {
-			zoom += 0.01;
-		} else {
-			zoom -= 0.01;
-		}
+		zoom -= 0.01 * turn.amount;
 		zoom = clamp(zoom, maxZoom, 1.0);
 		setZoom();
 	}
-	pos = newPos;
+}
+
+static long pressDuration(InputEvent const &release, std::chrono::steady_clock::time_point press) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(release.timestamp - press).count();
+}
+
+static void handleInput(InputEvent const &event) {
+	if(event.type == InputEvent::TURN) {
+		KnobAcceleration::Turn turn = knobAcceleration.Turned(event);
+		if(event.control == SHADER_KNOB) {
+			shaderKnobTurned(turn);
+		} else {
+			zoomKnobTurned(turn);
+		}
+	} else if(event.type == InputEvent::PRESS) {
+		if(event.control == SHADER_KNOB) {
+			shaderButtonHeld = true;
+			lastShaderButtonPress = event.timestamp;
+		} else {
+			zoomButtonHeld = true;
+			lastZoomButtonPress = event.timestamp;
+		}
+	} else if(event.control == SHADER_KNOB) {
+		if(pressDuration(event, lastShaderButtonPress) < 560 && !shaderCallbackActivated) {
+			app.swapOriginalAndActiveShader();
+		}
+
+		shaderButtonHeld = false;
+		shaderCallbackActivated = false;
+	} else {
+		if(!zoomCallbackActivated) {
+			if(pressDuration(event, lastZoomButtonPress) >= 560) {
+				toggleFreeze();
+			} else if(frozen) {
+				freezeAdjust = (freezeAdjust + 1) % FREEZE_ADJUST_COUNT;
+			} else {
+				toggleAutofocus();
+			}
+		}
+
+		zoomButtonHeld = false;
+		zoomCallbackActivated = false;
+	}
 }
 
 static long getTimeDiff(std::chrono::time_point<std::chrono::_V2::system_clock> timePoint) {
@@ -219,7 +414,7 @@ static long getTimeDiff(std::chrono::time_point<std::chrono::_V2::system_clock>
 	return std::chrono::duration_cast<std::chrono::milliseconds>(diff).count();
 }
 
-static float getZoomLevel() {
+static float getZoomLevel(float zoom) {
 	return (1 - ((zoom - maxZoom) / (1 - maxZoom)));
 }
 
@@ -231,6 +426,12 @@ static int drawCounter = 0;
 static float green[3] = {0.2, 1, 0.2};
 static float red[3] = {1, 0.2, 0.2};
 static void onDraw() {
+	OverlayState state;
+	{
+		std::lock_guard<std::mutex> lock(overlayMutex);
+		state = overlay;
+	}
+	float zoomLevel = getZoomLevel(state.zoom);
 
 	const int shadowXOffset = 22;
 	const int shadowYOffset = 13;
@@ -242,24 +443,24 @@ static void onDraw() {
 	float textR = 1;
 	float textG = 1;
 	float textB = 1;
-	if(getTimeDiff(lastZoomTextDraw) < 2000) {
+	if(getTimeDiff(state.lastZoomTextDraw) < 2000) {
 		app.drawText("Zoom", 1896+shadowXOffset, 2200+shadowYOffset, 1, shadowR,shadowG,shadowB);
 		app.drawText("Zoom", 1896, 2200, 1, textR,textG,textB);
 
 		int x = 1920;
 		//keep the number centered
-		if(getZoomLevel() < 1) {
+		if(zoomLevel < 1) {
 			x += 95;
-		}else if(getZoomLevel() < 0.1) {
+		}else if(zoomLevel < 0.1) {
 			x += 40;
 		}
 
 
-		app.drawText(std::to_string((int)(getZoomLevel()*100)) + std::string("%"), x+shadowXOffset, 2450+shadowYOffset, 1, shadowR,shadowG,shadowB);
-		app.drawText(std::to_string((int)(getZoomLevel()*100)) + std::string("%"), x, 2450, 1, lerp(red[0], green[0], getZoomLevel()), lerp(red[1], green[1], getZoomLevel()), lerp(red[2], green[2], getZoomLevel()));
+		app.drawText(std::to_string((int)(zoomLevel*100)) + std::string("%"), x+shadowXOffset, 2450+shadowYOffset, 1, shadowR,shadowG,shadowB);
+		app.drawText(std::to_string((int)(zoomLevel*100)) + std::string("%"), x, 2450, 1, lerp(red[0], green[0], zoomLevel), lerp(red[1], green[1], zoomLevel), lerp(red[2], green[2], zoomLevel));
 	}
 
-	if(getTimeDiff(lastAutofocusTextDraw) < 2000) {
+	if(getTimeDiff(state.lastAutofocusTextDraw) < 2000) {
 		//app.drawText(std::string("Autofocus ") + std::string(autofocusLocked ? "Disabled" : "Enabled"), 90+shadowXOffset, 350+shadowYOffset, 1, shadowR,shadowG,shadowB);
 		//app.drawText(std::string("Autofocus ") + std::string(autofocusLocked ? "Disabled" : "Enabled"), 90, 350, 1, textR,textG,textB);
 
@@ -269,12 +470,20 @@ static void onDraw() {
 		app.drawText("Autofocus ", 90+shadowXOffset, 350+shadowYOffset, 1, shadowR,shadowG,shadowB);
 		app.drawText("Autofocus ", 90, 350, 1, textR,textG,textB);
 
-		std::string autofocusText = autofocusLocked ? "Disabled" : "Enabled";
-		float* color = autofocusLocked ? red : green;
+		std::string autofocusText = state.autofocusLocked ? "Disabled" : "Enabled";
+		float* color = state.autofocusLocked ? red : green;
 		app.drawText(autofocusText, 1300+shadowXOffset, 350+shadowYOffset, 1, shadowR,shadowG,shadowB);
 		app.drawText(autofocusText, 1300, 350, 1, color[0],color[1],color[2]);
 	}
 
+	// With no frames kept for review (--freeze-frames 0) nothing is ever held.
+	if(state.frozen && app.isFrozen()) {
+		app.drawText("Frozen", 90+shadowXOffset, 2450+shadowYOffset, 1, shadowR,shadowG,shadowB);
+		app.drawText("Frozen", 90, 2450, 1, 0.2,0.6,1);
+		app.drawText(freezeAdjustNames[state.freezeAdjust], 90+shadowXOffset, 2200+shadowYOffset, 0.5, shadowR,shadowG,shadowB);
+		app.drawText(freezeAdjustNames[state.freezeAdjust], 90, 2200, 0.5, textR,textG,textB);
+	}
+
 	drawCounter++;
 }
 
@@ -284,16 +493,29 @@ static void event_loop(RPiCamApp &app) {
 	app.OpenCamera();
 	app.ConfigureViewfinder();
 	app.StartCamera();
-	app.setShaderValues(contrastA, contrastB, contrastC, contrast);
-	app.SetTextDrawCallback(onDraw);
+	applyShaderValues();
+	app.setSharpenStrength(sharpenStrength);
 	libcamera::ControlList properties = app.GetProperties();
 	scalerCropMaximum = *properties.get(libcamera::properties::ScalerCropMaximum);
 
-	started = true;
+	// Carry on where the user left off.
+	if(settings)
+		app.setShaderIndex(settings->Get("mode", 0, 0, 1000));
+	focusBand = FocusMemory::Band(zoom);
+	if(zoom < 1.0)
+		setZoom();
+	if(autofocusLocked)
+		setAutofocusLocked(true);
+	publishOverlay();
+	app.SetTextDrawCallback(onDraw);
+
 	auto start_time = std::chrono::high_resolution_clock::now();
+	std::chrono::steady_clock::time_point scriptFinished;
 
 	for (unsigned int count = 0; ; count++)
 	{
+		// Done here, between frames, as it may restart the camera.
+		app.ApplyGovernor();
 		RPiCamApp::Msg msg = app.Wait();
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
@@ -312,68 +534,139 @@ static void event_loop(RPiCamApp &app) {
 		if (options->timeout && (now - start_time) > options->timeout.value)
 			return;
 
+		// The script's times start from the first frame, once the camera is up and running.
+		// If it had already finished, all its events get taken below.
+		bool scriptDone = false;
+		if(inputScript) {
+			inputScript->Start();
+			scriptDone = inputScript->Finished();
+		}
+
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		updateFocus(completed_request->metadata);
+		if(completed_request->post_process_metadata.Get("auto_threshold.threshold", autoThreshold) == 0)
+			applyShaderValues();
+
+		// Deal with any input just before the frame goes to the preview, so that it shows
+		// straight away, and tag the frame so that we hear when it's on the display.
+		InputEvent event;
+		bool handled = false;
+		while (inputEvents.Next(event)) {
+			handleInput(event);
+			inputEvents.Handled(event);
+			handled = true;
+		}
+		if (handled) {
+			publishOverlay();
+			saveSettings();
+		}
+		completed_request->post_process_metadata.Set("input.sequence", inputEvents.HandledCount());
+
 		app.ShowPreview(completed_request, app.ViewfinderStream());
+		PreviewStats stats = app.GetPreviewStats();
+		inputEvents.Presented(stats.input_sequence, stats.input_present_time);
+
+		// Stop when everything in the script has reached the display, or has had long enough
+		// (a preview that doesn't report what it shows never will).
+		if(scriptDone) {
+			auto now = std::chrono::steady_clock::now();
+			if(scriptFinished == std::chrono::steady_clock::time_point()) {
+				scriptFinished = now;
+			}
+			if(inputEvents.PendingCount() == 0 || now - scriptFinished > std::chrono::seconds(1)) {
+				return;
+			}
+		}
 	}
 }
 
 
-void gpioCallback(int a, int b, RED_CB_t callback) {
-   	if (pi >= 0) {
-   		RED_t *renc;
-      	renc = RED(pi, a, b, RED_MODE_DETENT, callback);
-      	RED_set_glitch_filter(renc, 1000);
-      	while(running) sleep(1);
+// pigpio's ticks are the microseconds since the daemon started, and wrap round every 72
+// minutes. Line them up with the steady clock at the first one, and again whenever they
+// stray far from it. pigpiod_if2 makes all its callbacks from the one thread, so this
+// only ever runs there.
+static std::chrono::steady_clock::time_point tickTime(uint32_t tick) {
+	static uint32_t baseTick;
+	static std::chrono::steady_clock::time_point baseTime;
+	auto now = std::chrono::steady_clock::now();
+	auto time = baseTime + std::chrono::microseconds(uint32_t(tick - baseTick));
+	if(baseTime == std::chrono::steady_clock::time_point() || time - now > std::chrono::seconds(1) ||
+	   now - time > std::chrono::seconds(1)) {
+		baseTick = tick;
+		baseTime = now;
+		return now;
+	}
+	return time;
+}
+
+// The RED decoders report each knob's position, so turn that into how far it moved. They
+// share a source, as the callbacks all come from the one thread.
+static void shaderEncoderMoved(int newPos, uint32_t tick) {
+	static int pos = 0;
+	inputEvents.Post(gpioSource, InputEvent::TURN, SHADER_KNOB, newPos - pos, tickTime(tick));
+	pos = newPos;
+}
 
-      	RED_cancel(renc);
-   }
+static void zoomEncoderMoved(int newPos, uint32_t tick) {
+	static int pos = 0;
+	inputEvents.Post(gpioSource, InputEvent::TURN, ZOOM_KNOB, newPos - pos, tickTime(tick));
+	pos = newPos;
 }
 
-void buttonCallbacks() {
+static void startButtons(unsigned int debounce) {
    	set_pull_up_down(pi, ENCODER1_SW, PI_PUD_UP);
    	set_pull_up_down(pi, ENCODER2_SW, PI_PUD_UP);
 
-	set_glitch_filter(pi, ENCODER1_SW, 1000);
-	set_glitch_filter(pi, ENCODER2_SW, 1000);
-
-	callback(pi, ENCODER1_SW, RISING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
-		std::cout << "Button Up 1" << std::endl;
+	set_glitch_filter(pi, ENCODER1_SW, debounce);
+	set_glitch_filter(pi, ENCODER2_SW, debounce);
 
-		if(getTimeDiff(lastShaderButtonPress) < 560 && !shaderCallbackActivated) { 
-			app.swapOriginalAndActiveShader();
-		}
-		
-		shaderButtonHeld = false;
-		shaderCallbackActivated = false;
+	// The buttons pull the line low while they're held.
+	callback(pi, ENCODER1_SW, FALLING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
+		inputEvents.Post(gpioSource, InputEvent::PRESS, SHADER_KNOB, 0, tickTime(tick));
 	});
 
-	callback(pi, ENCODER2_SW, RISING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
-		std::cout << "Button Up 2 " << getTimeDiff(lastZoomButtonPress) << " " << zoomCallbackActivated << std::endl;
-
-		if(getTimeDiff(lastZoomButtonPress) < 560 && !zoomCallbackActivated) { 
-			toggleAutofocus();
-		}
-		
-		zoomButtonHeld = false;
-		zoomCallbackActivated = false;
+	callback(pi, ENCODER1_SW, RISING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
+		inputEvents.Post(gpioSource, InputEvent::RELEASE, SHADER_KNOB, 0, tickTime(tick));
 	});
 
-	
-	callback(pi, ENCODER1_SW, FALLING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
-		std::cout << "Button Down 1" << std::endl;
-		shaderButtonHeld = true;
-		lastShaderButtonPress = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
+	callback(pi, ENCODER2_SW, FALLING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
+		inputEvents.Post(gpioSource, InputEvent::PRESS, ZOOM_KNOB, 0, tickTime(tick));
 	});
 
-	callback(pi, ENCODER2_SW, FALLING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
-		std::cout << "Button Down 2" << std::endl;
-		zoomButtonHeld = true;
-		lastZoomButtonPress = std::chrono::time_point_cast<std::chrono::milliseconds>(std::chrono::system_clock::now());
-		
+	callback(pi, ENCODER2_SW, RISING_EDGE, [](int pi, unsigned gpio, unsigned level, uint32_t tick){
+		inputEvents.Post(gpioSource, InputEvent::RELEASE, ZOOM_KNOB, 0, tickTime(tick));
 	});
 }
 
-int camera(int argc, char *argv[]) {
+// Reads the knobs through the pigpio daemon. The encoders report every step, rather than
+// every detent, so that slow turns can move things by less than a detent.
+class PigpioKnobs {
+public:
+	explicit PigpioKnobs(unsigned int debounce) : shaderEncoder(nullptr), zoomEncoder(nullptr) {
+		gpioSource = inputEvents.AddSource();
+		pi = pigpio_start(NULL, NULL); /* Connect to Pi. */
+		std::cout << "Starting GPIO | PI: " << pi << std::endl;
+		if (pi >= 0) {
+			shaderEncoder = RED(pi, ENCODER1_A, ENCODER1_B, RED_MODE_STEP, shaderEncoderMoved);
+			RED_set_glitch_filter(shaderEncoder, debounce);
+			zoomEncoder = RED(pi, ENCODER2_A, ENCODER2_B, RED_MODE_STEP, zoomEncoderMoved);
+			RED_set_glitch_filter(zoomEncoder, debounce);
+			startButtons(debounce);
+		}
+	}
+	~PigpioKnobs() {
+		if (pi >= 0) {
+			RED_cancel(shaderEncoder);
+			RED_cancel(zoomEncoder);
+			pigpio_stop(pi);
+		}
+	}
+private:
+	RED_t *shaderEncoder;
+	RED_t *zoomEncoder;
+};
+
+int main(int argc, char *argv[]) {
 	try
 	{
 		Options *options = app.GetOptions();
@@ -381,9 +674,51 @@ int camera(int argc, char *argv[]) {
 		{
 			if (options->verbose >= 2)
 				options->Print();
+			knobAcceleration =
+				KnobAcceleration({ options->knob_gain, options->knob_slow_speed, options->knob_fast_speed });
+			std::unique_ptr<SettingsStore> store;
+			std::unique_ptr<FocusMemory> focus;
+			if (options->input_script.empty()) {
+				store = std::make_unique<SettingsStore>("shaderValues.txt");
+				settings = store.get();
+				loadSettings();
+				if (options->focus_memory) {
+					focus = std::make_unique<FocusMemory>(store.get());
+					focusMemory = focus.get();
+				}
+			}
 
+			// With --gpio-chip we read the knobs straight from the kernel, and don't need
+			// the pigpio daemon at all. A script replaces the knobs altogether, so that
+			// nothing else gets mixed in with it.
+			std::unique_ptr<InputScript> script;
+			std::unique_ptr<GpioInput> gpioInput;
+			std::unique_ptr<PigpioKnobs> pigpioKnobs;
+			std::unique_ptr<KeyboardInput> keyboard;
+			if (!options->input_script.empty()) {
+				script = std::make_unique<InputScript>(options->input_script, inputEvents);
+				inputScript = script.get();
+			} else if (!options->gpio_chip.empty()) {
+				GpioInput::Config config;
+				config.chip = options->gpio_chip;
+				config.knobs = { { ENCODER1_A, ENCODER1_B, ENCODER1_SW }, { ENCODER2_A, ENCODER2_B, ENCODER2_SW } };
+				config.debounce_us = options->knob_debounce;
+				gpioInput = std::make_unique<GpioInput>(config, inputEvents);
+			} else {
+				pigpioKnobs = std::make_unique<PigpioKnobs>(options->knob_debounce);
+			}
+			if (!script) {
+				keyboard = std::make_unique<KeyboardInput>(inputEvents);
+			}
+			if (!options->input_report.empty()) {
+				inputEvents.StartReport(options->input_report);
+			}
 
 			event_loop(app);
+			inputEvents.FinishReport();
+			inputScript = nullptr;
+			focusMemory = nullptr;
+			settings = nullptr;
 		}
 	}
 	catch (std::exception const &e)
@@ -393,25 +728,3 @@ int camera(int argc, char *argv[]) {
 	}
 	return 0;
 }
-
-char *optHost   = NULL;
-char *optPort   = NULL;
-int main(int argc, char *argv[]) {
-	loadShaderValues();
-	pi = pigpio_start(NULL, NULL); /* Connect to Pi. */
-	std::cout << "Starting GPIO | PI: " << pi << std::endl;
-
-	std::thread cameraThread (camera, argc, argv);
-	std::thread gpioShaderThread (gpioCallback, ENCODER1_A, ENCODER1_B, shaderRotaryCallback);
-	std::thread gpioZoomThread (gpioCallback, ENCODER2_A, ENCODER2_B, zoomRotaryCallback);
-	std::thread buttonsThread (buttonCallbacks);
-	
-	cameraThread.join();
-	running = false;
-
-	gpioShaderThread.join();
-	gpioZoomThread.join();
-	pigpio_stop(pi);
-
-	buttonsThread.join();
-}
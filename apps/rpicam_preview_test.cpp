@@ -0,0 +1,156 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rpicam_preview_test.cpp - draw a test image through every preview display mode.
+ */
+
+// Example: rpicam-preview-test --headless-preview --input chart.ppm --output-dir out --golden-dir golden
+//
+// No camera is needed. Each display mode is drawn, timed and read back, and written out as
+// mode<N>.ppm. Any golden images given must match exactly, so they have to be generated on
+// the same GPU and driver.
+
+#include <fstream>
+#include <memory>
+
+#include "core/rpicam_app.hpp"
+#include "core/options.hpp"
+
+#include "preview/preview.hpp"
+
+struct PreviewTestOptions : public Options
+{
+	PreviewTestOptions() : Options()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("input", value<std::string>(&input), "Test image to draw, as a binary (P6) PPM file")
+			("output-dir", value<std::string>(&output_dir), "Directory to write the rendered modes to")
+			("golden-dir", value<std::string>(&golden_dir), "Directory of golden images to compare against")
+			("repeat", value<unsigned int>(&repeat)->default_value(20), "Number of draws of each mode for timing")
+			("modes", value<unsigned int>(&modes)->default_value(11), "Number of display modes to test")
+			;
+	}
+
+	std::string input;
+	std::string output_dir;
+	std::string golden_dir;
+	unsigned int repeat;
+	unsigned int modes;
+
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    input: " << input << std::endl;
+		std::cerr << "    output-dir: " << output_dir << std::endl;
+		std::cerr << "    golden-dir: " << golden_dir << std::endl;
+		std::cerr << "    repeat: " << repeat << std::endl;
+		std::cerr << "    modes: " << modes << std::endl;
+	}
+};
+
+class RPiCamPreviewTestApp : public RPiCamApp
+{
+public:
+	RPiCamPreviewTestApp() : RPiCamApp(std::make_unique<PreviewTestOptions>()) {}
+	PreviewTestOptions *GetOptions() const { return static_cast<PreviewTestOptions *>(options_.get()); }
+};
+
+static RgbImage read_ppm(std::string const &filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	std::string magic;
+	unsigned int max_value;
+	RgbImage image;
+	file >> magic >> image.width >> image.height >> max_value;
+	if (!file || magic != "P6" || max_value != 255)
+		throw std::runtime_error("failed to read PPM file " + filename);
+	file.get(); // the single whitespace character before the pixel data
+	image.data.resize(image.width * image.height * 3);
+	file.read(reinterpret_cast<char *>(image.data.data()), image.data.size());
+	if (!file)
+		throw std::runtime_error("PPM file " + filename + " is truncated");
+	return image;
+}
+
+static void write_ppm(std::string const &filename, RgbImage const &image)
+{
+	std::ofstream file(filename, std::ios::binary);
+	file << "P6\n" << image.width << " " << image.height << "\n255\n";
+	file.write(reinterpret_cast<char const *>(image.data.data()), image.data.size());
+	if (!file)
+		throw std::runtime_error("failed to write PPM file " + filename);
+}
+
+// Returns the number of pixels that differ from the golden image.
+static unsigned int compare(RgbImage const &image, RgbImage const &golden)
+{
+	if (image.width != golden.width || image.height != golden.height)
+		return image.width * image.height;
+	unsigned int differences = 0;
+	for (unsigned int i = 0; i < image.data.size(); i += 3)
+		differences += image.data[i] != golden.data[i] || image.data[i + 1] != golden.data[i + 1] ||
+					   image.data[i + 2] != golden.data[i + 2];
+	return differences;
+}
+
+static int run_tests(RPiCamPreviewTestApp &app)
+{
+	PreviewTestOptions const *options = app.GetOptions();
+	if (options->input.empty())
+		throw std::runtime_error("no input image given");
+	RgbImage input = read_ppm(options->input);
+
+	std::unique_ptr<Preview> preview(make_preview(options));
+	int failures = 0;
+	for (unsigned int mode = 0; mode < options->modes; mode++)
+	{
+		RgbImage output;
+		double time_taken = preview->RenderImage(input, mode, options->repeat, output);
+		std::string name = "mode" + std::to_string(mode) + ".ppm";
+
+		std::cerr << "Mode " << mode << ": ";
+		if (time_taken >= 0)
+			std::cerr << time_taken << "ms GPU time";
+		else
+			std::cerr << "no GPU timer";
+
+		if (!options->output_dir.empty())
+			write_ppm(options->output_dir + "/" + name, output);
+		if (!options->golden_dir.empty())
+		{
+			unsigned int differences = compare(output, read_ppm(options->golden_dir + "/" + name));
+			if (differences)
+			{
+				std::cerr << ", " << differences << " pixels differ from golden image";
+				failures++;
+			}
+			else
+				std::cerr << ", matches golden image";
+		}
+		std::cerr << std::endl;
+	}
+
+	return failures ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamPreviewTestApp app;
+		PreviewTestOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->verbose >= 2)
+				options->Print();
+
+			return run_tests(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
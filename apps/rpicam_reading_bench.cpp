@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rpicam_reading_bench.cpp - run the reading aids' image analysis on a recorded frame.
+ */
+
+// Example: rpicam-reading-bench --input page.yuv --width 320 --height 240 --roi 0.5,0,0.5,1 --overview
+//
+// No camera is needed. The input is a YUV420 frame, such as rpicam-vid writes with "--codec
+// yuv420" (choose a width that is a multiple of 64 so that there is no padding), standing in
+// for the low resolution stream. The --roi and --overview options say what would be on the
+// display, as they do for the camera, and the stages' analysis of that part of the frame is
+// printed.
+
+#include <fstream>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+#include "core/options.hpp"
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/luma_threshold.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/text_line_finder.hpp"
+
+using Rectangle = libcamera::Rectangle;
+
+struct ReadingBenchOptions : public Options
+{
+	ReadingBenchOptions() : Options()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("input", value<std::string>(&input), "YUV420 frame to analyse")
+			("method", value<std::string>(&method)->default_value("otsu"), "Threshold method, otsu or percentile")
+			;
+	}
+
+	std::string input;
+	std::string method;
+
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    input: " << input << std::endl;
+		std::cerr << "    method: " << method << std::endl;
+	}
+};
+
+class RPiCamReadingBenchApp : public RPiCamApp
+{
+public:
+	RPiCamReadingBenchApp() : RPiCamApp(std::make_unique<ReadingBenchOptions>()) {}
+	ReadingBenchOptions *GetOptions() const { return static_cast<ReadingBenchOptions *>(options_.get()); }
+};
+
+static int run_bench(RPiCamReadingBenchApp &app)
+{
+	ReadingBenchOptions const *options = app.GetOptions();
+	if (options->input.empty())
+		throw std::runtime_error("no input file given");
+	if (!options->width || !options->height)
+		throw std::runtime_error("the frame width and height must be given");
+	if (options->method != "otsu" && options->method != "percentile")
+		throw std::runtime_error("unknown method " + options->method);
+
+	std::ifstream file(options->input, std::ios::binary);
+	std::vector<uint8_t> frame(options->width * options->height * 3 / 2);
+	if (!file.read(reinterpret_cast<char *>(frame.data()), frame.size()))
+		throw std::runtime_error("failed to read a frame from " + options->input);
+
+	// Stand in for the sensor with a full field of view the size of the frame. The camera's
+	// crop is the --roi, which the lores stream shares unless there's an --overview.
+	Rectangle full(0, 0, options->width, options->height);
+	float shown[4] = { 0, 0, 1, 1 };
+	if (options->roi_width && options->roi_height)
+	{
+		shown[0] = options->roi_x, shown[1] = options->roi_y;
+		shown[2] = options->roi_width, shown[3] = options->roi_height;
+	}
+	Rectangle crop(shown[0] * full.width, shown[1] * full.height, shown[2] * full.width, shown[3] * full.height);
+	float region[4];
+	PostProcessingStage::MapRegion(shown, full, options->overview ? full : crop, region);
+	std::cerr << "Region: " << region[0] << " " << region[1] << " " << region[2] << " " << region[3] << std::endl;
+
+	LumaThreshold::Config config;
+	config.otsu = options->method == "otsu";
+	LumaThreshold threshold(config);
+	threshold.Configure(options->width, options->height, options->width);
+	std::cerr << "Threshold: " << threshold.Find(frame.data(), region) << std::endl;
+
+	TextLineFinder finder;
+	finder.Configure(options->width, options->height, options->width);
+	std::cerr << "Lines:";
+	for (float line : finder.Find(frame.data(), region))
+		std::cerr << " " << line;
+	std::cerr << std::endl;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamReadingBenchApp app;
+		ReadingBenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->verbose >= 2)
+				options->Print();
+
+			return run_bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rpicam_stabilise_bench.cpp - time the stabiliser's motion estimation on recorded frames.
+ */
+
+// Example: rpicam-stabilise-bench --input frames.yuv --width 320 --height 240
+//
+// No camera is needed. The input is a file of YUV420 frames, such as rpicam-vid writes with
+// "--codec yuv420" (choose a width that is a multiple of 64 so that there is no padding).
+// The motion measured between each pair of frames is printed, followed by the average time
+// the estimate took.
+
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+#include "core/options.hpp"
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/motion_estimator.hpp"
+
+struct StabiliseBenchOptions : public Options
+{
+	StabiliseBenchOptions() : Options()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("input", value<std::string>(&input), "File of YUV420 frames to measure")
+			("search", value<int>(&search)->default_value(12), "Search range in decimated pixels")
+			("decimate", value<unsigned int>(&decimate)->default_value(2), "Factor to reduce the frames by first")
+			;
+	}
+
+	std::string input;
+	int search;
+	unsigned int decimate;
+
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    input: " << input << std::endl;
+		std::cerr << "    search: " << search << std::endl;
+		std::cerr << "    decimate: " << decimate << std::endl;
+	}
+};
+
+class RPiCamStabiliseBenchApp : public RPiCamApp
+{
+public:
+	RPiCamStabiliseBenchApp() : RPiCamApp(std::make_unique<StabiliseBenchOptions>()) {}
+	StabiliseBenchOptions *GetOptions() const { return static_cast<StabiliseBenchOptions *>(options_.get()); }
+};
+
+static int run_bench(RPiCamStabiliseBenchApp &app)
+{
+	StabiliseBenchOptions const *options = app.GetOptions();
+	if (options->input.empty())
+		throw std::runtime_error("no input file given");
+	if (!options->width || !options->height)
+		throw std::runtime_error("the frame width and height must be given");
+
+	std::ifstream file(options->input, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("failed to open " + options->input);
+
+	MotionEstimator::Config config;
+	config.search = options->search;
+	config.decimate = options->decimate;
+	MotionEstimator estimator(config);
+	estimator.Configure(options->width, options->height, options->width);
+
+	std::vector<uint8_t> frame(options->width * options->height * 3 / 2);
+	unsigned int frames = 0;
+	double time_taken = 0;
+	while (file.read(reinterpret_cast<char *>(frame.data()), frame.size()))
+	{
+		float dx, dy;
+		auto start = std::chrono::steady_clock::now();
+		bool found = estimator.Estimate(frame.data(), dx, dy);
+		time_taken += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (frames++)
+		{
+			std::cerr << "Frame " << frames - 1 << ": ";
+			if (found)
+				std::cerr << dx << " " << dy << std::endl;
+			else
+				std::cerr << "no estimate" << std::endl;
+		}
+	}
+
+	if (!frames)
+		throw std::runtime_error("no frames in " + options->input);
+	std::cerr << "Average time: " << time_taken / frames << "ms per frame" << std::endl;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamStabiliseBenchApp app;
+		StabiliseBenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->verbose >= 2)
+				options->Print();
+
+			return run_bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
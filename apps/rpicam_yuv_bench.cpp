@@ -0,0 +1,374 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rpicam_yuv_bench.cpp - time the YUV420 to RGB conversion and check it against the original.
+ */
+
+// Example: rpicam-yuv-bench --width 1920 --height 1080 --repeat 50
+//
+// No camera is needed. A random YUV420 image of the given size (1920x1080 if none is given)
+// is converted to RGB in a few different ways: the whole image, a centre crop, a small crop
+// such as the TFLite stages take, and the whole image scaled down. Each case prints the
+// speed of the original floating point conversion and of the new one in Mpix/s, and the
+// largest difference between their outputs. The scaled case has no original to time, so it
+// is compared with the nearest pixels of the original's full size output. Any difference of
+// more than one is an error.
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "core/options.hpp"
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+struct YuvBenchOptions : public Options
+{
+	YuvBenchOptions() : Options()
+	{
+		using namespace boost::program_options;
+		options_.add_options()
+			("repeat", value<unsigned int>(&repeat)->default_value(20), "Number of times to time each conversion")
+			;
+	}
+
+	unsigned int repeat;
+
+	virtual void Print() const override
+	{
+		Options::Print();
+		std::cerr << "    repeat: " << repeat << std::endl;
+	}
+};
+
+class RPiCamYuvBenchApp : public RPiCamApp
+{
+public:
+	RPiCamYuvBenchApp() : RPiCamApp(std::make_unique<YuvBenchOptions>()) {}
+	YuvBenchOptions *GetOptions() const { return static_cast<YuvBenchOptions *>(options_.get()); }
+};
+
+// The conversion as it was before it went fixed point, to compare with.
+static std::vector<uint8_t> original_yuv420_to_rgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
+{
+	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
+
+	assert(src_info.width >= dst_info.width && src_info.height >= dst_info.height);
+	int off_x = ((src_info.width - dst_info.width) / 2) & ~1, off_y = ((src_info.height - dst_info.height) / 2) & ~1;
+	int src_Y_size = src_info.height * src_info.stride, src_U_size = (src_info.height / 2) * (src_info.stride / 2);
+
+	// We're going to process 4x2 pixel blocks, as far as alignment allows.
+	unsigned int dst_h_aligned = dst_info.height & ~1, dst_w_aligned = dst_info.width & ~3;
+
+	unsigned int y = 0;
+	for (; y < dst_h_aligned; y += 2)
+	{
+		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
+		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
+		const uint8_t *src_V = src_U + src_U_size;
+		const uint8_t *src_Y1 = src_Y0 + src_info.stride;
+		uint8_t *dst0 = &output[y * dst_info.stride];
+		uint8_t *dst1 = dst0 + dst_info.stride;
+
+		unsigned int x = 0;
+		for (; x < dst_w_aligned; x += 4)
+		{
+			int Y0 = *(src_Y0++);
+			int U0 = *(src_U++);
+			int V0 = *(src_V++);
+			int Y1 = *(src_Y0++);
+			int Y2 = *(src_Y0++);
+			int U2 = *(src_U++);
+			int V2 = *(src_V++);
+			int Y3 = *(src_Y0++);
+			int Y4 = *(src_Y1++);
+			int Y5 = *(src_Y1++);
+			int Y6 = *(src_Y1++);
+			int Y7 = *(src_Y1++);
+
+			U0 -= 128;
+			V0 -= 128;
+			U2 -= 128;
+			V2 -= 128;
+			int U1 = U0;
+			int V1 = V0;
+			int U4 = U0;
+			int V4 = V0;
+			int U5 = U0;
+			int V5 = V0;
+			int U3 = U2;
+			int V3 = V2;
+			int U6 = U2;
+			int V6 = V2;
+			int U7 = U2;
+			int V7 = V2;
+
+			int R0 = Y0 + 1.402 * V0;
+			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
+			int B0 = Y0 + 1.771 * U0;
+			int R1 = Y1 + 1.402 * V1;
+			int G1 = Y1 - 0.345 * U1 - 0.714 * V1;
+			int B1 = Y1 + 1.771 * U1;
+			int R2 = Y2 + 1.402 * V2;
+			int G2 = Y2 - 0.345 * U2 - 0.714 * V2;
+			int B2 = Y2 + 1.771 * U2;
+			int R3 = Y3 + 1.402 * V3;
+			int G3 = Y3 - 0.345 * U3 - 0.714 * V3;
+			int B3 = Y3 + 1.771 * U3;
+			int R4 = Y4 + 1.402 * V4;
+			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
+			int B4 = Y4 + 1.771 * U4;
+			int R5 = Y5 + 1.402 * V5;
+			int G5 = Y5 - 0.345 * U5 - 0.714 * V5;
+			int B5 = Y5 + 1.771 * U5;
+			int R6 = Y6 + 1.402 * V6;
+			int G6 = Y6 - 0.345 * U6 - 0.714 * V6;
+			int B6 = Y6 + 1.771 * U6;
+			int R7 = Y7 + 1.402 * V7;
+			int G7 = Y7 - 0.345 * U7 - 0.714 * V7;
+			int B7 = Y7 + 1.771 * U7;
+
+			R0 = std::clamp(R0, 0, 255);
+			G0 = std::clamp(G0, 0, 255);
+			B0 = std::clamp(B0, 0, 255);
+			R1 = std::clamp(R1, 0, 255);
+			G1 = std::clamp(G1, 0, 255);
+			B1 = std::clamp(B1, 0, 255);
+			R2 = std::clamp(R2, 0, 255);
+			G2 = std::clamp(G2, 0, 255);
+			B2 = std::clamp(B2, 0, 255);
+			R3 = std::clamp(R3, 0, 255);
+			G3 = std::clamp(G3, 0, 255);
+			B3 = std::clamp(B3, 0, 255);
+			R4 = std::clamp(R4, 0, 255);
+			G4 = std::clamp(G4, 0, 255);
+			B4 = std::clamp(B4, 0, 255);
+			R5 = std::clamp(R5, 0, 255);
+			G5 = std::clamp(G5, 0, 255);
+			B5 = std::clamp(B5, 0, 255);
+			R6 = std::clamp(R6, 0, 255);
+			G6 = std::clamp(G6, 0, 255);
+			B6 = std::clamp(B6, 0, 255);
+			R7 = std::clamp(R7, 0, 255);
+			G7 = std::clamp(G7, 0, 255);
+			B7 = std::clamp(B7, 0, 255);
+
+			*(dst0++) = R0;
+			*(dst0++) = G0;
+			*(dst0++) = B0;
+			*(dst0++) = R1;
+			*(dst0++) = G1;
+			*(dst0++) = B1;
+			*(dst0++) = R2;
+			*(dst0++) = G2;
+			*(dst0++) = B2;
+			*(dst0++) = R3;
+			*(dst0++) = G3;
+			*(dst0++) = B3;
+			*(dst1++) = R4;
+			*(dst1++) = G4;
+			*(dst1++) = B4;
+			*(dst1++) = R5;
+			*(dst1++) = G5;
+			*(dst1++) = B5;
+			*(dst1++) = R6;
+			*(dst1++) = G6;
+			*(dst1++) = B6;
+			*(dst1++) = R7;
+			*(dst1++) = G7;
+			*(dst1++) = B7;
+		}
+		// Straggling pixel columns - we must still do both rows.
+		for (; x < dst_info.width; x++)
+		{
+			int Y0 = *(src_Y0++);
+			int U0 = *(src_U);
+			int V0 = *(src_V);
+			int Y4 = *(src_Y1++);
+			src_U += (x & 1);
+			src_V += (x & 1);
+
+			U0 -= 128;
+			V0 -= 128;
+			int U4 = U0;
+			int V4 = V0;
+
+			int R0 = Y0 + 1.402 * V0;
+			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
+			int B0 = Y0 + 1.771 * U0;
+			int R4 = Y4 + 1.402 * V4;
+			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
+			int B4 = Y4 + 1.771 * U4;
+
+			R0 = std::clamp(R0, 0, 255);
+			G0 = std::clamp(G0, 0, 255);
+			B0 = std::clamp(B0, 0, 255);
+			R4 = std::clamp(R4, 0, 255);
+			G4 = std::clamp(G4, 0, 255);
+			B4 = std::clamp(B4, 0, 255);
+
+			*(dst0++) = R0;
+			*(dst0++) = G0;
+			*(dst0++) = B0;
+			*(dst1++) = R4;
+			*(dst1++) = G4;
+			*(dst1++) = B4;
+		}
+	}
+	// Any straggling final row is done with extreme steam power.
+	for (; y < dst_info.height; y++)
+	{
+		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
+		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
+		const uint8_t *src_V = src_U + src_U_size;
+		uint8_t *dst0 = &output[y * dst_info.stride];
+
+		unsigned int x = 0;
+		for (; x < dst_info.width; x++)
+		{
+			int Y0 = *(src_Y0++);
+			int U0 = *(src_U);
+			int V0 = *(src_V);
+			src_U += (x & 1);
+			src_V += (x & 1);
+
+			U0 -= 128;
+			V0 -= 128;
+
+			int R0 = Y0 + 1.402 * V0;
+			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
+			int B0 = Y0 + 1.771 * U0;
+
+			R0 = std::clamp(R0, 0, 255);
+			G0 = std::clamp(G0, 0, 255);
+			B0 = std::clamp(B0, 0, 255);
+
+			*(dst0++) = R0;
+			*(dst0++) = G0;
+			*(dst0++) = B0;
+		}
+	}
+
+	return output;
+}
+
+static StreamInfo rgb_info(unsigned int width, unsigned int height)
+{
+	StreamInfo info;
+	info.width = width, info.height = height, info.stride = width * 3;
+	return info;
+}
+
+template <typename F>
+static double mpix_per_second(F &&f, StreamInfo const &dst_info, unsigned int repeat)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < repeat; i++)
+		f();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return dst_info.width * dst_info.height * repeat / (seconds * 1e6);
+}
+
+static int max_difference(std::vector<uint8_t> const &a, std::vector<uint8_t> const &b)
+{
+	int difference = 0;
+	for (unsigned int i = 0; i < a.size(); i++)
+		difference = std::max(difference, std::abs(a[i] - b[i]));
+	return difference;
+}
+
+static void report(char const *name, StreamInfo const &dst_info, double original, double converted, int difference)
+{
+	std::cerr << name << ": " << dst_info.width << "x" << dst_info.height << " original ";
+	if (original)
+		std::cerr << original << " Mpix/s";
+	else
+		std::cerr << "-";
+	std::cerr << ", new " << converted << " Mpix/s, max difference " << difference << std::endl;
+	if (difference > 1)
+		throw std::runtime_error(std::string(name) + " conversion differs from the original by " +
+								 std::to_string(difference));
+}
+
+static int run_bench(RPiCamYuvBenchApp &app)
+{
+	YuvBenchOptions const *options = app.GetOptions();
+	StreamInfo src_info;
+	src_info.width = options->width ? options->width : 1920;
+	src_info.height = options->height ? options->height : 1080;
+	src_info.stride = src_info.width;
+	if (src_info.width % 2 || src_info.height % 2 || src_info.width < 320 || src_info.height < 240)
+		throw std::runtime_error("the image must be at least 320x240, with an even width and height");
+	unsigned int repeat = std::max(options->repeat, 1u);
+
+	std::mt19937 random(0);
+	std::vector<uint8_t> src(src_info.stride * src_info.height * 3 / 2);
+	for (auto &value : src)
+		value = random();
+
+	struct Case
+	{
+		char const *name;
+		StreamInfo dst_info;
+	} cases[] = {
+		{ "full", rgb_info(src_info.width, src_info.height) },
+		{ "centre crop", rgb_info(src_info.width / 2 + 1, src_info.height / 2 + 1) },
+		{ "tflite", rgb_info(300, 224) },
+	};
+	for (auto &c : cases)
+	{
+		std::vector<uint8_t> original = original_yuv420_to_rgb(src.data(), src_info, c.dst_info);
+		std::vector<uint8_t> converted(c.dst_info.height * c.dst_info.stride);
+		PostProcessingStage::Yuv420ToRgb(converted.data(), c.dst_info, src.data(), src_info);
+
+		double original_speed = mpix_per_second(
+			[&]() { original_yuv420_to_rgb(src.data(), src_info, c.dst_info); }, c.dst_info, repeat);
+		double speed = mpix_per_second(
+			[&]() { PostProcessingStage::Yuv420ToRgb(converted.data(), c.dst_info, src.data(), src_info); },
+			c.dst_info, repeat);
+		report(c.name, c.dst_info, original_speed, speed, max_difference(original, converted));
+	}
+
+	// Scale the whole image to half the width and height, which should pick every other pixel.
+	StreamInfo full_info = rgb_info(src_info.width, src_info.height);
+	std::vector<uint8_t> full = original_yuv420_to_rgb(src.data(), src_info, full_info);
+	StreamInfo dst_info = rgb_info(src_info.width / 2, src_info.height / 2);
+	std::vector<uint8_t> scaled(dst_info.height * dst_info.stride), expected(scaled.size());
+	libcamera::Rectangle crop(0, 0, src_info.width, src_info.height);
+	PostProcessingStage::Yuv420ToRgb(scaled.data(), dst_info, src.data(), src_info, crop);
+	for (unsigned int y = 0; y < dst_info.height; y++)
+		for (unsigned int x = 0; x < dst_info.width; x++)
+			std::copy_n(&full[(2 * y + 1) * full_info.stride + (2 * x + 1) * 3], 3,
+						&expected[y * dst_info.stride + x * 3]);
+	double speed = mpix_per_second(
+		[&]() { PostProcessingStage::Yuv420ToRgb(scaled.data(), dst_info, src.data(), src_info, crop); }, dst_info,
+		repeat);
+	report("scaled", dst_info, 0, speed, max_difference(expected, scaled));
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamYuvBenchApp app;
+		YuvBenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->verbose >= 2)
+				options->Print();
+
+			return run_bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
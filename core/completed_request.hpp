@@ -12,6 +12,7 @@
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
 
+#include "core/image_cache.hpp"
 #include "core/metadata.hpp"
 
 struct CompletedRequest
@@ -31,6 +32,7 @@ struct CompletedRequest
 	Request *request;
 	float framerate;
 	Metadata post_process_metadata;
+	ImageCache image_cache;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
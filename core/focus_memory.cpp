@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * focus_memory.cpp - remember where the lens settles at each zoom
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "core/focus_memory.hpp"
+#include "core/logging.hpp"
+#include "core/settings_store.hpp"
+
+// Lens positions beyond these (in dioptres) count as close up (under a third of a metre), or
+// across a table (up to a metre). Anything less is across the room.
+static const float NEAR_POSITION = 3.0;
+static const float MID_POSITION = 1.0;
+// No lens we know of goes beyond this.
+static const float MAX_POSITION = 32.0;
+// Autofocus wanders about a little even once it has settled, which isn't worth writing down.
+static const float TOLERANCE = 0.1;
+
+FocusMemory::FocusMemory(SettingsStore *store) : store_(store)
+{
+	if (!store_)
+		return;
+	for (int band = 0; band <= MAX_BAND; band++)
+	{
+		for (int distance = 0; distance < DISTANCES; distance++)
+		{
+			float position = store_->Get(name(band, distance), -1, 0, MAX_POSITION);
+			if (position >= 0)
+				positions_[{ band, distance }] = position;
+		}
+	}
+	LOG(2, "FocusMemory: " << positions_.size() << " lens positions remembered");
+}
+
+int FocusMemory::Band(float zoom)
+{
+	if (!(zoom > 0))
+		return 0;
+	return std::clamp((int)std::lround(-std::log2(zoom * zoom) * 4), 0, MAX_BAND);
+}
+
+int FocusMemory::Distance(float lens_position)
+{
+	if (lens_position >= NEAR_POSITION)
+		return 2;
+	return lens_position >= MID_POSITION ? 1 : 0;
+}
+
+bool FocusMemory::Seed(int band, float lens_position, float &seed) const
+{
+	auto it = positions_.find({ band, Distance(lens_position) });
+	if (it == positions_.end())
+		return false;
+	seed = it->second;
+	return true;
+}
+
+void FocusMemory::Converged(int band, float lens_position)
+{
+	if (!(lens_position >= 0 && lens_position <= MAX_POSITION))
+		return;
+	int distance = Distance(lens_position);
+	auto [it, added] = positions_.insert({ { band, distance }, lens_position });
+	if (!added && std::abs(it->second - lens_position) <= TOLERANCE)
+		return;
+	it->second = lens_position;
+	LOG(2, "FocusMemory: lens settled at " << lens_position << " in zoom band " << band);
+	if (store_)
+		store_->Set(name(band, distance), lens_position);
+}
+
+std::string FocusMemory::name(int band, int distance)
+{
+	return "focus_" + std::to_string(band) + "_" + std::to_string(distance);
+}
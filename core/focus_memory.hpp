@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * focus_memory.hpp - remember where the lens settles at each zoom
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+
+class SettingsStore;
+
+// Continuous autofocus starts its search from wherever the lens happens to be, so every zoom
+// step can set it hunting. Instead we remember the lens position (in dioptres) that it last
+// settled on for each band of zoom levels and each rough distance (things close up, across
+// a table, or across a room), and start the lens there when the zoom moves into a new band.
+// The distance is judged from where the lens is before the zoom changes, which tells us
+// what the user was looking at.
+
+// The positions are kept in the SettingsStore, if given, so they're still there next time.
+
+class FocusMemory
+{
+public:
+	explicit FocusMemory(SettingsStore *store = nullptr);
+
+	// The band for a zoom setting, as the application has it: the camera crops the full field
+	// of view down to zoom squared of its width and height. There are four bands to each
+	// doubling of the magnification.
+	static int Band(float zoom);
+	// Which of the distances a lens position suggests we're looking at.
+	static int Distance(float lens_position);
+
+	// Finds the position to start the lens from on moving to the given band. Returns false
+	// if we've nothing to go on.
+	bool Seed(int band, float lens_position, float &seed) const;
+	// Remember where autofocus settled at this band, unless it's much where it was before.
+	void Converged(int band, float lens_position);
+
+private:
+	static constexpr int MAX_BAND = 20;
+	static constexpr int DISTANCES = 3;
+	static std::string name(int band, int distance);
+
+	SettingsStore *store_;
+	std::map<std::pair<int, int>, float> positions_;
+};
@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * gpio_input.cpp - rotary encoder knobs read from a GPIO character device
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/gpio.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/gpio_input.hpp"
+#include "core/logging.hpp"
+
+GpioInput::GpioInput(Config const &config, InputEvents &events)
+	: events_(events), source_(events.AddSource()), fd_(-1), abort_(false)
+{
+	for (unsigned int i = 0; i < config.knobs.size(); i++)
+	{
+		Knob const &knob = config.knobs[i];
+		offsets_.push_back(knob.a);
+		lines_.push_back({ i, ENCODER_A });
+		offsets_.push_back(knob.b);
+		lines_.push_back({ i, ENCODER_B });
+		if (knob.button >= 0)
+		{
+			offsets_.push_back(knob.button);
+			lines_.push_back({ i, BUTTON });
+		}
+	}
+	if (offsets_.empty() || offsets_.size() > GPIO_V2_LINES_MAX)
+		throw std::runtime_error("GpioInput: bad number of GPIO lines");
+
+	int chip_fd = open(config.chip.c_str(), O_RDONLY | O_CLOEXEC);
+	if (chip_fd < 0)
+		throw std::runtime_error("GpioInput: failed to open " + config.chip);
+
+	// The encoders and buttons all connect their pins to ground, so they need pulling up.
+	gpio_v2_line_request request = {};
+	for (unsigned int i = 0; i < offsets_.size(); i++)
+		request.offsets[i] = offsets_[i];
+	request.num_lines = offsets_.size();
+	uint64_t all_lines = offsets_.size() == 64 ? ~0ULL : (1ULL << offsets_.size()) - 1;
+	strncpy(request.consumer, "rpicam-apps", sizeof(request.consumer) - 1);
+	request.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING |
+						   GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+	if (config.debounce_us)
+	{
+		request.config.num_attrs = 1;
+		request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		request.config.attrs[0].attr.debounce_period_us = config.debounce_us;
+		request.config.attrs[0].mask = all_lines;
+	}
+	int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &request);
+	close(chip_fd);
+	if (ret < 0)
+		throw std::runtime_error("GpioInput: failed to request lines from " + config.chip + ": " + strerror(errno));
+	fd_ = request.fd;
+
+	// Start the encoders from wherever they're resting.
+	gpio_v2_line_values values = {};
+	values.mask = all_lines;
+	if (ioctl(fd_, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("GpioInput: failed to read GPIO lines");
+	}
+	std::vector<int> levels(config.knobs.size() * 2, 1);
+	for (unsigned int i = 0; i < lines_.size(); i++)
+	{
+		if (lines_[i].role != BUTTON)
+			levels[lines_[i].knob * 2 + lines_[i].role] = (values.bits >> i) & 1;
+	}
+	for (unsigned int i = 0; i < config.knobs.size(); i++)
+		encoders_.emplace_back(levels[i * 2 + ENCODER_A], levels[i * 2 + ENCODER_B]);
+
+	LOG(2, "GpioInput: reading " << config.knobs.size() << " knobs from " << config.chip);
+	thread_ = std::thread(&GpioInput::readEvents, this);
+}
+
+GpioInput::~GpioInput()
+{
+	abort_ = true;
+	thread_.join();
+	close(fd_);
+}
+
+void GpioInput::readEvents()
+{
+	while (!abort_)
+	{
+		// Wake up now and then to see if we're finished.
+		pollfd pfd = { fd_, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		gpio_v2_line_event events[16];
+		ssize_t count = read(fd_, events, sizeof(events));
+		if (count < 0)
+		{
+			LOG_ERROR("WARNING: GpioInput: failed to read GPIO events");
+			return;
+		}
+
+		for (unsigned int i = 0; i < count / sizeof(gpio_v2_line_event); i++)
+		{
+			unsigned int index = 0;
+			while (index < offsets_.size() && offsets_[index] != events[i].offset)
+				index++;
+			if (index == offsets_.size())
+				continue;
+			// The kernel's timestamps are CLOCK_MONOTONIC, which is what steady_clock uses.
+			std::chrono::steady_clock::time_point timestamp{ std::chrono::nanoseconds(events[i].timestamp_ns) };
+			lineChanged(lines_[index], events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE, timestamp);
+		}
+	}
+}
+
+void GpioInput::lineChanged(Line const &line, int level, std::chrono::steady_clock::time_point timestamp)
+{
+	// The buttons read low while they're held.
+	if (line.role == BUTTON)
+	{
+		events_.Post(source_, level ? InputEvent::RELEASE : InputEvent::PRESS, line.knob, 0, timestamp);
+		return;
+	}
+
+	int inc = encoders_[line.knob].Changed(line.role == ENCODER_B, level);
+	if (inc)
+		events_.Post(source_, InputEvent::TURN, line.knob, inc, timestamp);
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * gpio_input.hpp - rotary encoder knobs read from a GPIO character device
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/input_events.hpp"
+#include "core/quadrature_decoder.hpp"
+
+// Reads the knobs straight from the kernel's GPIO character device, rather than through
+// the pigpio daemon, so there's no socket in the way and no extra service to run. The
+// lines are requested with edge events and the kernel's debounce, and the encoders are
+// decoded here, reporting every count just like RED_MODE_STEP. Events carry the kernel's
+// timestamp of the edge.
+
+// Works with any GPIO chip, including ones made by the gpio-sim module, so it can be tried
+// out without the real hardware.
+
+class GpioInput
+{
+public:
+	// The GPIO line offsets on the chip of a knob's two encoder pins and its button (-1 if
+	// it doesn't have one). Knobs are numbered as InputEvent controls in the order given.
+	struct Knob
+	{
+		int a, b, button;
+	};
+
+	struct Config
+	{
+		std::string chip; // e.g. /dev/gpiochip0
+		std::vector<Knob> knobs;
+		unsigned int debounce_us = 1000;
+	};
+
+	GpioInput(Config const &config, InputEvents &events);
+	~GpioInput();
+
+private:
+	enum Role
+	{
+		ENCODER_A,
+		ENCODER_B,
+		BUTTON
+	};
+	struct Line
+	{
+		unsigned int knob;
+		Role role;
+	};
+	void readEvents();
+	void lineChanged(Line const &line, int level, std::chrono::steady_clock::time_point timestamp);
+
+	InputEvents &events_;
+	unsigned int source_;
+	std::vector<unsigned int> offsets_;
+	std::vector<Line> lines_;
+	std::vector<QuadratureDecoder> encoders_;
+	int fd_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * image_cache.cpp - share the images that post-processing stages make from a request
+ */
+
+#include "core/image_cache.hpp"
+
+std::atomic<uint64_t> ImageCache::hits_, ImageCache::misses_, ImageCache::bytes_;
+
+ImageCache::Image ImageCache::Get(Key const &key, std::function<void(std::vector<uint8_t> &)> const &make)
+{
+	// Making the image under the lock means a second stage wanting it waits rather than
+	// making another.
+	std::lock_guard<std::recursive_mutex> lock(mutex_);
+	auto it = images_.find(key);
+	if (it != images_.end())
+	{
+		hits_++;
+		return it->second;
+	}
+
+	auto image = std::make_shared<std::vector<uint8_t>>();
+	make(*image);
+	misses_++;
+	bytes_ += image->size();
+	images_[key] = image;
+	return image;
+}
+
+void ImageCache::Clear()
+{
+	std::lock_guard<std::recursive_mutex> lock(mutex_);
+	images_.clear();
+}
+
+ImageCache::Stats ImageCache::GetStats()
+{
+	return { hits_, misses_, bytes_ };
+}
+
+void ImageCache::ResetStats()
+{
+	hits_ = misses_ = bytes_ = 0;
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * image_cache.hpp - share the images that post-processing stages make from a request
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+namespace libcamera
+{
+class Stream;
+}
+
+// Several stages may want the same copy or conversion of a request's image, such as a TFLite
+// stage and a face detector both wanting the low resolution image in ordinary memory. Each
+// CompletedRequest carries one of these, so whichever stage asks first makes the image and
+// the rest get the same one. The post-processor clears it once every stage has seen the
+// request. Stages that carry on using an image after that (from their own threads, say)
+// just keep hold of it.
+
+// Hits, misses and the bytes made are counted over all requests, from when the post-processor
+// starts to when it stops and reports them.
+
+class ImageCache
+{
+public:
+	enum Format
+	{
+		YUV420, // a copy of the whole buffer
+		RGB888, // packed RGB, as PostProcessingStage::Yuv420ToRgb gives
+	};
+
+	struct Key
+	{
+		libcamera::Stream *stream;
+		Format format;
+		unsigned int width, height;
+		libcamera::Rectangle crop;
+		bool operator<(Key const &other) const
+		{
+			return std::tie(stream, format, width, height, crop.x, crop.y, crop.width, crop.height) <
+				   std::tie(other.stream, other.format, other.width, other.height, other.crop.x, other.crop.y,
+							other.crop.width, other.crop.height);
+		}
+	};
+
+	using Image = std::shared_ptr<const std::vector<uint8_t>>;
+
+	// Returns the image for this key, calling make to fill it in if it isn't here yet.
+	Image Get(Key const &key, std::function<void(std::vector<uint8_t> &)> const &make);
+	void Clear();
+
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t bytes;
+	};
+	static Stats GetStats();
+	static void ResetStats();
+
+private:
+	// Recursive, so that making one image can use another from the cache.
+	std::recursive_mutex mutex_;
+	std::map<Key, Image> images_;
+
+	static std::atomic<uint64_t> hits_, misses_, bytes_;
+};
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * input_events.cpp - knob and button events for the application's event loop
+ */
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/input_events.hpp"
+#include "core/logging.hpp"
+
+InputEvents::InputEvents()
+	: num_sources_(0), dropped_(0), dropped_reported_(0), handled_(0), latency_count_(0), latency_total_ms_(0),
+	  latency_max_ms_(0), report_handled_(0)
+{
+}
+
+unsigned int InputEvents::AddSource()
+{
+	unsigned int source = num_sources_;
+	if (source == MAX_SOURCES)
+		throw std::runtime_error("InputEvents: too many input sources");
+	num_sources_ = source + 1;
+	return source;
+}
+
+void InputEvents::Post(unsigned int source, InputEvent::Type type, unsigned int control, int steps,
+					   std::chrono::steady_clock::time_point timestamp)
+{
+	InputEvent event = { type, control, steps, timestamp };
+	if (!queues_[source].Push(event))
+		dropped_++;
+}
+
+bool InputEvents::Next(InputEvent &event)
+{
+	unsigned int dropped = dropped_;
+	if (dropped != dropped_reported_)
+	{
+		LOG_ERROR("WARNING: InputEvents: " << dropped - dropped_reported_ << " input events dropped");
+		dropped_reported_ = dropped;
+	}
+
+	// Take whichever source's oldest event happened first.
+	SpscQueue<InputEvent, 256> *oldest = nullptr;
+	for (unsigned int i = 0; i < num_sources_; i++)
+	{
+		InputEvent const *front = queues_[i].Front();
+		if (front && (!oldest || front->timestamp < oldest->Front()->timestamp))
+			oldest = &queues_[i];
+	}
+	return oldest && oldest->Pop(event);
+}
+
+void InputEvents::Handled(InputEvent const &event)
+{
+	pending_.push_back({ ++handled_, event });
+	// A preview that doesn't report what it shows would let these pile up forever.
+	if (pending_.size() > 256)
+		pending_.pop_front();
+}
+
+void InputEvents::Presented(uint64_t handled_count, std::chrono::steady_clock::time_point time)
+{
+	while (!pending_.empty() && pending_.front().sequence <= handled_count)
+	{
+		InputEvent const &event = pending_.front().event;
+		double latency_ms = std::chrono::duration<double, std::milli>(time - event.timestamp).count();
+		LOG(2, "InputEvents: input to display " << latency_ms << "ms");
+		if (report_.is_open())
+		{
+			static char const *names[] = { "turn", "press", "release" };
+			double event_ms = std::chrono::duration<double, std::milli>(event.timestamp - report_start_).count();
+			report_ << "{ \"time\": " << event_ms << ", \"event\": \"" << names[event.type] << "\", \"control\": "
+					<< event.control << ", \"steps\": " << event.steps << ", \"latency\": " << latency_ms << " }"
+					<< std::endl;
+			report_latencies_.push_back(latency_ms);
+		}
+		pending_.pop_front();
+
+		latency_total_ms_ += latency_ms;
+		latency_max_ms_ = std::max(latency_max_ms_, latency_ms);
+		if (++latency_count_ == 50)
+		{
+			LOG(1, "InputEvents: input to display " << latency_total_ms_ / latency_count_ << "ms average, "
+													<< latency_max_ms_ << "ms worst");
+			latency_count_ = 0;
+			latency_total_ms_ = latency_max_ms_ = 0;
+		}
+	}
+}
+
+void InputEvents::StartReport(std::string const &filename)
+{
+	report_.open(filename, std::ios::trunc);
+	if (!report_)
+		throw std::runtime_error("InputEvents: failed to open report file " + filename);
+	report_start_ = std::chrono::steady_clock::now();
+	report_handled_ = handled_;
+}
+
+void InputEvents::FinishReport()
+{
+	if (!report_.is_open())
+		return;
+
+	// Any events that never reached the display show up as the difference between the
+	// number handled and the number seen.
+	std::vector<double> &latencies = report_latencies_;
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (double latency : latencies)
+		total += latency;
+	auto percentile = [&latencies](double p) { return latencies[(size_t)(p * (latencies.size() - 1) + 0.5)]; };
+	report_ << "{ \"summary\": { \"events\": " << handled_ - report_handled_ << ", \"seen\": " << latencies.size();
+	if (!latencies.empty())
+		report_ << ", \"mean\": " << total / latencies.size() << ", \"median\": " << percentile(0.5)
+				<< ", \"p95\": " << percentile(0.95) << ", \"max\": " << latencies.back();
+	report_ << " } }" << std::endl;
+	report_.close();
+
+	if (!latencies.empty())
+		LOG(1, "InputEvents: " << latencies.size() << " events, input to display " << total / latencies.size()
+							   << "ms average, " << percentile(0.95) << "ms 95th percentile, " << latencies.back()
+							   << "ms worst");
+}
+
+KeyboardInput::KeyboardInput(InputEvents &events)
+	: events_(events), source_(events.AddSource()), held_{ false, false }, abort_(false)
+{
+	if (isatty(STDIN_FILENO))
+		thread_ = std::thread(&KeyboardInput::readKeys, this);
+}
+
+KeyboardInput::~KeyboardInput()
+{
+	abort_ = true;
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void KeyboardInput::readKeys()
+{
+	while (!abort_)
+	{
+		// Wake up now and then to see if we're finished.
+		pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		char keys[64];
+		ssize_t count = read(STDIN_FILENO, keys, sizeof(keys));
+		if (count <= 0)
+			return;
+
+		for (ssize_t i = 0; i < count; i++)
+		{
+			switch (keys[i])
+			{
+			case 'a':
+			case 'j':
+				events_.Post(source_, InputEvent::TURN, keys[i] == 'j', -InputEvent::STEPS_PER_DETENT);
+				break;
+			case 'd':
+			case 'l':
+				events_.Post(source_, InputEvent::TURN, keys[i] == 'l', InputEvent::STEPS_PER_DETENT);
+				break;
+			case 's':
+			case 'k':
+			{
+				unsigned int control = keys[i] == 'k';
+				held_[control] = !held_[control];
+				events_.Post(source_, held_[control] ? InputEvent::PRESS : InputEvent::RELEASE, control);
+				break;
+			}
+			}
+		}
+	}
+}
+
+InputScript::InputScript(std::string const &filename, InputEvents &events)
+	: events_(events), source_(events.AddSource()), finished_(false), abort_(false)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::runtime_error("InputScript: failed to open " + filename);
+
+	std::string line;
+	for (unsigned int number = 1; std::getline(file, line); number++)
+	{
+		std::istringstream stream(line.substr(0, line.find('#')));
+		unsigned int ms;
+		std::string type;
+		if (!(stream >> ms))
+		{
+			if (!stream.eof())
+				throw std::runtime_error("InputScript: bad time at line " + std::to_string(number) + " of " + filename);
+			continue;
+		}
+
+		Step step = { std::chrono::milliseconds(ms), InputEvent::TURN, 0, 0 };
+		bool ok = static_cast<bool>(stream >> type >> step.control);
+		if (type == "turn")
+			ok = ok && stream >> step.steps;
+		else if (type == "press")
+			step.type = InputEvent::PRESS;
+		else if (type == "release")
+			step.type = InputEvent::RELEASE;
+		else
+			ok = false;
+		if (!ok || (!steps_.empty() && step.time < steps_.back().time))
+			throw std::runtime_error("InputScript: bad event at line " + std::to_string(number) + " of " + filename);
+		steps_.push_back(step);
+	}
+	LOG(2, "InputScript: " << steps_.size() << " events in " << filename);
+}
+
+InputScript::~InputScript()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_.notify_one();
+	}
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void InputScript::Start()
+{
+	if (!thread_.joinable())
+		thread_ = std::thread(&InputScript::play, this);
+}
+
+void InputScript::play()
+{
+	auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (Step const &step : steps_)
+	{
+		auto time = start + step.time;
+		if (cond_.wait_until(lock, time, [this] { return abort_; }))
+			return;
+		events_.Post(source_, step.type, step.control, step.steps, time);
+	}
+	finished_ = true;
+}
@@ -0,0 +1,162 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * input_events.hpp - knob and button events for the application's event loop
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/spsc_queue.hpp"
+
+// Input devices (GPIO knobs, the keyboard) post timestamped events from their own threads,
+// and the application's event loop takes them all in one place, so that only that thread
+// ever changes the settings they control. Each thread that posts gets its own lock-free
+// queue, so posting never waits.
+
+// The event loop also tells us which events each frame it shows is the first to include,
+// and the preview reports when that frame reached the display, which gives the time from
+// each user action to its effect being seen.
+
+struct InputEvent
+{
+	// Knobs report every count from their encoders, so a turn can be acted on before it
+	// reaches the next detent.
+	static constexpr int STEPS_PER_DETENT = 2;
+
+	enum Type
+	{
+		TURN, // a knob turned by "steps" counts, positive clockwise
+		PRESS, // a knob's button pressed
+		RELEASE, // and released
+	};
+	Type type;
+	unsigned int control; // which knob
+	int steps;
+	std::chrono::steady_clock::time_point timestamp;
+};
+
+class InputEvents
+{
+public:
+	static constexpr unsigned int MAX_SOURCES = 4;
+
+	InputEvents();
+
+	// Each thread that posts events needs its own source. Sources must all be added from
+	// the same thread, though others may already be posting.
+	unsigned int AddSource();
+
+	// Producer side. Safe to call from a device's callback thread, and never blocks. An
+	// event is dropped if the event loop has fallen so far behind that the queue is full.
+	// Devices that know when the event happened can say so.
+	void Post(unsigned int source, InputEvent::Type type, unsigned int control, int steps = 0,
+			  std::chrono::steady_clock::time_point timestamp = std::chrono::steady_clock::now());
+
+	// Everything else is for the event loop's thread only. Next() returns the oldest
+	// event from any source.
+	bool Next(InputEvent &event);
+	// Call once each event has been dealt with. The count of them goes on to the frames
+	// shown afterwards.
+	void Handled(InputEvent const &event);
+	uint64_t HandledCount() const { return handled_; }
+	// Tell us the latest count that the preview has put on the display, and when.
+	void Presented(uint64_t handled_count, std::chrono::steady_clock::time_point time);
+	// The number of events handled but not yet seen on the display.
+	unsigned int PendingCount() const { return pending_.size(); }
+
+	// Write a line of JSON to the file for each event once it's been seen, giving its
+	// latency, and a summary of them all when FinishReport() is called.
+	void StartReport(std::string const &filename);
+	void FinishReport();
+
+private:
+	struct Pending
+	{
+		uint64_t sequence;
+		InputEvent event;
+	};
+
+	std::array<SpscQueue<InputEvent, 256>, MAX_SOURCES> queues_;
+	std::atomic<unsigned int> num_sources_;
+	std::atomic<unsigned int> dropped_;
+	unsigned int dropped_reported_;
+	uint64_t handled_;
+	std::deque<Pending> pending_;
+	unsigned int latency_count_;
+	double latency_total_ms_, latency_max_ms_;
+	std::ofstream report_;
+	std::chrono::steady_clock::time_point report_start_;
+	std::vector<double> report_latencies_;
+	uint64_t report_handled_;
+};
+
+// Lets the keyboard stand in for the knobs, for trying things out without them. This only
+// starts if standard input is a terminal. Each line is read when Enter is pressed, and
+// every character in it is a key:
+//     a / d  turn the first knob anticlockwise / clockwise, s  press or release it
+//     j / l  turn the second knob anticlockwise / clockwise, k  press or release it
+class KeyboardInput
+{
+public:
+	explicit KeyboardInput(InputEvents &events);
+	~KeyboardInput();
+
+private:
+	void readKeys();
+
+	InputEvents &events_;
+	unsigned int source_;
+	bool held_[2];
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
+
+// Plays a script of knob events into the event loop, as if someone were turning the knobs,
+// so that things can be tried out and timed the same way every time, with no one at the
+// device. Each line of the script is one of
+//     <ms> turn <knob> <counts>
+//     <ms> press <knob>
+//     <ms> release <knob>
+// where the time is from when Start() is called, and anything after a # is a comment. Each
+// event is posted at its time, with that as its timestamp.
+class InputScript
+{
+public:
+	InputScript(std::string const &filename, InputEvents &events);
+	~InputScript();
+
+	void Start();
+	// True once the last event has been posted.
+	bool Finished() const { return finished_; }
+
+private:
+	struct Step
+	{
+		std::chrono::milliseconds time;
+		InputEvent::Type type;
+		unsigned int control;
+		int steps;
+	};
+
+	void play();
+
+	InputEvents &events_;
+	unsigned int source_;
+	std::vector<Step> steps_;
+	std::atomic<bool> finished_;
+	bool abort_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::thread thread_;
+};
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * knob_acceleration.cpp - make the knobs move settings further the faster they turn
+ */
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "core/knob_acceleration.hpp"
+
+// After a pause this long, or a change of direction, the knob starts again from rest.
+static const std::chrono::milliseconds REST_TIME(200);
+
+float KnobAcceleration::Curve::Gain(float speed) const
+{
+	float t = std::clamp((speed - slow_speed) / (fast_speed - slow_speed), 0.0f, 1.0f);
+	return 1 + (max_gain - 1) * t * t;
+}
+
+KnobAcceleration::Turn KnobAcceleration::Turned(InputEvent const &event)
+{
+	if (event.control >= knobs_.size())
+		knobs_.resize(event.control + 1);
+	Knob &knob = knobs_[event.control];
+
+	auto interval = event.timestamp - knob.last;
+	int direction = event.steps > 0 ? 1 : -1;
+	if (knob.last == std::chrono::steady_clock::time_point() || interval <= interval.zero() ||
+		interval > REST_TIME || direction != knob.direction)
+	{
+		knob.speed = 0;
+		knob.counts = 0;
+	}
+	else
+	{
+		// Average a little, as the edges of a cheap encoder are far from evenly spaced.
+		float seconds = std::chrono::duration<float>(interval).count();
+		float speed = std::abs(event.steps) / (float)InputEvent::STEPS_PER_DETENT / seconds;
+		knob.speed = knob.speed ? (knob.speed + speed) / 2 : speed;
+	}
+	knob.last = event.timestamp;
+	knob.direction = direction;
+
+	Turn turn;
+	turn.amount = event.steps / (float)InputEvent::STEPS_PER_DETENT * curve_.Gain(knob.speed);
+	knob.counts += event.steps;
+	turn.detents = knob.counts / InputEvent::STEPS_PER_DETENT;
+	knob.counts -= turn.detents * InputEvent::STEPS_PER_DETENT;
+	return turn;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * knob_acceleration.hpp - make the knobs move settings further the faster they turn
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "core/input_events.hpp"
+
+// A slow turn moves a setting a little for every count from the encoder, half a detent at a
+// time, so it can be set exactly. Spinning the knob quickly moves it up to the curve's gain
+// times as far, so that going from one end of the zoom to the other doesn't take dozens of
+// clicks. The speed comes from the events' timestamps, which are those of the edges
+// themselves, so it isn't upset by the event loop getting round to them late.
+
+class KnobAcceleration
+{
+public:
+	// Below slow_speed (in detents per second) there's no acceleration, and it rises
+	// smoothly from there to max_gain at fast_speed.
+	struct Curve
+	{
+		float max_gain = 1;
+		float slow_speed = 3;
+		float fast_speed = 15;
+
+		float Gain(float speed) const;
+	};
+
+	struct Turn
+	{
+		float amount; // how far to move a setting, in detents and with the gain applied
+		int detents; // whole detents turned, for things that step through a list
+	};
+
+	KnobAcceleration() {}
+	explicit KnobAcceleration(Curve const &curve) : curve_(curve) {}
+
+	// Call with each TURN event. Both are positive clockwise.
+	Turn Turned(InputEvent const &event);
+
+private:
+	struct Knob
+	{
+		std::chrono::steady_clock::time_point last;
+		int direction = 0;
+		float speed = 0;
+		int counts = 0; // towards the next whole detent
+	};
+
+	Curve curve_;
+	std::vector<Knob> knobs_;
+};
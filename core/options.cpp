@@ -382,6 +382,11 @@ bool Options::Parse(int argc, char *argv[])
 		throw std::runtime_error("Invalid metering mode: " + metering);
 	metering_index = metering_table[metering];
 
+	std::map<std::string, int> reading_line_table = { { "off", 0 }, { "highlight", 1 }, { "mask", 2 } };
+	if (reading_line_table.count(reading_line) == 0)
+		throw std::runtime_error("Invalid reading line mode: " + reading_line);
+	reading_line_index = reading_line_table[reading_line];
+
 	std::map<std::string, int> exposure_table =
 		{ { "normal", libcamera::controls::ExposureNormal },
 			{ "sport", libcamera::controls::ExposureShort },
@@ -438,6 +443,14 @@ bool Options::Parse(int argc, char *argv[])
 	contrast = std::clamp(contrast, 0.0f, 15.99f); // limits are arbitrary..
 	saturation = std::clamp(saturation, 0.0f, 15.99f); // limits are arbitrary..
 	sharpness = std::clamp(sharpness, 0.0f, 15.99f); // limits are arbitrary..
+	temporal_denoise = std::clamp(temporal_denoise, 0.0f, 0.95f); // 1 would freeze the image
+	overview_size = std::clamp(overview_size, 0.05f, 1.0f);
+	overview_interval = std::max(overview_interval, 1u);
+	zoom_smoothing = std::max(zoom_smoothing, 0.0f);
+
+	if (sscanf(knob_acceleration.c_str(), "%f,%f,%f", &knob_gain, &knob_slow_speed, &knob_fast_speed) != 3 ||
+		!(knob_gain >= 1) || !(knob_slow_speed >= 0) || !(knob_fast_speed > knob_slow_speed))
+		throw std::runtime_error("Invalid knob acceleration " + knob_acceleration);
 
 	if (strcasecmp(metadata_format.c_str(), "json") == 0)
 		metadata_format = "json";
@@ -474,6 +487,41 @@ void Options::Print() const
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
+	std::cerr << "    sharpen-strength: " << sharpen_strength << std::endl;
+	std::cerr << "    sharpen-budget: " << sharpen_budget << "ms" << std::endl;
+	std::cerr << "    temporal-denoise: " << temporal_denoise << std::endl;
+	std::cerr << "    freeze-frames: " << freeze_frames << std::endl;
+	std::cerr << "    swap-interval: " << swap_interval << std::endl;
+	std::cerr << "    overview: " << overview << std::endl;
+	std::cerr << "    overview-interval: " << overview_interval << std::endl;
+	std::cerr << "    overview-size: " << overview_size << std::endl;
+	std::cerr << "    zoom-smoothing: " << zoom_smoothing << "ms" << std::endl;
+	std::cerr << "    zoom-interval: " << zoom_interval << "ms" << std::endl;
+	std::cerr << "    reading-line: " << reading_line << std::endl;
+	std::cerr << "    governor: " << governor << std::endl;
+	if (governor)
+	{
+		std::cerr << "    governor-thermal-path: " << governor_thermal_path << std::endl;
+		std::cerr << "    governor-temperature: " << governor_temperature << std::endl;
+	}
+	if (!metrics_file.empty())
+		std::cerr << "    metrics-file: " << metrics_file << std::endl;
+	if (!gpio_chip.empty())
+		std::cerr << "    gpio-chip: " << gpio_chip << std::endl;
+	std::cerr << "    knob-acceleration: " << knob_gain << "," << knob_slow_speed << "," << knob_fast_speed
+			  << std::endl;
+	std::cerr << "    knob-debounce: " << knob_debounce << "us" << std::endl;
+	std::cerr << "    focus-memory: " << focus_memory << std::endl;
+	if (!input_script.empty())
+		std::cerr << "    input-script: " << input_script << std::endl;
+	if (!input_report.empty())
+		std::cerr << "    input-report: " << input_report << std::endl;
+	std::cerr << "    shader-dir: " << shader_dir << std::endl;
+	std::cerr << "    shader-cache: " << shader_cache << std::endl;
+	std::cerr << "    shader-reload: " << shader_reload << std::endl;
+	std::cerr << "    headless-preview: " << headless_preview << std::endl;
+	std::cerr << "    kms-preview: " << kms_preview << std::endl;
+	std::cerr << "    kms-device: " << kms_device << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
 		std::cerr << "    roi: all" << std::endl;
@@ -136,8 +136,69 @@ struct Options
 			 "Set the preview window dimensions, given as x,y,width,height e.g. 0,0,640,480")
 			("fullscreen,f", value<bool>(&fullscreen)->default_value(false)->implicit_value(true),
 			 "Use a fullscreen preview window")
+			("headless-preview", value<bool>(&headless_preview)->default_value(false)->implicit_value(true),
+			 "Render the EGL preview offscreen without a display, for testing and benchmarking")
+			("kms-preview", value<bool>(&kms_preview)->default_value(false)->implicit_value(true),
+			 "Draw the EGL preview straight to the display through KMS, without an X server")
+			("kms-device", value<std::string>(&kms_device)->default_value(""),
+			 "DRM device for the KMS preview, e.g. /dev/dri/card1 (default: the first with a connected display)")
 			("qt-preview", value<bool>(&qt_preview)->default_value(false)->implicit_value(true),
 			 "Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
+			("sharpen-strength", value<float>(&sharpen_strength)->default_value(1.0),
+			 "Strength of the sharpen and edge outline preview modes")
+			("sharpen-budget", value<float>(&sharpen_budget)->default_value(8.0),
+			 "Time budget in ms for the sharpen passes, beyond which a cheaper kernel is used (0 = no limit)")
+			("temporal-denoise", value<float>(&temporal_denoise)->default_value(0),
+			 "Strength of the motion-adaptive temporal denoise in the preview, from 0 (off) to 0.95")
+			("freeze-frames", value<unsigned int>(&freeze_frames)->default_value(4),
+			 "Number of recent frames the preview keeps on the GPU for freeze-frame review (0 = disabled)")
+			("swap-interval", value<unsigned int>(&swap_interval)->default_value(1),
+			 "EGL swap interval for the preview's render loop. 1 = draw every display refresh, "
+			 "0 = draw only when a new frame arrives, without waiting for vsync (lowest latency, may tear)")
+			("overview", value<bool>(&overview)->default_value(false)->implicit_value(true),
+			 "Show a small inset of the whole field of view in the preview, marking the zoomed region")
+			("overview-interval", value<unsigned int>(&overview_interval)->default_value(6),
+			 "Update the overview inset every this many frames")
+			("overview-size", value<float>(&overview_size)->default_value(0.25),
+			 "Width of the overview inset as a fraction of the preview window")
+			("zoom-smoothing", value<float>(&zoom_smoothing)->default_value(120),
+			 "Time constant in ms with which the preview animates zoom changes (0 = no animation)")
+			("zoom-interval", value<unsigned int>(&zoom_interval)->default_value(50),
+			 "Minimum time in ms between camera crop updates while a zoom is animating")
+			("reading-line", value<std::string>(&reading_line)->default_value("off"),
+			 "Pick out the line of text being read in the preview: off, highlight or mask (needs the reading_line "
+			 "post-processing stage)")
+			("governor", value<bool>(&governor)->default_value(false)->implicit_value(true),
+			 "Give up preview features, one at a time, when the preview can't keep up or the device gets hot")
+			("governor-thermal-path", value<std::string>(&governor_thermal_path)
+			 ->default_value("/sys/class/thermal/thermal_zone0/temp"),
+			 "File to read the temperature from, in millidegrees C, for the governor (empty = ignore temperature)")
+			("governor-temperature", value<float>(&governor_temperature)->default_value(80),
+			 "Temperature in degrees C above which the governor gives up preview features")
+			("metrics-file", value<std::string>(&metrics_file),
+			 "File to write preview timings and governor decisions to, one JSON object per line")
+			("gpio-chip", value<std::string>(&gpio_chip),
+			 "Read the knobs from this GPIO character device, e.g. /dev/gpiochip0, instead of through the pigpio "
+			 "daemon")
+			("knob-acceleration", value<std::string>(&knob_acceleration)->default_value("6,3,15"),
+			 "How much faster the knobs move settings when turned quickly, as gain,slow,fast: the gain is reached "
+			 "at fast detents per second, and there's none below slow (gain of 1 = no acceleration)")
+			("knob-debounce", value<unsigned int>(&knob_debounce)->default_value(1000),
+			 "Ignore knob and button edges shorter than this many microseconds")
+			("focus-memory", value<bool>(&focus_memory)->default_value(true)->implicit_value(true),
+			 "Remember where autofocus settles at each zoom, and start the lens from there on zooming")
+			("input-script", value<std::string>(&input_script),
+			 "Play a script of knob events instead of reading the knobs, and stop once they've all been seen. "
+			 "The saved settings are neither used nor changed")
+			("input-report", value<std::string>(&input_report),
+			 "File to write the time from each knob event to its effect being displayed to, as JSON lines")
+			("shader-dir", value<std::string>(&shader_dir)->default_value("shaders"),
+			 "Directory of preview fragment shaders to use in place of the built-in ones, where present")
+			("shader-cache", value<std::string>(&shader_cache)->default_value("auto"),
+			 "Directory for caching compiled preview shaders (auto = rpicam-apps/shaders under $XDG_CACHE_HOME "
+			 "or ~/.cache, empty = no cache)")
+			("shader-reload", value<bool>(&shader_reload)->default_value(false)->implicit_value(true),
+			 "Rebuild the preview shaders whenever the files in the shader directory change")
 			("hflip", value<bool>(&hflip_)->default_value(false)->implicit_value(true), "Request a horizontal flip transform")
 			("vflip", value<bool>(&vflip_)->default_value(false)->implicit_value(true), "Request a vertical flip transform")
 			("rotation", value<int>(&rotation_)->default_value(0), "Request an image rotation, 0 or 180")
@@ -262,6 +323,35 @@ struct Options
 	unsigned int viewfinder_height;
 	std::string tuning_file;
 	bool qt_preview;
+	bool headless_preview;
+	bool kms_preview;
+	std::string kms_device;
+	float sharpen_strength;
+	float sharpen_budget;
+	float temporal_denoise;
+	unsigned int freeze_frames;
+	unsigned int swap_interval;
+	bool overview;
+	unsigned int overview_interval;
+	float overview_size;
+	float zoom_smoothing;
+	unsigned int zoom_interval;
+	std::string reading_line;
+	int reading_line_index;
+	bool governor;
+	std::string governor_thermal_path;
+	float governor_temperature;
+	std::string metrics_file;
+	std::string gpio_chip;
+	std::string knob_acceleration;
+	float knob_gain, knob_slow_speed, knob_fast_speed;
+	unsigned int knob_debounce;
+	bool focus_memory;
+	std::string input_script;
+	std::string input_report;
+	std::string shader_dir;
+	std::string shader_cache;
+	bool shader_reload;
 	unsigned int lores_width;
 	unsigned int lores_height;
 	unsigned int camera;
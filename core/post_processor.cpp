@@ -5,7 +5,11 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <numeric>
+#include <set>
 
 #include "core/rpicam_app.hpp"
 #include "core/post_processor.hpp"
@@ -15,7 +19,7 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
-PostProcessor::PostProcessor(RPiCamApp *app) : app_(app)
+PostProcessor::PostProcessor(RPiCamApp *app) : app_(app), sequential_(true), workers_quit_(false)
 {
 }
 
@@ -27,17 +31,48 @@ void PostProcessor::Read(std::string const &filename)
 {
 	boost::property_tree::ptree root;
 	boost::property_tree::read_json(filename, root);
+	std::map<std::string, unsigned int> indices;
+	std::set<std::string> missing;
 	for (auto const &key_and_value : root)
 	{
-		PostProcessingStage *stage = createPostProcessingStage(key_and_value.first.c_str());
-		if (stage)
+		std::string const &name = key_and_value.first;
+		StagePtr stage(createPostProcessingStage(name.c_str()));
+		if (!stage)
 		{
-			LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
-			stage->Read(key_and_value.second);
-			stages_.push_back(StagePtr(stage));
+			LOG(1, "No post processing stage found for \"" << name << "\"");
+			missing.insert(name);
+			continue;
 		}
-		else
-			LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
+
+		std::vector<unsigned int> depends_on;
+		auto names = key_and_value.second.get_child_optional("depends_on");
+		if (!names && !stages_.empty())
+			depends_on.push_back(stages_.size() - 1);
+		else if (names)
+		{
+			for (auto const &dependency : *names)
+			{
+				// Stages we don't have never run, so there's nothing to wait for.
+				std::string const &other = dependency.second.data();
+				auto it = indices.find(other);
+				if (it != indices.end())
+					depends_on.push_back(it->second);
+				else if (!missing.count(other))
+					throw std::runtime_error("PostProcessor: stage \"" + name + "\" depends on \"" + other +
+											 "\", which doesn't come before it");
+			}
+		}
+
+		LOG(1, "Reading post processing stage \"" << name << "\"");
+		stage->Read(key_and_value.second);
+		indices[name] = stages_.size();
+		sequential_ &= depends_on.size() == (stages_.empty() ? 0 : 1) &&
+					   (stages_.empty() || depends_on[0] == stages_.size() - 1);
+		for (unsigned int j : depends_on)
+			dependents_[j].push_back(stages_.size());
+		stages_.push_back(std::move(stage));
+		depends_on_.push_back(std::move(depends_on));
+		dependents_.emplace_back();
 	}
 }
 
@@ -71,14 +106,42 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	ImageCache::ResetStats();
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	// One stage can always run on the request's own thread, so the pool needs one thread fewer
+	// than the number of stages that might run at once.
+	if (!sequential_)
+	{
+		unsigned int threads = std::min<unsigned int>(stages_.size() - 1, std::thread::hardware_concurrency());
+		workers_quit_ = false;
+		for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+			workers_.emplace_back(&PostProcessor::workerThread, this);
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
 	}
 }
 
+void PostProcessor::workerThread()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(tasks_mutex_);
+			tasks_cv_.wait(lock, [this] { return workers_quit_ || !tasks_.empty(); });
+			if (tasks_.empty())
+				return;
+			task = std::move(tasks_.front());
+			tasks_.pop_front();
+		}
+		task();
+	}
+}
+
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
 	if (stages_.empty())
@@ -92,15 +155,9 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 
 	std::promise<bool> promise;
 	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
-		{
-			if (stage->Process(request))
-			{
-				drop_request = true;
-				break;
-			}
-		}
+		bool drop_request = runStages(request);
+		// Nothing else wants the stages' images, so don't hang on to them while it's shown.
+		request->image_cache.Clear();
 		promise.set_value(drop_request);
 		cv_.notify_one();
 	};
@@ -111,6 +168,138 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
 }
 
+// What one request's trip through the stages needs. The pool's tasks share ownership of it, so
+// it outlives the request thread should a worker still be on its way out when that returns.
+struct PostProcessor::StageRun
+{
+	StageRun(CompletedRequestPtr const &request, unsigned int num_stages)
+		: request(request), path(num_stages), times(num_stages), dropped(num_stages), waiting(num_stages),
+		  finished(0)
+	{
+	}
+
+	CompletedRequestPtr request;
+	// The longest chain of stage times (in ms) through the dependencies, up to the end of each
+	// stage, and whether each stage (or one it depends on) wants the request dropped.
+	std::vector<double> path, times;
+	std::vector<char> dropped;
+	// How many of its dependencies each stage is still waiting for, and how many have finished.
+	std::vector<unsigned int> waiting;
+	unsigned int finished;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable cv;
+};
+
+void PostProcessor::runStage(StageRun &run, unsigned int i)
+{
+	double start = 0;
+	bool drop = false;
+	for (unsigned int j : depends_on_[i])
+	{
+		start = std::max(start, run.path[j]);
+		drop |= run.dropped[j];
+	}
+	if (!drop)
+	{
+		auto t1 = std::chrono::steady_clock::now();
+		drop = stages_[i]->Process(run.request);
+		run.times[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t1).count();
+		start += run.times[i];
+	}
+	run.path[i] = start;
+	run.dropped[i] = drop;
+}
+
+void PostProcessor::submitStage(std::shared_ptr<StageRun> const &run, unsigned int i)
+{
+	{
+		std::lock_guard<std::mutex> lock(tasks_mutex_);
+		tasks_.push_back([this, run, i] { runFrom(run, i); });
+	}
+	tasks_cv_.notify_one();
+}
+
+// A stage is ready once the last of its dependencies finishes. Whichever thread finished that
+// goes straight on to run it, and hands any others that became ready to the pool.
+void PostProcessor::runFrom(std::shared_ptr<StageRun> run, unsigned int i)
+{
+	while (true)
+	{
+		try
+		{
+			runStage(*run, i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(run->mutex);
+			if (!run->error)
+				run->error = std::current_exception();
+			run->dropped[i] = true;
+		}
+
+		std::vector<unsigned int> ready;
+		{
+			std::lock_guard<std::mutex> lock(run->mutex);
+			for (unsigned int k : dependents_[i])
+			{
+				if (--run->waiting[k] == 0)
+					ready.push_back(k);
+			}
+			if (++run->finished == stages_.size())
+				run->cv.notify_all();
+		}
+		if (ready.empty())
+			return;
+		for (unsigned int n = 1; n < ready.size(); n++)
+			submitStage(run, ready[n]);
+		i = ready[0];
+	}
+}
+
+// Each stage runs once all the stages it depends on have finished, unless one of them wants
+// the request dropped, in which case it doesn't run at all.
+bool PostProcessor::runStages(CompletedRequestPtr &request)
+{
+	unsigned int num_stages = stages_.size();
+	auto run = std::make_shared<StageRun>(request, num_stages);
+	auto start_time = std::chrono::steady_clock::now();
+
+	if (sequential_)
+	{
+		for (unsigned int i = 0; i < num_stages; i++)
+			runStage(*run, i);
+	}
+	else
+	{
+		for (unsigned int i = 0; i < num_stages; i++)
+			run->waiting[i] = depends_on_[i].size();
+
+		// Dependencies always come earlier, so the first stage never has any.
+		for (unsigned int i = 1; i < num_stages; i++)
+		{
+			if (!run->waiting[i])
+				submitStage(run, i);
+		}
+		runFrom(run, 0);
+
+		// Let every stage finish before passing on any exception, so none is still using the request.
+		std::unique_lock<std::mutex> lock(run->mutex);
+		run->cv.wait(lock, [&] { return run->finished == num_stages; });
+		if (run->error)
+			std::rethrow_exception(run->error);
+	}
+
+	double critical_path = *std::max_element(run->path.begin(), run->path.end());
+	double total = std::accumulate(run->times.begin(), run->times.end(), 0.0);
+	double took = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+	request->post_process_metadata.Set("post_process.critical_path", critical_path);
+	LOG(2, "PostProcessor: request " << request->sequence << " critical path " << critical_path << "ms, stages "
+									 << total << "ms, took " << took << "ms");
+
+	return std::find(run->dropped.begin(), run->dropped.end(), true) != run->dropped.end();
+}
+
 void PostProcessor::outputThread()
 {
 	while (true)
@@ -155,6 +344,20 @@ void PostProcessor::Stop()
 	}
 
 	output_thread_.join();
+
+	{
+		std::lock_guard<std::mutex> lock(tasks_mutex_);
+		workers_quit_ = true;
+	}
+	tasks_cv_.notify_all();
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
+
+	ImageCache::Stats stats = ImageCache::GetStats();
+	if (stats.hits || stats.misses)
+		LOG(1, "PostProcessor: images made " << stats.misses << " times (" << stats.bytes << " bytes), reused "
+										   << stats.hits << " times");
 }
 
 void PostProcessor::Teardown()
@@ -11,7 +11,9 @@
 #include <condition_variable>
 #include <future>
 #include <mutex>
+#include <deque>
 #include <queue>
+#include <thread>
 
 #include "core/completed_request.hpp"
 #include "core/logging.hpp"
@@ -29,6 +31,18 @@ using PostProcessorCallback = std::function<void(CompletedRequestPtr &)>;
 using StreamConfiguration = libcamera::StreamConfiguration;
 typedef std::unique_ptr<PostProcessingStage> StagePtr;
 
+// Each stage in the JSON file normally runs after the one before it. A stage may instead
+// list the stages it needs to run after, which must come before it in the file, as in
+// "depends_on": [ "motion_detect" ], or "depends_on": [] to need none. Stages that don't
+// depend on one another then run at the same time. Those that write to the image, or read
+// what another stage writes, must say so with their dependencies. A request's thread runs a
+// stage itself whenever one is ready, handing any others that are ready at the same time to
+// a small pool of threads that the post-processor keeps for as long as it's started.
+
+// The longest chain of stage times through the dependencies, which is how long a request
+// spends in the stages when enough of them can run at once, goes in the metadata as
+// "post_process.critical_path" (in ms).
+
 class PostProcessor
 {
 public:
@@ -54,11 +68,26 @@ public:
 
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	struct StageRun;
+	bool runStages(CompletedRequestPtr &request);
+	void runStage(StageRun &run, unsigned int i);
+	void submitStage(std::shared_ptr<StageRun> const &run, unsigned int i);
+	void runFrom(std::shared_ptr<StageRun> run, unsigned int i);
+	void workerThread();
 
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
+	std::vector<std::vector<unsigned int>> depends_on_;
+	std::vector<std::vector<unsigned int>> dependents_;
+	bool sequential_;
 	void outputThread();
 
+	std::vector<std::thread> workers_;
+	std::deque<std::function<void()>> tasks_;
+	bool workers_quit_;
+	std::mutex tasks_mutex_;
+	std::condition_variable tasks_cv_;
+
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
 	std::thread output_thread_;
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * preview_governor.cpp - give up preview features when it can't keep up
+ */
+
+#include <fstream>
+#include <sstream>
+
+#include "core/logging.hpp"
+#include "core/preview_governor.hpp"
+
+PreviewGovernor::PreviewGovernor(Config const &config)
+	: config_(config), level_(FULL_QUALITY), temperature_(-1), temperature_failed_(false), last_superseded_(0),
+	  trouble_frames_(0), headroom_frames_(0)
+{
+}
+
+char const *PreviewGovernor::LevelName(Level level)
+{
+	static char const *names[NUM_LEVELS] = { "full quality", "cheap sharpen", "no denoise",
+											 "slow overlays", "low resolution", "low framerate" };
+	return names[level];
+}
+
+unsigned int PreviewGovernor::ReducedFeatures(Level level)
+{
+	unsigned int features = 0;
+	if (level >= CHEAP_SHARPEN)
+		features |= Preview::REDUCE_SHARPEN;
+	if (level >= NO_DENOISE)
+		features |= Preview::REDUCE_DENOISE;
+	if (level >= SLOW_OVERLAYS)
+		features |= Preview::REDUCE_OVERLAYS;
+	return features;
+}
+
+bool PreviewGovernor::Update(PreviewStats const &stats, double camera_fps)
+{
+	readTemperature();
+	unsigned int superseded = stats.frames_superseded - last_superseded_;
+	last_superseded_ = stats.frames_superseded;
+	if (camera_fps <= 0)
+		return false;
+	double frame_ms = 1000 / camera_fps;
+
+	// Anything that says we're not keeping up counts as trouble. Room to spare needs
+	// everything to be comfortable.
+	std::stringstream trouble;
+	if (stats.render_ms > 0.8 * frame_ms)
+		trouble << "render time " << stats.render_ms << "ms of a " << frame_ms << "ms frame";
+	else if (superseded)
+		trouble << superseded << " camera frames dropped";
+	else if (stats.display_fps && stats.display_fps < 0.9 * camera_fps)
+		trouble << "display at " << stats.display_fps << "fps for a " << camera_fps << "fps camera";
+	else if (temperature_ > config_.temperature_limit)
+		trouble << "temperature " << temperature_ << "C";
+	bool headroom = stats.render_ms < 0.5 * frame_ms && !superseded &&
+					(!stats.display_fps || stats.display_fps >= 0.95 * camera_fps) &&
+					temperature_ < config_.temperature_limit - 5;
+
+	if (!trouble.str().empty())
+	{
+		headroom_frames_ = 0;
+		if (++trouble_frames_ >= config_.down_frames && level_ + 1 < NUM_LEVELS)
+		{
+			level_ = static_cast<Level>(level_ + 1);
+			reason_ = trouble.str();
+			trouble_frames_ = 0;
+			return true;
+		}
+	}
+	else if (headroom)
+	{
+		trouble_frames_ = 0;
+		if (++headroom_frames_ >= config_.up_frames && level_ > FULL_QUALITY)
+		{
+			level_ = static_cast<Level>(level_ - 1);
+			std::stringstream reason;
+			reason << "render time " << stats.render_ms << "ms of a " << frame_ms << "ms frame";
+			if (temperature_ >= 0)
+				reason << ", temperature " << temperature_ << "C";
+			reason_ = reason.str();
+			headroom_frames_ = 0;
+			return true;
+		}
+	}
+	else
+		trouble_frames_ = headroom_frames_ = 0;
+
+	return false;
+}
+
+// The temperature doesn't change quickly, so there's no point reading it every frame.
+void PreviewGovernor::readTemperature()
+{
+	auto now = std::chrono::steady_clock::now();
+	if (config_.thermal_path.empty() || now - last_temperature_read_ < std::chrono::seconds(1))
+		return;
+	last_temperature_read_ = now;
+
+	std::ifstream file(config_.thermal_path);
+	int millidegrees;
+	if (file >> millidegrees)
+		temperature_ = millidegrees / 1000.0;
+	else
+	{
+		if (!temperature_failed_)
+			LOG_ERROR("WARNING: PreviewGovernor: can't read temperature from " << config_.thermal_path);
+		temperature_failed_ = true;
+		temperature_ = -1;
+	}
+}
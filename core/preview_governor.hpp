@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * preview_governor.hpp - give up preview features when it can't keep up
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#include "preview/preview.hpp"
+
+// Watches how long the preview takes to draw, whether it keeps up with the camera, and the
+// temperature, and when things get tight steps down through the levels below in order,
+// each giving up more than the last. It steps back up one level at a time once there has
+// been plenty of room for long enough, so that it doesn't flip back and forth.
+
+class PreviewGovernor
+{
+public:
+	enum Level
+	{
+		FULL_QUALITY,
+		CHEAP_SHARPEN, // smallest sharpen kernel
+		NO_DENOISE, // and no temporal denoise
+		SLOW_OVERLAYS, // and the overlays updated less often
+		LOW_RESOLUTION, // and a half size viewfinder
+		LOW_FRAMERATE, // and the camera slowed to 2/3 of its framerate
+		NUM_LEVELS
+	};
+
+	struct Config
+	{
+		std::string thermal_path; // where to read the temperature, in millidegrees C
+		float temperature_limit; // step down above this, and only step up 5 degrees below it
+		unsigned int down_frames = 30; // frames of trouble before stepping down
+		unsigned int up_frames = 300; // frames of room to spare before stepping up
+	};
+
+	explicit PreviewGovernor(Config const &config);
+
+	// Called once for each frame shown. Returns true if the level has changed, in which
+	// case Reason() says why.
+	bool Update(PreviewStats const &stats, double camera_fps);
+
+	Level GetLevel() const { return level_; }
+	std::string const &Reason() const { return reason_; }
+	float Temperature() const { return temperature_; }
+	static char const *LevelName(Level level);
+
+	// The Preview::REDUCE_* features for a level.
+	static unsigned int ReducedFeatures(Level level);
+
+private:
+	void readTemperature();
+
+	Config config_;
+	Level level_;
+	std::string reason_;
+	float temperature_; // -1 if unknown
+	bool temperature_failed_;
+	std::chrono::steady_clock::time_point last_temperature_read_;
+	unsigned int last_superseded_;
+	unsigned int trouble_frames_, headroom_frames_;
+};
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * quadrature_decoder.hpp - turn a rotary encoder's pin changes into counts
+ */
+
+#pragma once
+
+// The same decoding as RED: each valid change of the two pins' state moves the count by
+// one, and there are InputEvent::STEPS_PER_DETENT counts to a detent. A change that skips
+// a state (a missed edge, or a bounce) is ignored.
+
+class QuadratureDecoder
+{
+public:
+	QuadratureDecoder(int lev_a = 1, int lev_b = 1) : lev_a_(lev_a), lev_b_(lev_b), state_(lev_a << 1 | lev_b) {}
+
+	// Returns how far the count moved, -1, 0 or 1, positive clockwise.
+	int Changed(bool pin_b, int level)
+	{
+		// Indexed by the old state and then the new one, each as A << 1 | B.
+		static const int transits[16] = {
+			0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0,
+		};
+
+		if (pin_b)
+			lev_b_ = level;
+		else
+			lev_a_ = level;
+		int new_state = lev_a_ << 1 | lev_b_;
+		int inc = transits[state_ << 2 | new_state];
+		if (inc)
+			state_ = new_state;
+		return inc;
+	}
+
+private:
+	int lev_a_, lev_b_;
+	int state_;
+};
@@ -10,7 +10,9 @@
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/preview_governor.hpp"
 
+#include <array>
 #include <cmath>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -127,8 +129,18 @@ int RPiCamApp::getShaderIndex() {
 	return preview_->getShaderIndex();
 }
 
+void RPiCamApp::setShaderIndex(int index) {
+	preview_->setShaderIndex(index);
+}
+
+PreviewStats RPiCamApp::GetPreviewStats() const
+{
+	return preview_->GetStats();
+}
+
 RPiCamApp::RPiCamApp(std::unique_ptr<Options> opts)
-	: options_(std::move(opts)), controls_(controls::controls), post_processor_(this)
+	: options_(std::move(opts)), controls_(controls::controls), applied_controls_(controls::controls),
+	  post_processor_(this)
 {
 	Platform platform = get_platform();
 	if (platform == Platform::LEGACY)
@@ -204,6 +216,49 @@ void RPiCamApp::setShaderValues(float a, float b, float c, float contrast) {
 	preview_->setShaderValues(a, b, c, contrast);
 }
 
+void RPiCamApp::setSharpenStrength(float strength) {
+	preview_->setSharpenStrength(strength);
+}
+
+void RPiCamApp::setFreeze(bool freeze) {
+	preview_->setFreeze(freeze);
+}
+
+bool RPiCamApp::isFrozen() const {
+	return preview_->isFrozen();
+}
+
+void RPiCamApp::stepFreezeFrame(int amount) {
+	preview_->stepFreezeFrame(amount);
+}
+
+void RPiCamApp::setFreezeView(float zoom, float x, float y) {
+	preview_->setFreezeView(zoom, x, y);
+}
+
+bool RPiCamApp::GetShownCrop(float crop[4]) const
+{
+	float target[4];
+	return preview_ && preview_->getZoomCrop(crop, target);
+}
+
+void RPiCamApp::setZoom(Rectangle const &crop) {
+	Rectangle full = *camera_->properties().get(properties::ScalerCropMaximum);
+	float target[4] = { (crop.x - full.x) / (float)full.width, (crop.y - full.y) / (float)full.height,
+						crop.width / (float)full.width, crop.height / (float)full.height };
+	if (preview_ && preview_->setZoomTarget(target))
+	{
+		std::lock_guard<std::mutex> lock(zoom_mutex_);
+		zoom_target_ = crop;
+		zoom_target_pending_ = true;
+		return;
+	}
+
+	ControlList controls;
+	controls.set(controls::ScalerCrop, crop);
+	SetControls(controls);
+}
+
 void RPiCamApp::drawText(std::string text, float x, float y, float scale, float r, float g, float b, float opacity) {
 	preview_->glRenderText( text, x, y, scale, r, g, b, opacity);
 }
@@ -363,6 +418,19 @@ void RPiCamApp::ConfigureViewfinder()
 	int lores_stream_num = 0, raw_stream_num = 0;
 	bool have_lores_stream = options_->lores_width && options_->lores_height;
 
+	// The overview inset needs the lores stream to stay at the full field of view while the
+	// viewfinder is zoomed, which needs a separate crop for each output.
+	overview_ = false;
+	if (options_->overview)
+	{
+#ifdef LIBCAMERA_HAS_RPI_VENDOR_CONTROLS_SCALER_CROPS
+		overview_ = camera_->controls().find(&controls::rpi::ScalerCrops) != camera_->controls().end();
+#endif
+		if (!overview_)
+			LOG_ERROR("WARNING: this camera can't crop its outputs separately, so no overview is available");
+		have_lores_stream |= overview_;
+	}
+
 	StreamRoles stream_roles = { StreamRole::Viewfinder };
 	int stream_num = 1;
 	if (have_lores_stream)
@@ -401,6 +469,14 @@ void RPiCamApp::ConfigureViewfinder()
 		LOG(2, "Final viewfinder size is " << size.toString());
 	}
 
+	// The preview governor may have asked for a smaller image.
+	if (viewfinder_scale_ > 1)
+	{
+		size = size / viewfinder_scale_;
+		size.alignDownTo(2, 2);
+		LOG(2, "Governor reduced viewfinder size to " << size.toString());
+	}
+
 	// Now we get to override any of the default settings from the options_->
 	configuration_->at(0).pixelFormat = libcamera::formats::YUV420;
 	configuration_->at(0).size = size;
@@ -410,6 +486,8 @@ void RPiCamApp::ConfigureViewfinder()
 	if (have_lores_stream)
 	{
 		Size lores_size(options_->lores_width, options_->lores_height);
+		if (lores_size.isNull())
+			lores_size = size / 4; // just for the overview
 		lores_size.alignDownTo(2, 2);
 		if (lores_size.width > size.width || lores_size.height > size.height)
 			throw std::runtime_error("Low res image larger than viewfinder");
@@ -703,6 +781,7 @@ void RPiCamApp::Teardown()
 	frame_buffers_.clear();
 
 	streams_.clear();
+	overview_ = false;
 }
 
 void RPiCamApp::StartCamera()
@@ -834,6 +913,7 @@ void RPiCamApp::StartCamera()
 		controls_.set(controls::AeFlickerPeriod, options_->flicker_period.get<std::chrono::microseconds>());
 	}
 
+	applyOverviewCrop(controls_);
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
@@ -940,6 +1020,7 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
+		applyOverviewCrop(controls_);
 		request->controls() = std::move(controls_);
 	}
 
@@ -1021,7 +1102,185 @@ void RPiCamApp::SetControls(const ControlList &controls)
 	// the value in the argument replaces the previously stored value.
 	// These controls will be applied to the next StartCamera or request.
 	for (const auto &c : controls)
+	{
 		controls_.set(c.first, c.second);
+		if (c.first == controls::SCALER_CROP || c.first == controls::AF_MODE || c.first == controls::LENS_POSITION ||
+			c.first == controls::AF_METERING || c.first == controls::AF_WINDOWS ||
+			c.first == controls::EXPOSURE_VALUE)
+			applied_controls_.set(c.first, c.second);
+	}
+}
+
+// With the overview, a crop from the application applies only to the viewfinder, and the
+// lores stream (the second output) keeps the whole field of view.
+void RPiCamApp::applyOverviewCrop(ControlList &controls)
+{
+#ifdef LIBCAMERA_HAS_RPI_VENDOR_CONTROLS_SCALER_CROPS
+	auto crop = controls.get(controls::ScalerCrop);
+	if (!overview_ || !crop)
+		return;
+	Rectangle crops[2] = { *crop, *camera_->properties().get(properties::ScalerCropMaximum) };
+	// ScalerCrops takes precedence over any ScalerCrop left in the list.
+	controls.set(controls::rpi::ScalerCrops, libcamera::Span<const Rectangle>(crops));
+#endif
+}
+
+// While the preview animates a zoom, the camera follows it with ScalerCrop updates, though
+// no more often than --zoom-interval. We ask for whichever of the animated crop and the
+// target is bigger, so that the frames keep covering everything that has to be shown, and
+// the preview makes up the difference. Once the animation gets there, the crop the
+// application asked for goes exactly, and the preview carries on until the frames have it.
+void RPiCamApp::updateZoomCrop()
+{
+	static constexpr float ARRIVED = 1e-4;
+	float shown[4], target[4];
+	bool animating = preview_->getZoomCrop(shown, target);
+	std::lock_guard<std::mutex> lock(zoom_mutex_);
+	if (!animating && !zoom_target_pending_)
+		return;
+	auto now = std::chrono::steady_clock::now();
+
+	bool arrived = !animating;
+	if (animating)
+	{
+		float error = 0;
+		for (int i = 0; i < 4; i++)
+			error = std::max(error, std::abs(shown[i] - target[i]));
+		arrived = error < ARRIVED;
+	}
+
+	Rectangle rect;
+	if (arrived)
+	{
+		if (!zoom_target_pending_)
+			return;
+		rect = zoom_target_;
+		zoom_target_pending_ = false;
+	}
+	else
+	{
+		if (now - zoom_crop_time_ < std::chrono::milliseconds(options_->zoom_interval))
+			return;
+		float const *crop = shown[2] * shown[3] >= target[2] * target[3] ? shown : target;
+		Rectangle full = *camera_->properties().get(properties::ScalerCropMaximum);
+		rect = Rectangle(full.x + crop[0] * full.width, full.y + crop[1] * full.height, crop[2] * full.width,
+						 crop[3] * full.height);
+	}
+	if (rect == zoom_crop_)
+		return;
+
+	ControlList controls;
+	controls.set(controls::ScalerCrop, rect);
+	SetControls(controls);
+	zoom_crop_ = rect;
+	zoom_crop_time_ = now;
+}
+
+// The preview gives up its own features when told to, and the camera's framerate is
+// reduced here, but changing the resolution means restarting the camera, which has to wait
+// for ApplyGovernor(). Every change, and the preview's timings about once a second, go to
+// the --metrics-file.
+void RPiCamApp::updateGovernor(double camera_fps)
+{
+	if (!options_->governor && options_->metrics_file.empty())
+		return;
+
+	PreviewStats stats = preview_->GetStats();
+	if (options_->governor)
+	{
+		if (!governor_)
+		{
+			PreviewGovernor::Config config;
+			config.thermal_path = options_->governor_thermal_path;
+			config.temperature_limit = options_->governor_temperature;
+			governor_ = std::make_unique<PreviewGovernor>(config);
+		}
+
+		if (governor_->Update(stats, camera_fps))
+		{
+			PreviewGovernor::Level level = governor_->GetLevel();
+			LOG(1, "Preview governor: " << PreviewGovernor::LevelName(level) << " (" << governor_->Reason() << ")");
+			std::stringstream line;
+			line << "{ \"event\": \"governor\", \"level\": " << level << ", \"name\": \""
+				 << PreviewGovernor::LevelName(level) << "\", \"reason\": \"" << governor_->Reason() << "\" }";
+			WriteMetrics(line.str());
+			preview_->setReducedFeatures(PreviewGovernor::ReducedFeatures(level));
+			governor_level_ = level;
+		}
+
+		// The camera forgets the slower framerate if it is restarted, so keep checking.
+		bool slow = governor_level_ >= PreviewGovernor::LOW_FRAMERATE;
+		float framerate = options_->framerate.value_or(DEFAULT_FRAMERATE);
+		if (slow != governor_slow_ && framerate > 0 && !StillStream())
+		{
+			int64_t frame_time = 1000000 / framerate * (slow ? 1.5 : 1); // in us
+			ControlList controls;
+			controls.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+			SetControls(controls);
+			governor_slow_ = slow;
+		}
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - metrics_time_ >= std::chrono::seconds(1))
+	{
+		metrics_time_ = now;
+		std::stringstream line;
+		line << "{ \"event\": \"stats\", \"render_ms\": " << stats.render_ms
+			 << ", \"swap_slack_ms\": " << stats.swap_slack_ms << ", \"frame_age_ms\": " << stats.frame_age_ms
+			 << ", \"display_fps\": " << stats.display_fps << ", \"camera_fps\": " << camera_fps
+			 << ", \"superseded\": " << stats.frames_superseded;
+		if (governor_)
+			line << ", \"level\": " << governor_->GetLevel() << ", \"temperature\": " << governor_->Temperature();
+		line << " }";
+		WriteMetrics(line.str());
+	}
+}
+
+void RPiCamApp::WriteMetrics(std::string const &line)
+{
+	if (options_->metrics_file.empty())
+		return;
+	std::lock_guard<std::mutex> lock(metrics_mutex_);
+	if (!metrics_.is_open())
+	{
+		metrics_.open(options_->metrics_file, std::ios::trunc);
+		if (!metrics_)
+			throw std::runtime_error("failed to open metrics file " + options_->metrics_file);
+		metrics_start_ = std::chrono::steady_clock::now();
+	}
+	double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - metrics_start_).count();
+	// Each line is a JSON object with the time in seconds added at the front.
+	metrics_ << "{ \"time\": " << time << ", " << line.substr(2) << std::endl;
+}
+
+void RPiCamApp::ApplyGovernor()
+{
+	// Only the plain viewfinder can be resized, since any other stream's size is the user's.
+	if (!camera_started_ || !ViewfinderStream() || StillStream() || VideoStream())
+		return;
+	unsigned int scale = governor_level_ >= PreviewGovernor::LOW_RESOLUTION ? 2 : 1;
+	if (scale == viewfinder_scale_)
+		return;
+
+	LOG(1, "Preview governor: restarting camera at " << (scale > 1 ? "half" : "full") << " resolution");
+	viewfinder_scale_ = scale;
+	StopCamera();
+	Teardown();
+	ConfigureViewfinder();
+	// StartCamera() only fills in what isn't already set, so the user's zoom, focus and
+	// exposure carry on rather than going back to the command line's.
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		for (const auto &c : applied_controls_)
+			controls_.set(c.first, c.second);
+	}
+	{
+		std::lock_guard<std::mutex> lock(zoom_mutex_);
+		zoom_crop_ = Rectangle();
+	}
+	StartCamera();
+	governor_slow_ = false;
 }
 
 StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
@@ -1238,7 +1497,39 @@ void RPiCamApp::previewThread()
 		frame_info.fps = item.completed_request->framerate;
 		frame_info.sequence = item.completed_request->sequence;
 
+		PreviewFrameData frame_data;
+		auto timestamp = item.completed_request->metadata.get(controls::SensorTimestamp);
+		if (timestamp)
+			frame_data.timestamp_ns = *timestamp;
+		auto crop = item.completed_request->metadata.get(controls::ScalerCrop);
+		Rectangle full = *camera_->properties().get(properties::ScalerCropMaximum);
+		if (crop && !full.isNull())
+		{
+			frame_data.crop[0] = (crop->x - full.x) / (float)full.width;
+			frame_data.crop[1] = (crop->y - full.y) / (float)full.height;
+			frame_data.crop[2] = crop->width / (float)full.width;
+			frame_data.crop[3] = crop->height / (float)full.height;
+		}
+		std::array<float, 4> stabilise_crop;
+		item.completed_request->post_process_metadata.Get("input.sequence", frame_data.input_sequence);
+		if (item.completed_request->post_process_metadata.Get("stabilise.crop", stabilise_crop) == 0)
+			std::copy(stabilise_crop.begin(), stabilise_crop.end(), frame_data.stabilise_crop);
+		unsigned int reading_lines_age;
+		if (item.completed_request->post_process_metadata.Get("reading_line.age", reading_lines_age) == 0 &&
+			item.completed_request->post_process_metadata.Get("reading_line.lines", frame_data.reading_lines) == 0)
+			frame_data.reading_lines_age = reading_lines_age;
+		if (overview_)
+		{
+			// The lores buffer belongs to the same request, so stays valid as long as the
+			// viewfinder buffer does.
+			FrameBuffer *lores_buffer = item.completed_request->buffers[LoresStream(&frame_data.overview_info)];
+			frame_data.overview_fd = lores_buffer->planes()[0].fd.get();
+			for (auto const &plane : lores_buffer->planes())
+				frame_data.overview_size += plane.length;
+		}
+
 		int fd = buffer->planes()[0].fd.get();
+		float framerate = item.completed_request->framerate;
 		{
 			std::lock_guard<std::mutex> lock(preview_mutex_);
 			// the reference to the shared_ptr moves to the map here
@@ -1250,7 +1541,10 @@ void RPiCamApp::previewThread()
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
+		preview_->SetFrameData(frame_data);
 		preview_->Show(fd, span, info);
+		updateZoomCrop();
+		updateGovernor(framerate);
 		if (!options_->info_text.empty())
 		{
 			std::string s = frame_info.ToString(options_->info_text);
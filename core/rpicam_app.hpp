@@ -9,7 +9,10 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <fstream>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -38,6 +41,8 @@
 
 struct Options;
 class Preview;
+class PreviewGovernor;
+struct PreviewStats;
 struct Mode;
 
 namespace controls = libcamera::controls;
@@ -140,6 +145,9 @@ public:
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
+	// Changes the viewfinder resolution if the preview governor has asked for it. This
+	// restarts the camera, so call it from the application's own thread.
+	void ApplyGovernor();
 
 	void nextShader();
 	void prevShader();
@@ -147,7 +155,21 @@ public:
 	void drawText(std::string = "", float x = 0, float y = 0, float scale = 1, float r = 255, float g = 255, float b = 255, float opacity = 1);
 	void SetTextDrawCallback(std::function<void()> func);
 	void setShaderValues(float a, float b, float c, float contrast);
+	void setSharpenStrength(float strength);
+	void setFreeze(bool freeze);
+	bool isFrozen() const;
+	void stepFreezeFrame(int amount);
+	void setFreezeView(float zoom, float x, float y);
+	// Zoom to the given ScalerCrop, animated smoothly where the preview can do it.
+	void setZoom(libcamera::Rectangle const &crop);
+	// While the preview is animating a zoom, gets the part of the full field of view that it's
+	// showing (x, y, w, h as fractions), which may be less than the camera's crop.
+	bool GetShownCrop(float crop[4]) const;
 	int getShaderIndex();
+	void setShaderIndex(int index);
+	PreviewStats GetPreviewStats() const;
+	// Adds a line, which must be a JSON object, to the --metrics-file if there is one.
+	void WriteMetrics(std::string const &line);
 	void drawRect(float x, float y, float w, float h, float r, float g, float b, float opacity);
 
 	Msg Wait();
@@ -253,6 +275,9 @@ private:
 	void stopPreview();
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
+	void applyOverviewCrop(ControlList &controls);
+	void updateZoomCrop();
+	void updateGovernor(double camera_fps);
 	Mode selectMode(const Mode &mode) const;
 
 	std::unique_ptr<CameraManager> camera_manager_;
@@ -282,9 +307,30 @@ private:
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
 	std::thread preview_thread_;
+	// The lores stream is kept at the full field of view for the preview's overview inset.
+	bool overview_ = false;
+	// The last ScalerCrop sent for an animated zoom, and the one it's heading for, which
+	// is sent exactly once the animation gets there.
+	std::mutex zoom_mutex_;
+	libcamera::Rectangle zoom_crop_;
+	libcamera::Rectangle zoom_target_;
+	bool zoom_target_pending_ = false;
+	std::chrono::steady_clock::time_point zoom_crop_time_;
+	// Stepping the preview down when it can't keep up. The level is read by ApplyGovernor()
+	// from the application's thread.
+	std::unique_ptr<PreviewGovernor> governor_;
+	std::atomic<int> governor_level_ { 0 };
+	bool governor_slow_ = false;
+	unsigned int viewfinder_scale_ = 1;
+	std::mutex metrics_mutex_;
+	std::ofstream metrics_;
+	std::chrono::steady_clock::time_point metrics_start_, metrics_time_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	// The zoom, focus and exposure controls last set by the application, which StartCamera()
+	// wouldn't otherwise know about when the governor restarts the camera.
+	ControlList applied_controls_;
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
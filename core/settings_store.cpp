@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * settings_store.cpp - remember the user's settings without holding up the input
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+#include "core/logging.hpp"
+#include "core/settings_store.hpp"
+
+// The order of the values in files that had no names.
+static char const *legacy_names[] = { "contrast_a", "contrast_b", "contrast_c", "contrast", "sharpen" };
+
+static bool parse_float(std::string const &text, float &value)
+{
+	char *end;
+	value = strtof(text.c_str(), &end);
+	return end != text.c_str() && *end == '\0' && std::isfinite(value);
+}
+
+SettingsStore::SettingsStore(std::string const &filename, std::chrono::milliseconds delay)
+	: filename_(filename), delay_(delay), dirty_(false), abort_(false)
+{
+	load();
+	thread_ = std::thread(&SettingsStore::saveThread, this);
+}
+
+SettingsStore::~SettingsStore()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_.notify_one();
+	}
+	thread_.join();
+}
+
+float SettingsStore::Get(std::string const &name, float default_value, float min, float max) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = values_.find(name);
+	if (it == values_.end() || !(it->second >= min && it->second <= max))
+		return default_value;
+	return it->second;
+}
+
+void SettingsStore::Set(std::string const &name, float value)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = values_.find(name);
+	if (it != values_.end() && it->second == value)
+		return;
+	values_[name] = value;
+	auto now = std::chrono::steady_clock::now();
+	if (!dirty_)
+		first_change_ = now;
+	last_change_ = now;
+	dirty_ = true;
+	cond_.notify_one();
+}
+
+void SettingsStore::load()
+{
+	std::ifstream file(filename_);
+	if (!file)
+	{
+		LOG(1, "SettingsStore: no settings in " << filename_ << ", using defaults");
+		return;
+	}
+
+	std::string line;
+	std::vector<std::string> unnamed;
+	while (std::getline(file, line))
+	{
+		std::istringstream stream(line);
+		std::string name, text;
+		float value;
+		if (!(stream >> name))
+			continue;
+		if (!(stream >> text))
+			unnamed.push_back(name);
+		else if (parse_float(text, value))
+			values_[name] = value;
+		else
+			LOG_ERROR("WARNING: SettingsStore: ignoring bad setting \"" << line << "\" in " << filename_);
+	}
+
+	for (unsigned int i = 0; i < unnamed.size() && i < std::size(legacy_names); i++)
+	{
+		float value;
+		if (parse_float(unnamed[i], value))
+			values_[legacy_names[i]] = value;
+	}
+}
+
+void SettingsStore::save(std::map<std::string, float> const &values)
+{
+	std::stringstream text;
+	for (auto const &[name, value] : values)
+		text << name << " " << value << "\n";
+	std::string contents = text.str();
+
+	// Write a new file alongside the old one, make sure it's on the disk, and only then
+	// swap it in. Syncing the directory makes the rename itself stick.
+	std::string tmp = filename_ + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool ok = fd >= 0 && write(fd, contents.data(), contents.size()) == (ssize_t)contents.size() && fsync(fd) == 0;
+	if (fd >= 0)
+		ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), filename_.c_str()) != 0)
+	{
+		LOG_ERROR("WARNING: SettingsStore: failed to save settings to " << filename_ << ": " << strerror(errno));
+		unlink(tmp.c_str());
+		return;
+	}
+
+	size_t slash = filename_.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : filename_.substr(0, slash + 1);
+	int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd >= 0)
+	{
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+	LOG(2, "SettingsStore: saved settings to " << filename_);
+}
+
+void SettingsStore::saveThread()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		if (dirty_)
+		{
+			// Save once the settings have been left alone for a while, but don't put it
+			// off for ever if they keep changing.
+			auto due = std::min(last_change_ + delay_, first_change_ + 5 * delay_);
+			if (abort_ || std::chrono::steady_clock::now() >= due)
+			{
+				std::map<std::string, float> values = values_;
+				dirty_ = false;
+				lock.unlock();
+				save(values);
+				lock.lock();
+				continue;
+			}
+			cond_.wait_until(lock, due);
+		}
+		else if (abort_)
+			return;
+		else
+			cond_.wait(lock);
+	}
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * settings_store.hpp - remember the user's settings without holding up the input
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Keeps the settings in memory, where Set() only has to update a map, and writes them out
+// from its own thread once they have stopped changing for a while (or at the latest after
+// a few times that while the user keeps turning a knob), and when it's destroyed. The file
+// is written to a temporary one that is synced and renamed over the old, so a power cut
+// leaves either the old settings or the new ones, never half of each.
+
+// The file has a "name value" pair on each line. Anything that doesn't parse, or is out of
+// range, gets the default when it's read back. Files from before there were names, which
+// just listed the shader values in order, can be read too.
+
+class SettingsStore
+{
+public:
+	SettingsStore(std::string const &filename, std::chrono::milliseconds delay = std::chrono::milliseconds(1000));
+	~SettingsStore();
+
+	// Returns the named setting, or the default if it's missing or not between min and max.
+	float Get(std::string const &name, float default_value, float min, float max) const;
+	void Set(std::string const &name, float value);
+
+private:
+	void load();
+	void save(std::map<std::string, float> const &values);
+	void saveThread();
+
+	std::string filename_;
+	std::chrono::milliseconds delay_;
+	std::map<std::string, float> values_;
+	mutable std::mutex mutex_;
+	std::condition_variable cond_;
+	bool dirty_;
+	bool abort_;
+	std::chrono::steady_clock::time_point first_change_, last_change_;
+	std::thread thread_;
+};
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * spsc_queue.hpp - lock-free queue from one thread to one other
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// A fixed size queue for handing items from a single producer thread to a single consumer
+// thread without locks, so that the producer can be something like a GPIO callback that
+// mustn't wait. Each side only ever writes its own index, and the release/acquire pairs
+// make the item visible before the index that publishes it.
+
+template <typename T, size_t N>
+class SpscQueue
+{
+	static_assert(N && (N & (N - 1)) == 0, "SpscQueue size must be a power of 2");
+
+public:
+	// Producer only. Returns false, leaving the queue unchanged, if it is full.
+	bool Push(T const &item)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == N)
+			return false;
+		items_[tail & (N - 1)] = item;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. Returns the oldest item without removing it, or nullptr if empty.
+	T const *Front() const
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return nullptr;
+		return &items_[head & (N - 1)];
+	}
+
+	// Consumer only. Removes the oldest item, returning false if there was none.
+	bool Pop(T &item)
+	{
+		T const *front = Front();
+		if (!front)
+			return false;
+		item = *front;
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	// Kept on separate cache lines so that the two threads don't fight over them.
+	alignas(64) std::atomic<size_t> head_ { 0 };
+	alignas(64) std::atomic<size_t> tail_ { 0 };
+	T items_[N];
+};
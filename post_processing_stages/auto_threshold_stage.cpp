@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * auto_threshold_stage.cpp - automatic binarisation threshold
+ */
+
+// Works out where to split dark from light for the binarised display modes, from a
+// histogram of the luma of the part of the low resolution image that is on the display
+// (which isn't all of it under --overview, or while the preview animates a zoom). The
+// "roi_x", "roi_y", "roi_width" and "roi_height" pick out part of that, as fractions of it.
+// "method" is either "otsu", which picks the threshold that best separates the histogram
+// into two classes, or "percentile", which goes halfway between the "low" and "high"
+// quantiles. The threshold is smoothed from frame to frame by "smoothing", so that it
+// doesn't flicker.
+
+// The stage adds "auto_threshold.threshold" to the metadata, a float where 0 is black and
+// 1 is white.
+
+#include <chrono>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/luma_threshold.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class AutoThresholdStage : public PostProcessingStage
+{
+public:
+	AutoThresholdStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	// In the Config, dimensions are given as fractions of the shown part of the lores image.
+	struct Config
+	{
+		float roi_x, roi_y;
+		float roi_width, roi_height;
+		LumaThreshold::Config method;
+		float smoothing;
+		bool verbose;
+	} config_;
+	Stream *stream_;
+	LumaThreshold finder_;
+	// The luma values that map to black and white.
+	float black_, white_;
+	float threshold_;
+	unsigned int frames_;
+	double histogram_time_;
+	std::mutex mutex_;
+};
+
+#define NAME "auto_threshold"
+
+char const *AutoThresholdStage::Name() const
+{
+	return NAME;
+}
+
+void AutoThresholdStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.roi_x = params.get<float>("roi_x", 0.0);
+	config_.roi_y = params.get<float>("roi_y", 0.0);
+	config_.roi_width = params.get<float>("roi_width", 1.0);
+	config_.roi_height = params.get<float>("roi_height", 1.0);
+	std::string method = params.get<std::string>("method", "otsu");
+	if (method != "otsu" && method != "percentile")
+		throw std::runtime_error("AutoThresholdStage: unknown method " + method);
+	config_.method.otsu = method == "otsu";
+	config_.method.low = params.get<float>("low", 0.1);
+	config_.method.high = params.get<float>("high", 0.9);
+	config_.smoothing = params.get<float>("smoothing", 0.9);
+	config_.verbose = params.get<int>("verbose", 0);
+
+	config_.smoothing = std::clamp(config_.smoothing, 0.0f, 1.0f);
+	if (config_.method.low < 0 || config_.method.high > 1 || config_.method.low >= config_.method.high)
+		throw std::runtime_error("AutoThresholdStage: need 0 <= low < high <= 1");
+}
+
+void AutoThresholdStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_)
+	{
+		LOG(1, "AutoThreshold: no low resolution stream, automatic threshold disabled");
+		return;
+	}
+
+	finder_ = LumaThreshold(config_.method);
+	finder_.Configure(info.width, info.height, info.stride);
+
+	// The preview shows the luma stretched to the full range, so the threshold must be too.
+	bool full_range = info.colour_space && info.colour_space->range == libcamera::ColorSpace::Range::Full;
+	black_ = full_range ? 0 : 16;
+	white_ = full_range ? 255 : 235;
+	threshold_ = -1;
+	frames_ = 0;
+	histogram_time_ = 0;
+}
+
+bool AutoThresholdStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	float shown[4];
+	ShownRegion(completed_request, shown);
+	float region[4] = { shown[0] + config_.roi_x * shown[2], shown[1] + config_.roi_y * shown[3],
+						config_.roi_width * shown[2], config_.roi_height * shown[3] };
+
+	BufferReadSync r(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = r.Get()[0];
+
+	auto start = std::chrono::steady_clock::now();
+	double bin = finder_.Find(buffer.data(), region);
+	double time_taken = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (bin < 0)
+		return false;
+	float threshold = std::clamp<float>((bin - black_) / (white_ - black_), 0, 1);
+
+	// We need to protect access to the smoothed threshold.
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (threshold_ < 0)
+		threshold_ = threshold;
+	else
+		threshold_ = config_.smoothing * threshold_ + (1 - config_.smoothing) * threshold;
+	completed_request->post_process_metadata.Set("auto_threshold.threshold", threshold_);
+
+	histogram_time_ += time_taken;
+	if (config_.verbose && ++frames_ == 100)
+	{
+		LOG(1, "AutoThreshold: threshold " << threshold_ << ", histogram " << histogram_time_ / frames_
+										   << "ms per frame");
+		frames_ = 0;
+		histogram_time_ = 0;
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new AutoThresholdStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -52,6 +52,7 @@ private:
 	std::unique_ptr<std::future<void>> future_ptr_;
 	std::mutex face_mutex_;
 	std::mutex future_ptr_mutex_;
+	ImageCache::Image lores_copy_;
 	Mat image_;
 	std::vector<cv::Rect> faces_;
 	CascadeClassifier cascade_;
@@ -120,11 +121,10 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		if (completed_request->sequence % refresh_rate_ == 0 &&
 			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			BufferReadSync r(app_, completed_request->buffers[stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-			uint8_t *ptr = (uint8_t *)buffer.data();
-			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
+			// The copy may be shared with other stages, so image_ must only be read.
+			lores_copy_ = GetImage(completed_request, stream_, ImageCache::YUV420);
+			uint8_t *ptr = const_cast<uint8_t *>(lores_copy_->data());
+			image_ = Mat(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
 
 			future_ptr_ = std::make_unique<std::future<void>>();
 			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
@@ -152,10 +152,11 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 {
-	equalizeHist(image_, image_);
+	Mat equalised;
+	equalizeHist(image_, equalised);
 
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+	cascade.detectMultiScale(equalised, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
 							 Size(min_size_, min_size_), Size(max_size_, max_size_));
 
 	// Scale faces back to the size and location in the full res image.
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * luma_threshold.cpp - find where to split dark from light in a greyscale image
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/luma_threshold.hpp"
+
+LumaThreshold::LumaThreshold() : LumaThreshold(Config())
+{
+}
+
+LumaThreshold::LumaThreshold(Config const &config) : config_(config), width_(0), height_(0), stride_(0)
+{
+}
+
+void LumaThreshold::Configure(unsigned int width, unsigned int height, unsigned int stride)
+{
+	width_ = width;
+	height_ = height;
+	stride_ = stride;
+}
+
+double LumaThreshold::Find(uint8_t const *image, float const region[4]) const
+{
+	uint32_t counts[256];
+	if (!Count(image, region, counts))
+		return -1;
+	if (config_.otsu)
+		return otsu(counts);
+	Histogram histogram(counts, 256);
+	return (histogram.Quantile(config_.low) + histogram.Quantile(config_.high)) / 2;
+}
+
+bool LumaThreshold::Count(uint8_t const *image, float const region[4], uint32_t *counts) const
+{
+	unsigned int x0 = std::clamp<float>(region[0] * width_, 0, width_);
+	unsigned int y0 = std::clamp<float>(region[1] * height_, 0, height_);
+	unsigned int width = std::clamp<float>(region[2] * width_, 0, width_ - x0);
+	unsigned int height = std::clamp<float>(region[3] * height_, 0, height_ - y0);
+	if (!width || !height)
+		return false;
+
+	accumulate(image, x0, y0, width, height, counts);
+	return true;
+}
+
+// Counting into a single histogram stalls whenever neighbouring pixels have the same value,
+// as each increment waits for the last. So we read four pixels at a time and count them
+// into four separate histograms, which are added up at the end.
+void LumaThreshold::accumulate(uint8_t const *image, unsigned int x0, unsigned int y0, unsigned int width,
+							   unsigned int height, uint32_t *counts) const
+{
+	uint32_t partial[4][256] = {};
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint8_t const *ptr = image + (y0 + y) * stride_ + x0;
+		unsigned int x = 0;
+		for (; x + 4 <= width; x += 4, ptr += 4)
+		{
+			uint32_t four;
+			memcpy(&four, ptr, 4);
+			partial[0][four & 0xff]++;
+			partial[1][(four >> 8) & 0xff]++;
+			partial[2][(four >> 16) & 0xff]++;
+			partial[3][four >> 24]++;
+		}
+		for (; x < width; x++)
+			partial[0][*ptr++]++;
+	}
+	for (unsigned int i = 0; i < 256; i++)
+		counts[i] = partial[0][i] + partial[1][i] + partial[2][i] + partial[3][i];
+}
+
+// Otsu's method: choose the threshold that maximises the variance between the classes
+// of pixels below and above it.
+double LumaThreshold::otsu(uint32_t const *counts)
+{
+	uint64_t total = 0, total_sum = 0;
+	for (unsigned int i = 0; i < 256; i++)
+	{
+		total += counts[i];
+		total_sum += (uint64_t)i * counts[i];
+	}
+
+	uint64_t below = 0, below_sum = 0;
+	double best_variance = -1, best = 0;
+	for (unsigned int t = 0; t < 255; t++)
+	{
+		below += counts[t];
+		below_sum += (uint64_t)t * counts[t];
+		uint64_t above = total - below;
+		if (!below || !above)
+			continue;
+		double mean_difference = (double)below_sum / below - (double)(total_sum - below_sum) / above;
+		double variance = (double)below * above * mean_difference * mean_difference;
+		if (variance > best_variance)
+			best_variance = variance, best = t + 1;
+	}
+	return best;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * luma_threshold.hpp - find where to split dark from light in a greyscale image
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Works out the luma level that splits dark from light in part of a greyscale image, from
+// its histogram. Either by Otsu's method, which picks the threshold that best separates the
+// histogram into two classes, or halfway between the "low" and "high" quantiles.
+
+class LumaThreshold
+{
+public:
+	struct Config
+	{
+		bool otsu = true;
+		float low = 0.1, high = 0.9; // quantiles, when not using Otsu's method
+	};
+
+	LumaThreshold();
+	explicit LumaThreshold(Config const &config);
+
+	void Configure(unsigned int width, unsigned int height, unsigned int stride);
+
+	// Returns the threshold, as a luma value, for the region of the image given by x, y, width
+	// and height as fractions of it. Returns a negative value if the region is empty.
+	double Find(uint8_t const *image, float const region[4]) const;
+
+	// Fills in the 256 entry luma histogram of the same region, returning false (and leaving
+	// counts alone) if it's empty.
+	bool Count(uint8_t const *image, float const region[4], uint32_t *counts) const;
+
+private:
+	void accumulate(uint8_t const *image, unsigned int x0, unsigned int y0, unsigned int width,
+					unsigned int height, uint32_t *counts) const;
+	static double otsu(uint32_t const *counts);
+
+	Config config_;
+	unsigned int width_, height_, stride_;
+};
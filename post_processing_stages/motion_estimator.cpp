@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * motion_estimator.cpp - global motion estimation between consecutive frames
+ */
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <stdexcept>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "motion_estimator.hpp"
+
+static constexpr unsigned int BLOCK_SIZE = 16;
+
+// Sum of absolute differences between two 16x16 blocks. Nearly all the time goes here, so
+// we use whatever vector instructions we have.
+static inline unsigned int sad_16x16(uint8_t const *a, uint8_t const *b, unsigned int stride)
+{
+#if defined(__ARM_NEON)
+	uint16x8_t sum = vdupq_n_u16(0);
+	for (unsigned int y = 0; y < BLOCK_SIZE; y++, a += stride, b += stride)
+	{
+		uint8x16_t va = vld1q_u8(a), vb = vld1q_u8(b);
+		sum = vabal_u8(sum, vget_low_u8(va), vget_low_u8(vb));
+		sum = vabal_u8(sum, vget_high_u8(va), vget_high_u8(vb));
+	}
+	uint64x2_t total = vpaddlq_u32(vpaddlq_u16(sum));
+	return vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1);
+#elif defined(__SSE2__)
+	__m128i sum = _mm_setzero_si128();
+	for (unsigned int y = 0; y < BLOCK_SIZE; y++, a += stride, b += stride)
+		sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(a)),
+											  _mm_loadu_si128(reinterpret_cast<__m128i const *>(b))));
+	return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#else
+	unsigned int sum = 0;
+	for (unsigned int y = 0; y < BLOCK_SIZE; y++, a += stride, b += stride)
+		for (unsigned int x = 0; x < BLOCK_SIZE; x++)
+			sum += std::abs(a[x] - b[x]);
+	return sum;
+#endif
+}
+
+// Offset of the minimum of a parabola through three equally spaced values.
+static float subpixel(unsigned int left, unsigned int centre, unsigned int right)
+{
+	float curvature = (float)left + right - 2.0f * centre;
+	if (curvature <= 0)
+		return 0;
+	return std::clamp(((float)left - right) / (2 * curvature), -0.5f, 0.5f);
+}
+
+static float median(std::vector<float> &values)
+{
+	auto middle = values.begin() + values.size() / 2;
+	std::nth_element(values.begin(), middle, values.end());
+	return *middle;
+}
+
+MotionEstimator::MotionEstimator() : MotionEstimator(Config())
+{
+}
+
+MotionEstimator::MotionEstimator(Config const &config)
+	: config_(config), width_(0), height_(0), stride_(0), small_width_(0), small_height_(0), small_stride_(0),
+	  have_previous_(false)
+{
+}
+
+void MotionEstimator::Configure(unsigned int width, unsigned int height, unsigned int stride)
+{
+	config_.decimate = std::max(config_.decimate, 1u);
+	config_.search = std::max(config_.search, 1);
+	config_.grid_cols = std::max(config_.grid_cols, 1u);
+	config_.grid_rows = std::max(config_.grid_rows, 1u);
+
+	width_ = width;
+	height_ = height;
+	stride_ = stride;
+	small_width_ = width / config_.decimate;
+	small_height_ = height / config_.decimate;
+	small_stride_ = (small_width_ + 15) & ~15;
+	if (small_width_ < BLOCK_SIZE + 2 * config_.search || small_height_ < BLOCK_SIZE + 2 * config_.search)
+		throw std::runtime_error("MotionEstimator: image too small for the search range");
+
+	previous_.assign(small_stride_ * small_height_, 0);
+	current_.assign(small_stride_ * small_height_, 0);
+	sads_.resize((2 * config_.search + 1) * (2 * config_.search + 1));
+	block_dx_.reserve(config_.grid_cols * config_.grid_rows);
+	block_dy_.reserve(config_.grid_cols * config_.grid_rows);
+	have_previous_ = false;
+}
+
+void MotionEstimator::Reset()
+{
+	have_previous_ = false;
+}
+
+bool MotionEstimator::Estimate(uint8_t const *image, float &dx, float &dy)
+{
+	decimate(image, current_);
+	if (!have_previous_)
+	{
+		std::swap(previous_, current_);
+		have_previous_ = true;
+		return false;
+	}
+
+	// The blocks are spread evenly over the part of the image where the whole search
+	// stays inside it.
+	unsigned int range_x = small_width_ - BLOCK_SIZE - 2 * config_.search;
+	unsigned int range_y = small_height_ - BLOCK_SIZE - 2 * config_.search;
+	block_dx_.clear();
+	block_dy_.clear();
+	for (unsigned int row = 0; row < config_.grid_rows; row++)
+	{
+		unsigned int y =
+			config_.search + (config_.grid_rows > 1 ? row * range_y / (config_.grid_rows - 1) : range_y / 2);
+		for (unsigned int col = 0; col < config_.grid_cols; col++)
+		{
+			unsigned int x =
+				config_.search + (config_.grid_cols > 1 ? col * range_x / (config_.grid_cols - 1) : range_x / 2);
+			float block_dx, block_dy;
+			if (matchBlock(x, y, block_dx, block_dy))
+			{
+				block_dx_.push_back(block_dx);
+				block_dy_.push_back(block_dy);
+			}
+		}
+	}
+
+	std::swap(previous_, current_);
+
+	// Don't trust an answer that rests on only a few blocks.
+	unsigned int min_blocks = std::max(3u, config_.grid_cols * config_.grid_rows / 4);
+	if (block_dx_.size() < min_blocks)
+		return false;
+	dx = median(block_dx_) * config_.decimate;
+	dy = median(block_dy_) * config_.decimate;
+	return true;
+}
+
+void MotionEstimator::decimate(uint8_t const *image, std::vector<uint8_t> &output) const
+{
+	unsigned int d = config_.decimate, area = d * d;
+	for (unsigned int y = 0; y < small_height_; y++)
+	{
+		uint8_t *out = &output[y * small_stride_];
+		uint8_t const *in = image + y * d * stride_;
+		for (unsigned int x = 0; x < small_width_; x++, in += d)
+		{
+			unsigned int sum = area / 2;
+			for (unsigned int j = 0; j < d; j++)
+				for (unsigned int i = 0; i < d; i++)
+					sum += in[j * stride_ + i];
+			out[x] = sum / area;
+		}
+	}
+}
+
+// Search for the block at (x, y) of the previous image in the current one. Returns false if
+// the block is too flat, or the best match is at the edge of the search range, as the real
+// one could be beyond it.
+bool MotionEstimator::matchBlock(unsigned int x, unsigned int y, float &dx, float &dy)
+{
+	uint8_t const *block = &previous_[y * small_stride_ + x];
+	unsigned int sum = 0, deviation = 0;
+	for (unsigned int j = 0; j < BLOCK_SIZE; j++)
+		for (unsigned int i = 0; i < BLOCK_SIZE; i++)
+			sum += block[j * small_stride_ + i];
+	int mean = sum / (BLOCK_SIZE * BLOCK_SIZE);
+	for (unsigned int j = 0; j < BLOCK_SIZE; j++)
+		for (unsigned int i = 0; i < BLOCK_SIZE; i++)
+			deviation += std::abs(block[j * small_stride_ + i] - mean);
+	if (deviation < config_.min_contrast * BLOCK_SIZE * BLOCK_SIZE)
+		return false;
+
+	int search = config_.search, size = 2 * search + 1;
+	unsigned int best = UINT_MAX;
+	int best_x = 0, best_y = 0;
+	for (int j = -search; j <= search; j++)
+	{
+		uint8_t const *row = &current_[(y + j) * small_stride_ + x];
+		unsigned int *sads = &sads_[(j + search) * size + search];
+		for (int i = -search; i <= search; i++)
+		{
+			unsigned int sad = sad_16x16(block, row + i, small_stride_);
+			sads[i] = sad;
+			if (sad < best)
+				best = sad, best_x = i, best_y = j;
+		}
+	}
+	if (std::abs(best_x) == search || std::abs(best_y) == search)
+		return false;
+
+	unsigned int const *centre = &sads_[(best_y + search) * size + best_x + search];
+	dx = best_x + subpixel(centre[-1], centre[0], centre[1]);
+	dy = best_y + subpixel(centre[-size], centre[0], centre[size]);
+	return true;
+}
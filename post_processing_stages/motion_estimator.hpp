@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * motion_estimator.hpp - global motion estimation between consecutive frames
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Estimates how far the whole image has moved between one greyscale frame and the next.
+// Each frame is first box-filtered down by the decimation factor. A grid of 16x16 blocks
+// from the previous frame is then searched for in the new one over the full search range,
+// and the median of the block displacements, refined to sub-pixel accuracy, is the answer.
+// Blocks too flat to match reliably are left out.
+
+class MotionEstimator
+{
+public:
+	struct Config
+	{
+		unsigned int decimate = 2; // factor to reduce the image by before matching
+		int search = 12; // search range either way, in decimated pixels
+		unsigned int grid_cols = 6, grid_rows = 4;
+		unsigned int min_contrast = 4; // mean absolute deviation below which a block is ignored
+	};
+
+	MotionEstimator();
+	explicit MotionEstimator(Config const &config);
+
+	void Configure(unsigned int width, unsigned int height, unsigned int stride);
+
+	// Forget the previous frame, so that the next one starts afresh.
+	void Reset();
+
+	// Returns false when there's no estimate, either because this is the first frame or there
+	// isn't enough detail. Otherwise dx and dy are how far the image content has moved since
+	// the previous frame, in pixels of the full size image.
+	bool Estimate(uint8_t const *image, float &dx, float &dy);
+
+private:
+	void decimate(uint8_t const *image, std::vector<uint8_t> &output) const;
+	bool matchBlock(unsigned int x, unsigned int y, float &dx, float &dy);
+
+	Config config_;
+	unsigned int width_, height_, stride_;
+	unsigned int small_width_, small_height_, small_stride_;
+	std::vector<uint8_t> previous_, current_;
+	std::vector<unsigned int> sads_;
+	std::vector<float> block_dx_, block_dy_;
+	bool have_previous_;
+};
@@ -15,6 +15,8 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include <libcamera/geometry.h>
+
 #include "core/completed_request.hpp"
 #include "core/stream_info.hpp"
 
@@ -57,7 +59,40 @@ public:
 	// image is larger than the destination.
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 
+	// As above, but writing into dst, which must hold dst_info.height * dst_info.stride bytes.
+	// The crop (in src pixels) is scaled to the destination size, taking the nearest pixels;
+	// an empty one gives the centre crop above. Large images are converted on several threads.
+	static void Yuv420ToRgb(uint8_t *dst, StreamInfo const &dst_info, const uint8_t *src, StreamInfo const &src_info,
+							libcamera::Rectangle const &crop = libcamera::Rectangle());
+
+	// Returns the stream's image from this request, either copied out of the camera's buffer
+	// (YUV420) or converted by Yuv420ToRgb to packed RGB888 of the given size and crop. Stages
+	// asking for the same image from a request share the one made by whoever asked first.
+	ImageCache::Image GetImage(CompletedRequestPtr &completed_request, libcamera::Stream *stream,
+							   ImageCache::Format format, unsigned int width = 0, unsigned int height = 0,
+							   libcamera::Rectangle const &crop = libcamera::Rectangle());
+
+	// Where the shown part of the full field of view (x, y, width and height as fractions of
+	// full) falls in an image covering area, as fractions of that image and clipped to it.
+	// The whole image if they don't overlap.
+	static void MapRegion(float const shown[4], libcamera::Rectangle const &full, libcamera::Rectangle const &area,
+						  float region[4]);
+
 protected:
+	// Works out which part of the low resolution image (as fractions of it) the camera's crop,
+	// and so the main image, covers. That's all of it, as the lores stream shares the camera's
+	// crop, except under --overview, when the lores stream sees the whole field of view.
+	void FrameRegion(CompletedRequestPtr &completed_request, float region[4]) const;
+
+	// As above, but for the part that is actually on the display, which is less than the
+	// camera's crop while the preview animates a zoom.
+	void ShownRegion(CompletedRequestPtr &completed_request, float region[4]) const;
+
+	// The other way round: where a region of the low resolution image (as fractions of it)
+	// falls in the full field of view, as fractions of that. Returns false if the crops
+	// aren't known.
+	bool FieldOfView(CompletedRequestPtr &completed_request, float const region[4], float fov[4]) const;
+
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
 	// For functions returning a value, the simplest thing would be to wrap the call in a lambda and capture
 	// the return value.
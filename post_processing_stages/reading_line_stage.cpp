@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * reading_line_stage.cpp - find lines of text for the reading line guide
+ */
+
+// Finds the lines of text in the part of the low resolution image that the main image covers,
+// so that the preview can pick out the one being read. That's all of it, except under
+// --overview, when the lores stream sees the whole field of view. The search is done by a
+// TextLineFinder, with its "threshold", "min_height" and "min_gap" parameters.
+
+// Like the TfStage, the search runs asynchronously every "refresh_rate" frames on a copy
+// of the image, so it never holds up the frames. The stage adds the most recent results to
+// every frame's metadata as "reading_line.lines", a std::vector<float> of the top and bottom
+// of each line as fractions of the main image's height, and "reading_line.age", the number
+// of frames since the image that they were found in.
+
+#include <future>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+#include "post_processing_stages/text_line_finder.hpp"
+
+using Stream = libcamera::Stream;
+
+class ReadingLineStage : public PostProcessingStage
+{
+public:
+	ReadingLineStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	void findLines();
+
+	struct Config
+	{
+		int refresh_rate;
+		TextLineFinder::Config finder;
+		bool verbose;
+	} config_;
+	Stream *stream_;
+	TextLineFinder finder_;
+	std::mutex future_mutex_;
+	std::unique_ptr<std::future<void>> future_;
+	ImageCache::Image lores_copy_;
+	float copy_region_[4];
+	unsigned int copy_sequence_;
+	std::mutex output_mutex_;
+	std::vector<float> lines_;
+	unsigned int lines_sequence_;
+	bool have_lines_;
+};
+
+#define NAME "reading_line"
+
+char const *ReadingLineStage::Name() const
+{
+	return NAME;
+}
+
+void ReadingLineStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.refresh_rate = params.get<int>("refresh_rate", 3);
+	config_.finder.threshold = params.get<float>("threshold", 0.25);
+	config_.finder.min_height = params.get<float>("min_height", 0.02);
+	config_.finder.min_gap = params.get<float>("min_gap", 0.01);
+	config_.verbose = params.get<int>("verbose", 0);
+}
+
+void ReadingLineStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_)
+		LOG(1, "ReadingLine: no low resolution stream, reading line disabled");
+	else
+	{
+		finder_ = TextLineFinder(config_.finder);
+		finder_.Configure(info.width, info.height, info.stride);
+	}
+	lines_.clear();
+	have_lines_ = false;
+}
+
+bool ReadingLineStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	{
+		std::unique_lock<std::mutex> lck(future_mutex_);
+		if (config_.refresh_rate && completed_request->sequence % config_.refresh_rate == 0 &&
+			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		{
+			// Only the Y plane is needed, but the whole copy can be shared with other stages.
+			// Searching it in cached memory is much quicker anyway.
+			lores_copy_ = GetImage(completed_request, stream_, ImageCache::YUV420);
+			FrameRegion(completed_request, copy_region_);
+			copy_sequence_ = completed_request->sequence;
+
+			future_ = std::make_unique<std::future<void>>();
+			*future_ = std::async(std::launch::async, [this] {
+				auto time_taken = ExecutionTime<std::micro>(&ReadingLineStage::findLines, this).count();
+
+				if (config_.verbose)
+					LOG(1, "ReadingLine: search time: " << time_taken << " us");
+			});
+		}
+	}
+
+	std::unique_lock<std::mutex> lock(output_mutex_);
+	if (have_lines_)
+	{
+		completed_request->post_process_metadata.Set("reading_line.lines", lines_);
+		completed_request->post_process_metadata.Set("reading_line.age",
+													 completed_request->sequence - lines_sequence_);
+	}
+
+	return false;
+}
+
+void ReadingLineStage::findLines()
+{
+	std::vector<float> lines = finder_.Find(lores_copy_->data(), copy_region_);
+
+	std::unique_lock<std::mutex> lock(output_mutex_);
+	lines_ = std::move(lines);
+	lines_sequence_ = copy_sequence_;
+	have_lines_ = true;
+}
+
+void ReadingLineStage::Stop()
+{
+	if (future_)
+		future_->wait();
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new ReadingLineStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * rendezvous_stage.cpp - wait for other stages to reach the same request, for testing
+ */
+
+// Each "rendezvous" stage waits in Process() until "count" of them (itself included) have
+// started on the same request, or "timeout" ms have gone by. They can only all meet if the
+// post-processor runs them at the same time, so this shows that stages which don't depend on
+// one another really do run side by side, however many cores there are. When the camera
+// stops, each logs how many requests it met the others on and how many it gave up on.
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+class RendezvousStage : public PostProcessingStage
+{
+public:
+	RendezvousStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+private:
+	unsigned int count_;
+	unsigned int timeout_;
+	unsigned int met_;
+	unsigned int timed_out_;
+};
+
+#define NAME "rendezvous"
+
+// Shared by all the rendezvous stages, counting the ones that have started on each request.
+static std::mutex arrivals_mutex;
+static std::condition_variable arrivals_cv;
+static std::map<unsigned int, unsigned int> arrivals;
+
+char const *RendezvousStage::Name() const
+{
+	return NAME;
+}
+
+void RendezvousStage::Read(boost::property_tree::ptree const &params)
+{
+	count_ = params.get<unsigned int>("count", 2);
+	timeout_ = params.get<unsigned int>("timeout", 1000);
+}
+
+void RendezvousStage::Configure()
+{
+	met_ = timed_out_ = 0;
+	std::lock_guard<std::mutex> lock(arrivals_mutex);
+	arrivals.clear();
+}
+
+bool RendezvousStage::Process(CompletedRequestPtr &completed_request)
+{
+	unsigned int sequence = completed_request->sequence;
+	std::unique_lock<std::mutex> lock(arrivals_mutex);
+	arrivals[sequence]++;
+	arrivals_cv.notify_all();
+	bool met = arrivals_cv.wait_for(lock, std::chrono::milliseconds(timeout_),
+									[this, sequence] { return arrivals[sequence] >= count_; });
+	(met ? met_ : timed_out_)++;
+
+	// Anything this old has been met or given up on long since.
+	arrivals.erase(arrivals.begin(), arrivals.lower_bound(sequence > 100 ? sequence - 100 : 0));
+	return false;
+}
+
+void RendezvousStage::Stop()
+{
+	// Requests still on their way through may be counting.
+	std::lock_guard<std::mutex> lock(arrivals_mutex);
+	LOG(1, "Rendezvous: met on " << met_ << " requests, timed out on " << timed_out_);
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new RendezvousStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -0,0 +1,204 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * roi_metering_stage.cpp - expose for the part of the image that's on the display
+ */
+
+// The camera's AE meters the whole sensor image, whatever the zoom, so zooming onto a white
+// page leaves the page over-exposed and the text washed out (or a dark page the other way).
+// This stage meters just what is being shown instead, and nudges the exposure with the
+// ExposureValue control until it's right.
+
+// The lores stream shares the camera's crop, so the image to meter is normally all of it.
+// While the preview is animating a zoom it shows less than the camera's crop, and with the
+// overview the lores stream isn't cropped at all, so in those cases the part of the lores
+// image that's on the display is worked out from the crops.
+
+// The "quantile" of the luma histogram of that part is brought to "target" (0 is black and 1
+// white). To keep out of a fight with the AE, which is still chasing its own target, changes
+// are made at most every "interval" ms, only when the error is more than "deadband" stops,
+// by "gain" times the error and never more than "max_step" stops at once. The correction
+// stays within "max_ev" stops either side of the --ev setting.
+
+// Once the view stops moving, the stage times how long the exposure takes to settle within
+// the deadband, logging it and writing it to the --metrics-file. It adds "roi_metering.ev",
+// the correction in stops, to the metadata, and "roi_metering.region", the part of the full
+// field of view being metered (x, y, w, h as fractions), which it also logs when it moves.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/histogram.hpp"
+#include "post_processing_stages/luma_threshold.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+// Near enough the camera's tone curve, to turn a luma ratio into stops.
+static constexpr float GAMMA = 2.2;
+
+class RoiMeteringStage : public PostProcessingStage
+{
+public:
+	RoiMeteringStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	struct Config
+	{
+		float quantile;
+		float target;
+		unsigned int interval;
+		float deadband;
+		float gain;
+		float max_step;
+		float max_ev;
+		int verbose;
+	} config_;
+	Stream *stream_;
+	StreamInfo info_;
+	LumaThreshold counter_;
+	float black_, white_;
+	std::mutex mutex_;
+	float ev_;
+	float last_view_[4];
+	std::chrono::steady_clock::time_point last_update_;
+	std::chrono::steady_clock::time_point view_changed_;
+	bool settling_;
+};
+
+#define NAME "roi_metering"
+
+char const *RoiMeteringStage::Name() const
+{
+	return NAME;
+}
+
+void RoiMeteringStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.quantile = params.get<float>("quantile", 0.5);
+	config_.target = params.get<float>("target", 0.45);
+	config_.interval = params.get<unsigned int>("interval", 250);
+	config_.deadband = params.get<float>("deadband", 0.15);
+	config_.gain = params.get<float>("gain", 0.5);
+	config_.max_step = params.get<float>("max_step", 0.5);
+	config_.max_ev = params.get<float>("max_ev", 2.0);
+	config_.verbose = params.get<int>("verbose", 0);
+
+	if (config_.quantile < 0 || config_.quantile > 1 || config_.target <= 0 || config_.target >= 1)
+		throw std::runtime_error("RoiMeteringStage: need 0 <= quantile <= 1 and 0 < target < 1");
+	config_.gain = std::clamp(config_.gain, 0.0f, 1.0f); // any more and it overshoots
+}
+
+void RoiMeteringStage::Configure()
+{
+	stream_ = app_->LoresStream(&info_);
+	if (!stream_)
+	{
+		LOG(1, "RoiMetering: no low resolution stream, metering follows the AE");
+		return;
+	}
+
+	bool full_range = info_.colour_space && info_.colour_space->range == libcamera::ColorSpace::Range::Full;
+	black_ = full_range ? 0 : 16;
+	white_ = full_range ? 255 : 235;
+	counter_.Configure(info_.width, info_.height, info_.stride);
+	ev_ = 0;
+	std::fill_n(last_view_, 4, 0);
+	last_update_ = std::chrono::steady_clock::time_point();
+	settling_ = false;
+}
+
+bool RoiMeteringStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	float roi[4];
+	ShownRegion(completed_request, roi);
+
+	uint32_t counts[256];
+	{
+		BufferReadSync r(app_, completed_request->buffers[stream_]);
+		if (!counter_.Count(r.Get()[0].data(), roi, counts))
+			return false;
+	}
+	Histogram histogram(counts, 256);
+	if (!histogram.Total())
+		return false;
+	float level = std::clamp<float>((histogram.Quantile(config_.quantile) - black_) / (white_ - black_), 0.01, 1);
+	float error = GAMMA * std::log2(config_.target / level);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto now = std::chrono::steady_clock::now();
+	completed_request->post_process_metadata.Set("roi_metering.ev", ev_);
+	// Zooming without the preview animating it changes the camera's crop but not the lores
+	// region, so watch the field of view where we can.
+	std::array<float, 4> region;
+	bool have_region = FieldOfView(completed_request, roi, region.data());
+	if (have_region)
+		completed_request->post_process_metadata.Set("roi_metering.region", region);
+	float const *view = have_region ? region.data() : roi;
+
+	bool moved = false;
+	for (unsigned int i = 0; i < 4; i++)
+		moved |= std::abs(view[i] - last_view_[i]) > 0.01;
+	if (moved)
+	{
+		std::copy_n(view, 4, last_view_);
+		view_changed_ = now;
+		settling_ = true;
+		if (config_.verbose && have_region)
+			LOG(1, "RoiMetering: metering region " << region[0] << "," << region[1] << "," << region[2] << ","
+												   << region[3]);
+	}
+	else if (settling_ && std::abs(error) < config_.deadband)
+	{
+		settling_ = false;
+		double ms = std::chrono::duration<double, std::milli>(now - view_changed_).count();
+		if (config_.verbose)
+			LOG(1, "RoiMetering: exposure settled in " << ms << "ms, correction " << ev_ << " stops");
+		std::stringstream line;
+		line << "{ \"event\": \"exposure\", \"ms\": " << ms << ", \"ev\": " << ev_ << " }";
+		app_->WriteMetrics(line.str());
+	}
+
+	if (now - last_update_ < std::chrono::milliseconds(config_.interval) || std::abs(error) < config_.deadband)
+		return false;
+
+	float step = std::clamp(config_.gain * error, -config_.max_step, config_.max_step);
+	float ev = std::clamp(ev_ + step, -config_.max_ev, config_.max_ev);
+	if (ev == ev_)
+		return false;
+	ev_ = ev;
+	last_update_ = now;
+
+	libcamera::ControlList controls;
+	controls.set(libcamera::controls::ExposureValue, app_->GetOptions()->ev + ev_);
+	app_->SetControls(controls);
+	if (config_.verbose >= 2)
+		LOG(1, "RoiMetering: level " << level << ", correction now " << ev_ << " stops");
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new RoiMeteringStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
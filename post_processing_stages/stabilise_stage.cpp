@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * stabilise_stage.cpp - digital image stabilisation
+ */
+
+// Measures how far the whole picture moves between consecutive low resolution frames, and
+// works out a crop of the frame that cancels the shake. The crop is slightly smaller than
+// the frame, by "margin" (as a fraction of its size), and it can move around by up to half
+// the margin either way. "smoothing" is how much of the correction is kept from one frame
+// to the next, so that slower, deliberate movements of the camera drift back through.
+
+// The stage adds "stabilise.crop" to the metadata, as a std::array<float, 4> of x, y, width
+// and height as fractions of the frame. The EGL preview applies it to the image it shows.
+
+// The camera's crop changing (when zooming) makes consecutive frames incomparable, so the
+// measurement starts again whenever that happens.
+
+// With the --overview the lores stream isn't cropped at all, so the motion it shows is scaled
+// up by the zoom (the size of the lores image over that of the frame within it) to give the
+// motion in the frame that's displayed.
+
+#include <array>
+#include <chrono>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+
+#include "post_processing_stages/motion_estimator.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+using Stream = libcamera::Stream;
+
+class StabiliseStage : public PostProcessingStage
+{
+public:
+	StabiliseStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	struct Config
+	{
+		float margin;
+		float smoothing;
+		MotionEstimator::Config estimator;
+		bool verbose;
+	} config_;
+	Stream *stream_;
+	unsigned int width_, height_;
+	MotionEstimator estimator_;
+	Rectangle scaler_crop_;
+	float correction_x_, correction_y_;
+	unsigned int frames_;
+	double estimate_time_;
+	std::mutex mutex_;
+};
+
+#define NAME "stabilise"
+
+char const *StabiliseStage::Name() const
+{
+	return NAME;
+}
+
+void StabiliseStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.margin = params.get<float>("margin", 0.1);
+	config_.smoothing = params.get<float>("smoothing", 0.95);
+	config_.estimator.decimate = params.get<unsigned int>("decimate", 2);
+	config_.estimator.search = params.get<int>("search", 12);
+	config_.estimator.grid_cols = params.get<unsigned int>("grid_cols", 6);
+	config_.estimator.grid_rows = params.get<unsigned int>("grid_rows", 4);
+	config_.estimator.min_contrast = params.get<unsigned int>("min_contrast", 4);
+	config_.verbose = params.get<int>("verbose", 0);
+
+	config_.margin = std::clamp(config_.margin, 0.0f, 0.5f);
+	config_.smoothing = std::clamp(config_.smoothing, 0.0f, 1.0f);
+}
+
+void StabiliseStage::Configure()
+{
+	StreamInfo info;
+	stream_ = app_->LoresStream(&info);
+	if (!stream_)
+	{
+		LOG(1, "Stabilise: no low resolution stream, stabilisation disabled");
+		return;
+	}
+
+	width_ = info.width;
+	height_ = info.height;
+	estimator_ = MotionEstimator(config_.estimator);
+	estimator_.Configure(info.width, info.height, info.stride);
+	scaler_crop_ = Rectangle();
+	correction_x_ = correction_y_ = 0;
+	frames_ = 0;
+	estimate_time_ = 0;
+}
+
+bool StabiliseStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	BufferReadSync r(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = r.Get()[0];
+
+	// We need to protect the estimator's previous frame and the correction.
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto scaler_crop = completed_request->metadata.get(libcamera::controls::ScalerCrop);
+	if (scaler_crop && *scaler_crop != scaler_crop_)
+	{
+		scaler_crop_ = *scaler_crop;
+		estimator_.Reset();
+	}
+
+	float dx = 0, dy = 0;
+	auto start = std::chrono::steady_clock::now();
+	estimator_.Estimate(buffer.data(), dx, dy);
+	estimate_time_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// How many times bigger the displayed frame makes things than the lores one does.
+	float frame[4];
+	FrameRegion(completed_request, frame);
+	float scale_x = 1 / frame[2], scale_y = 1 / frame[3];
+
+	// The picture moving right means moving the crop right to follow it.
+	float limit = config_.margin / 2;
+	correction_x_ = std::clamp(config_.smoothing * (correction_x_ + scale_x * dx / width_), -limit, limit);
+	correction_y_ = std::clamp(config_.smoothing * (correction_y_ + scale_y * dy / height_), -limit, limit);
+
+	std::array<float, 4> crop = { limit + correction_x_, limit + correction_y_, 1 - config_.margin,
+								  1 - config_.margin };
+	completed_request->post_process_metadata.Set("stabilise.crop", crop);
+
+	if (config_.verbose && ++frames_ == 100)
+	{
+		LOG(1, "Stabilise: " << estimate_time_ / frames_ << "ms per frame");
+		frames_ = 0;
+		estimate_time_ = 0;
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new StabiliseStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
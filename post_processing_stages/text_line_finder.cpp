@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * text_line_finder.cpp - find the lines of text in a greyscale image
+ */
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "post_processing_stages/text_line_finder.hpp"
+
+TextLineFinder::TextLineFinder() : TextLineFinder(Config())
+{
+}
+
+TextLineFinder::TextLineFinder(Config const &config) : config_(config), width_(0), height_(0), stride_(0)
+{
+}
+
+void TextLineFinder::Configure(unsigned int width, unsigned int height, unsigned int stride)
+{
+	width_ = width;
+	height_ = height;
+	stride_ = stride;
+}
+
+std::vector<float> TextLineFinder::Find(uint8_t const *image, float const region[4]) const
+{
+	unsigned int x0 = std::clamp<float>(region[0] * width_, 0, width_);
+	unsigned int y0 = std::clamp<float>(region[1] * height_, 0, height_);
+	unsigned int width = std::clamp<float>(region[2] * width_, 0, width_ - x0);
+	unsigned int height = std::clamp<float>(region[3] * height_, 0, height_ - y0);
+	if (width < 2 || !height)
+		return {};
+
+	// The horizontal projection profile of the brightness changes along each row.
+	std::vector<float> profile(height);
+	for (unsigned int y = 0; y < height; y++)
+	{
+		uint8_t const *row = image + (y0 + y) * stride_ + x0;
+		unsigned int sum = 0;
+		for (unsigned int x = 1; x < width; x++)
+			sum += std::abs(row[x] - row[x - 1]);
+		profile[y] = sum;
+	}
+
+	// Smooth it over about half the smallest line height, so that the gaps between the
+	// letters' strokes don't break a line up.
+	int radius = std::max<int>(1, config_.min_height * height / 4);
+	std::vector<float> smoothed(height);
+	for (int y = 0; y < (int)height; y++)
+	{
+		int lo = std::max(0, y - radius), hi = std::min<int>(height - 1, y + radius);
+		float sum = 0;
+		for (int i = lo; i <= hi; i++)
+			sum += profile[i];
+		smoothed[y] = sum / (hi - lo + 1);
+	}
+
+	std::vector<float> sorted(smoothed);
+	std::nth_element(sorted.begin(), sorted.begin() + height / 2, sorted.end());
+	float median = sorted[height / 2];
+	float peak = *std::max_element(smoothed.begin(), smoothed.end());
+	float threshold = median + config_.threshold * (peak - median);
+
+	std::vector<float> lines;
+	unsigned int min_height = config_.min_height * height, min_gap = config_.min_gap * height;
+	for (unsigned int y = 0; y < height;)
+	{
+		if (smoothed[y] <= threshold || peak <= median)
+		{
+			y++;
+			continue;
+		}
+		unsigned int top = y;
+		while (y < height && smoothed[y] > threshold)
+			y++;
+		if (!lines.empty() && top - lines.back() * height < min_gap)
+			lines.back() = (float)y / height;
+		else if (y - top >= min_height)
+		{
+			lines.push_back((float)top / height);
+			lines.push_back((float)y / height);
+		}
+	}
+
+	return lines;
+}
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * text_line_finder.hpp - find the lines of text in a greyscale image
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Finds the lines of text in part of a greyscale image. Every row is scored by how much the
+// brightness changes along it, which is high through text and low in the gaps between lines,
+// whichever way round the text is. After smoothing, runs of rows scoring above "threshold"
+// (as a fraction of the way from the median row to the highest one) are the lines, discarding
+// any shorter than "min_height" and joining any separated by less than "min_gap" (both as
+// fractions of the height searched).
+
+class TextLineFinder
+{
+public:
+	struct Config
+	{
+		float threshold = 0.25;
+		float min_height = 0.02;
+		float min_gap = 0.01;
+	};
+
+	TextLineFinder();
+	explicit TextLineFinder(Config const &config);
+
+	void Configure(unsigned int width, unsigned int height, unsigned int stride);
+
+	// Returns the top and bottom of each line of text in the region of the image given by x, y,
+	// width and height as fractions of it. They are fractions of the region's height.
+	std::vector<float> Find(uint8_t const *image, float const region[4]) const;
+
+private:
+	Config config_;
+	unsigned int width_, height_, stride_;
+};
@@ -100,13 +100,9 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
-
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
-			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			// Only take the copy of the image here, which other stages can share, and leave
+			// the conversion for the model to the asynchronous thread.
+			lores_copy_ = GetImage(completed_request, lores_stream_, ImageCache::YUV420);
 
 			future_ = std::make_unique<std::future<void>>();
 			*future_ = std::async(std::launch::async, [this] {
@@ -129,19 +125,17 @@ void TfStage::runInference()
 	int input = interpreter_->inputs()[0];
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
 
+	// A uint8 model takes the RGB image as it is, so it can be converted straight into the tensor.
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
-	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
-	}
+		Yuv420ToRgb(interpreter_->typed_tensor<uint8_t>(input), tf_info, lores_copy_->data(), lores_info_);
 	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 	{
+		rgb_image_.resize(tf_info.height * tf_info.stride);
+		Yuv420ToRgb(rgb_image_.data(), tf_info, lores_copy_->data(), lores_info_);
 		float *tensor = interpreter_->typed_tensor<float>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+		for (unsigned int i = 0; i < rgb_image_.size(); i++)
+			tensor[i] = (rgb_image_[i] - config_->normalisation_offset) / config_->normalisation_scale;
 	}
 
 	if (interpreter_->Invoke() != kTfLiteOk)
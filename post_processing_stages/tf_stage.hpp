@@ -101,6 +101,7 @@ private:
 
 	std::mutex future_mutex_;
 	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	ImageCache::Image lores_copy_;
+	std::vector<uint8_t> rgb_image_;
 	std::mutex output_mutex_;
 };
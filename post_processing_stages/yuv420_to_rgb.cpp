@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * yuv420_to_rgb.cpp - convert YUV420 images to RGB for the post-processing stages
+ */
+
+// The conversion is done in fixed point, with the coefficients scaled up by 2^14. Results are
+// rounded down, as the original floating point version's were, so they match it to within one.
+
+// Each row is gathered first into rows of Y, U and V with a value for every output pixel,
+// which takes care of the crop, the scaling and the chroma subsampling all at once, and then
+// converted with whatever vector instructions we have.
+
+#include <algorithm>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "post_processing_stage.hpp"
+
+using Rectangle = libcamera::Rectangle;
+
+static constexpr int SHIFT = 14;
+static constexpr int R_V = 22970; // 1.402
+static constexpr int G_U = 5652; // 0.345
+static constexpr int G_V = 11698; // 0.714
+static constexpr int B_U = 29016; // 1.771
+
+// Below this many output pixels, starting threads costs more than it saves.
+static constexpr unsigned int THREAD_PIXELS = 640 * 480;
+static constexpr unsigned int MAX_THREADS = 4;
+
+static inline uint8_t clamp_shift(int value)
+{
+	return std::clamp(value >> SHIFT, 0, 255);
+}
+
+static void convert_row(uint8_t const *y, uint8_t const *u, uint8_t const *v, uint8_t *rgb, unsigned int n)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	int16x8_t offset = vdupq_n_s16(128);
+	for (; x + 8 <= n; x += 8, rgb += 24)
+	{
+		int16x8_t y16 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + x)));
+		int16x8_t u16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u + x))), offset);
+		int16x8_t v16 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v + x))), offset);
+		int32x4_t y_lo = vshll_n_s16(vget_low_s16(y16), SHIFT), y_hi = vshll_n_s16(vget_high_s16(y16), SHIFT);
+
+		int32x4_t r_lo = vmlal_n_s16(y_lo, vget_low_s16(v16), R_V);
+		int32x4_t r_hi = vmlal_n_s16(y_hi, vget_high_s16(v16), R_V);
+		int32x4_t g_lo = vmlsl_n_s16(vmlsl_n_s16(y_lo, vget_low_s16(u16), G_U), vget_low_s16(v16), G_V);
+		int32x4_t g_hi = vmlsl_n_s16(vmlsl_n_s16(y_hi, vget_high_s16(u16), G_U), vget_high_s16(v16), G_V);
+		int32x4_t b_lo = vmlal_n_s16(y_lo, vget_low_s16(u16), B_U);
+		int32x4_t b_hi = vmlal_n_s16(y_hi, vget_high_s16(u16), B_U);
+
+		// The narrowing shifts saturate, which does the clamping for us.
+		uint8x8x3_t out;
+		out.val[0] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(r_lo, SHIFT), vqshrun_n_s32(r_hi, SHIFT)));
+		out.val[1] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(g_lo, SHIFT), vqshrun_n_s32(g_hi, SHIFT)));
+		out.val[2] = vqmovn_u16(vcombine_u16(vqshrun_n_s32(b_lo, SHIFT), vqshrun_n_s32(b_hi, SHIFT)));
+		vst3_u8(rgb, out);
+	}
+#elif defined(__SSE2__)
+	// _mm_madd_epi16 multiplies interleaved (U, V) pairs by a pair of coefficients and adds them.
+	__m128i zero = _mm_setzero_si128(), offset = _mm_set1_epi16(128);
+	__m128i r_coeffs = _mm_set_epi16(R_V, 0, R_V, 0, R_V, 0, R_V, 0);
+	__m128i g_coeffs = _mm_set_epi16(-G_V, -G_U, -G_V, -G_U, -G_V, -G_U, -G_V, -G_U);
+	__m128i b_coeffs = _mm_set_epi16(0, B_U, 0, B_U, 0, B_U, 0, B_U);
+	for (; x + 8 <= n; x += 8)
+	{
+		__m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(y + x)), zero);
+		__m128i u16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(u + x)), zero),
+									offset);
+		__m128i v16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(v + x)), zero),
+									offset);
+		__m128i uv_lo = _mm_unpacklo_epi16(u16, v16), uv_hi = _mm_unpackhi_epi16(u16, v16);
+		__m128i y_lo = _mm_slli_epi32(_mm_unpacklo_epi16(y16, zero), SHIFT);
+		__m128i y_hi = _mm_slli_epi32(_mm_unpackhi_epi16(y16, zero), SHIFT);
+
+		__m128i channels[3];
+		__m128i const *coeffs[3] = { &r_coeffs, &g_coeffs, &b_coeffs };
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			__m128i lo = _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(uv_lo, *coeffs[c])), SHIFT);
+			__m128i hi = _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(uv_hi, *coeffs[c])), SHIFT);
+			// The saturating packs do the clamping for us.
+			__m128i packed = _mm_packs_epi32(lo, hi);
+			channels[c] = _mm_packus_epi16(packed, packed);
+		}
+
+		// SSE2 has no good way to interleave three channels, so leave that to the compiler.
+		alignas(16) uint8_t r[16], g[16], b[16];
+		_mm_store_si128(reinterpret_cast<__m128i *>(r), channels[0]);
+		_mm_store_si128(reinterpret_cast<__m128i *>(g), channels[1]);
+		_mm_store_si128(reinterpret_cast<__m128i *>(b), channels[2]);
+		for (unsigned int i = 0; i < 8; i++, rgb += 3)
+			rgb[0] = r[i], rgb[1] = g[i], rgb[2] = b[i];
+	}
+#endif
+	for (; x < n; x++, rgb += 3)
+	{
+		int Y = y[x] << SHIFT, U = u[x] - 128, V = v[x] - 128;
+		rgb[0] = clamp_shift(Y + R_V * V);
+		rgb[1] = clamp_shift(Y - G_U * U - G_V * V);
+		rgb[2] = clamp_shift(Y + B_U * U);
+	}
+}
+
+// The source pixel nearest the middle of each destination one.
+static inline unsigned int nearest(unsigned int i, unsigned int crop_size, unsigned int dst_size)
+{
+	return ((2 * i + 1) * crop_size) / (2 * dst_size);
+}
+
+static void convert_rows(uint8_t *dst, StreamInfo const &dst_info, const uint8_t *src, StreamInfo const &src_info,
+						 Rectangle const &crop, std::vector<unsigned int> const &columns, unsigned int y0,
+						 unsigned int y1)
+{
+	const uint8_t *src_U = src + src_info.height * src_info.stride;
+	const uint8_t *src_V = src_U + (src_info.height / 2) * (src_info.stride / 2);
+	bool scaled = crop.width != dst_info.width;
+
+	std::vector<uint8_t> rows(dst_info.width * 3);
+	uint8_t *row_Y = rows.data(), *row_U = row_Y + dst_info.width, *row_V = row_U + dst_info.width;
+	for (unsigned int y = y0; y < y1; y++)
+	{
+		unsigned int src_y = crop.y + nearest(y, crop.height, dst_info.height);
+		const uint8_t *Y = src + src_y * src_info.stride;
+		const uint8_t *U = src_U + (src_y / 2) * (src_info.stride / 2);
+		const uint8_t *V = src_V + (src_y / 2) * (src_info.stride / 2);
+		for (unsigned int x = 0; x < dst_info.width; x++)
+		{
+			row_U[x] = U[columns[x] / 2];
+			row_V[x] = V[columns[x] / 2];
+		}
+		if (scaled)
+		{
+			for (unsigned int x = 0; x < dst_info.width; x++)
+				row_Y[x] = Y[columns[x]];
+		}
+		convert_row(scaled ? row_Y : Y + crop.x, row_U, row_V, dst + y * dst_info.stride, dst_info.width);
+	}
+}
+
+void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, StreamInfo const &dst_info, const uint8_t *src,
+									  StreamInfo const &src_info, Rectangle const &crop)
+{
+	Rectangle area = crop;
+	if (area.isNull())
+	{
+		if (src_info.width < dst_info.width || src_info.height < dst_info.height)
+			throw std::runtime_error("Yuv420ToRgb: destination larger than the source image");
+		area = Rectangle(((src_info.width - dst_info.width) / 2) & ~1, ((src_info.height - dst_info.height) / 2) & ~1,
+						 dst_info.width, dst_info.height);
+	}
+	if (area.x < 0 || area.y < 0 || area.x + area.width > src_info.width || area.y + area.height > src_info.height)
+		throw std::runtime_error("Yuv420ToRgb: crop outside the source image");
+	if (!dst_info.width || !dst_info.height || !area.width || !area.height)
+		return;
+
+	std::vector<unsigned int> columns(dst_info.width);
+	for (unsigned int x = 0; x < dst_info.width; x++)
+		columns[x] = area.x + nearest(x, area.width, dst_info.width);
+
+	// Split big images into bands of rows, doing the last one on this thread.
+	unsigned int threads = 1;
+	if (dst_info.width * dst_info.height >= THREAD_PIXELS)
+		threads = std::clamp(std::thread::hardware_concurrency(), 1u, MAX_THREADS);
+	std::vector<std::future<void>> futures;
+	for (unsigned int i = 0; i + 1 < threads; i++)
+		futures.push_back(std::async(std::launch::async, convert_rows, dst, std::cref(dst_info), src,
+									 std::cref(src_info), std::cref(area), std::cref(columns),
+									 dst_info.height * i / threads, dst_info.height * (i + 1) / threads));
+	convert_rows(dst, dst_info, src, src_info, area, columns, dst_info.height * (threads - 1) / threads,
+				 dst_info.height);
+	for (auto &future : futures)
+		future.get();
+}
+
+std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
+{
+	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
+	Yuv420ToRgb(output.data(), dst_info, src, src_info);
+	return output;
+}
@@ -2,11 +2,32 @@
 /*
  * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
  *
- * egl_preview.cpp - X/EGL-based preview window.
+ * egl_preview.cpp - X/EGL-based preview window, which can also go straight to KMS.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
@@ -17,6 +38,12 @@
 
 #include <libdrm/drm_fourcc.h>
 
+#if LIBGBM_PRESENT
+#include <gbm.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#endif
+
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 // We don't use Status below, so we could consider #undefining it here.
@@ -82,7 +109,146 @@ std::string SC_MEGASHADER = "#extension GL_OES_EGL_image_external : enable\n"
     "}"
     "";
 
-const uint NUM_SHADERS = 9;
+// The sharpen and edge outline modes follow the colour mappings in the rotation, but are
+// drawn by the multi-pass path below rather than by the megashader.
+const uint NUM_SHADERS = 11;
+
+// Copies the camera image into an offscreen target for the sharpen passes.
+std::string SC_COPY_SHADER = "#extension GL_OES_EGL_image_external : enable\n"
+	"precision mediump float;\n"
+	"uniform samplerExternalOES s;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture2D(s, texcoord);\n"
+	"}\n";
+
+// Temporal denoise. Blends the camera image with the previous result, weighted per pixel
+// by how much it has changed, so that still text is averaged over many frames while
+// anything that moves follows the camera straight away.
+std::string SC_DENOISE_SHADER = "#extension GL_OES_EGL_image_external : enable\n"
+	"precision mediump float;\n"
+	"uniform samplerExternalOES s;\n"
+	"uniform sampler2D history;\n"
+	"uniform float u_Strength;\n"
+	"varying vec2 texcoord;\n"
+	"void main() {\n"
+	"	vec4 current = texture2D(s, texcoord);\n"
+	"	vec4 previous = texture2D(history, texcoord);\n"
+	"	float diff = abs(dot(current.rgb - previous.rgb, vec3(0.299, 0.587, 0.114)));\n"
+	"	float weight = u_Strength * (1.0 - smoothstep(0.02, 0.1, diff));\n"
+	"	gl_FragColor = mix(current, previous, weight);\n"
+	"}\n";
+
+std::string SC_TEXT_SHADER = "precision mediump float;\n"
+	"varying vec2 TexCoords;\n"
+
+	"uniform sampler2D text;\n"
+	"uniform vec3 textColor;\n"
+	"uniform float opacity;\n"
+
+	"void main() {\n"
+	"	vec4 sampled = vec4(1.0, 1.0, 1.0, texture2D(text, TexCoords).r);\n"
+	"	gl_FragColor = vec4(textColor, opacity) * sampled;\n"
+	"}\n";
+
+std::string SC_RECT_SHADER = "precision mediump float;\n"
+	"uniform vec3 color;\n"
+	"uniform float opacity;\n"
+
+	"void main() {\n"
+	"	gl_FragColor = vec4(color.xyz, opacity);\n"
+	"}\n";
+
+// The same shader source, but reading from one of our own offscreen targets rather than
+// straight from the camera.
+static std::string with_sampler_2d(std::string source)
+{
+	static const std::string external = "samplerExternalOES";
+	for (size_t pos = source.find(external); pos != std::string::npos; pos = source.find(external, pos))
+		source.replace(pos, external.size(), "sampler2D");
+	return source;
+}
+
+// The binarised modes only want luma, so they can read the camera's Y plane directly as a
+// single channel texture, which saves the driver converting YUV to RGB for every fetch. The
+// Y values are expanded from narrow range where necessary, and returned as grey.
+static std::string with_luma_sampler(std::string source)
+{
+	source = with_sampler_2d(source);
+	static const std::string fetch = "texture2D(s, texcoord)";
+	for (size_t pos = source.find(fetch); pos != std::string::npos; pos = source.find(fetch, pos))
+		source.replace(pos, fetch.size(), "sample_luma(texcoord)");
+	size_t main = source.find("void main()");
+	if (main == std::string::npos)
+		throw std::runtime_error("shader has no main() to add luma sampling to");
+	source.insert(main, "uniform vec2 u_LumaRange;\n"
+						"vec4 sample_luma(vec2 coord) {\n"
+						"	float y = (texture2D(s, coord).r - u_LumaRange.x) * u_LumaRange.y;\n"
+						"	return vec4(y, y, y, 1.0);\n"
+						"}\n");
+	return source;
+}
+
+// The blur is separable, so we have one pass for each direction. Each kernel size gets its
+// own pair of programs so that the taps are unrolled with the weights baked in.
+static const unsigned int NUM_SHARPEN_LEVELS = 3;
+static const int sharpenRadius[NUM_SHARPEN_LEVELS] = { 4, 2, 1 };
+
+static std::string blur_taps(int radius)
+{
+	float sigma = (radius + 1) / 2.0;
+	std::vector<float> weights;
+	float total = 0;
+	for (int i = -radius; i <= radius; i++)
+	{
+		weights.push_back(exp(-(i * i) / (2 * sigma * sigma)));
+		total += weights.back();
+	}
+
+	std::string taps = "	vec4 blur = vec4(0.0);\n";
+	for (int i = -radius; i <= radius; i++)
+		taps += "	blur += " + std::to_string(weights[i + radius] / total) + " * texture2D(s, texcoord + " +
+				std::to_string(i) + ".0 * u_Step);\n";
+	return taps;
+}
+
+static std::string make_blur_shader(int radius)
+{
+	return "precision mediump float;\n"
+		"uniform sampler2D s;\n"
+		"uniform vec2 u_Step;\n"
+		"varying vec2 texcoord;\n"
+		"void main() {\n" +
+		blur_taps(radius) +
+		"	gl_FragColor = blur;\n"
+		"}\n";
+}
+
+// The final pass does the vertical blur and combines it with the original image, either as
+// an unsharp mask or by drawing the difference over the top as an outline.
+static std::string make_combine_shader(int radius)
+{
+	return "precision mediump float;\n"
+		"uniform sampler2D s;\n" // The horizontally blurred image.
+		"uniform sampler2D original;\n"
+		"uniform vec2 u_Step;\n"
+		"uniform float u_Strength;\n"
+		"uniform float u_Edge;\n"
+		"uniform float u_Contrast;\n"
+		"varying vec2 texcoord;\n"
+		"void main() {\n" +
+		blur_taps(radius) +
+		"	vec3 colour = texture2D(original, texcoord).rgb;\n"
+		"	if (u_Edge > 0.5) {\n"
+		"		float edge = clamp(length(colour - blur.rgb) * u_Strength * 4.0, 0.0, 1.0);\n"
+		"		colour = mix(colour, vec3(1.0, 1.0, 0.0), edge);\n" // yellow outlines
+		"	} else {\n"
+		"		colour += (colour - blur.rgb) * u_Strength;\n"
+		"	}\n"
+		"	colour = ((colour - 0.5) * max(u_Contrast, 0.0)) + 0.5;\n"
+		"	gl_FragColor = vec4(clamp(colour, 0.0, 1.0), 1.0);\n"
+		"}\n";
+}
 
 struct Vec2 {
 	int x;
@@ -102,6 +268,20 @@ struct Character {
 
 std::map<char, Character> Characters;
 
+struct ProgramSet;
+
+// The colour mappings are drawn either straight from the camera image, from just its luma,
+// or, when an earlier pass has already processed it, from one of the offscreen targets.
+enum ColourSource { CAMERA_SOURCE, OFFSCREEN_SOURCE, LUMA_SOURCE, NUM_COLOUR_SOURCES };
+
+// The --reading-line settings.
+enum ReadingLineMode { READING_LINE_OFF, READING_LINE_HIGHLIGHT, READING_LINE_MASK };
+
+static GLenum source_target(ColourSource source)
+{
+	return source == CAMERA_SOURCE ? GL_TEXTURE_EXTERNAL_OES : GL_TEXTURE_2D;
+}
+
 class EglPreview : public Preview
 {
 public:
@@ -110,7 +290,11 @@ public:
 	virtual void SetInfoText(const std::string &text) override;
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
+	// The frame is drawn by the render thread, which always shows the newest one it has.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	virtual void SetFrameData(PreviewFrameData const &data) override;
+	virtual PreviewStats GetStats() const override;
+	virtual double RenderImage(RgbImage const &input, int mode, unsigned int repeat, RgbImage &output) override;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
@@ -127,7 +311,16 @@ public:
 	void glRenderText(std::string = "", float x = 0, float y = 0, float scale = 1, float r = 1, float g = 1, float b = 1, float opacity = 1) override;
 	void setShaderValues(float a, float b, float c, float d);
 	int getShaderIndex();
+	void setShaderIndex(int index) override;
 	void glRenderRect(float x, float y, float w, float h, float r, float g, float b, float opacity);
+	void setSharpenStrength(float strength) override;
+	void setFreeze(bool freeze) override;
+	bool isFrozen() const override { return frozen_; }
+	void stepFreezeFrame(int amount) override;
+	void setFreezeView(float zoom, float x, float y) override;
+	bool setZoomTarget(float const crop[4]) override;
+	bool getZoomCrop(float shown[4], float target[4]) const override;
+	void setReducedFeatures(unsigned int features) override { reduced_features_ = features; }
 private:
 	struct Buffer
 	{
@@ -136,15 +329,84 @@ private:
 		size_t size;
 		StreamInfo info;
 		GLuint texture;
+		GLuint luma_texture; // 0 if the Y plane couldn't be imported on its own
+		float luma_range[2]; // offset and scale to full range
+	};
+	struct Frame
+	{
+		int fd = -1;
+		size_t size = 0;
+		StreamInfo info;
+		PreviewFrameData data;
 	};
 	void makeWindow(char const *name);
+	void makeHeadless();
+#if LIBGBM_PRESENT
+	void makeKms();
+	bool findKmsOutput(drmModeModeInfo &mode);
+	void setupKms(drmModeModeInfo const &mode);
+	void releaseKms();
+	void presentKms();
+#endif
+	void setup(unsigned int width, unsigned int height);
+	void draw(GLuint texture, ColourSource source, bool time_sharpen);
+	double renderImage(RgbImage const &input, int mode, unsigned int repeat, RgbImage &output);
+	void renderThread();
+	bool render(Frame const *frame);
+	void updateStats(double render_ms, double slack_ms, double age_ms, uint64_t input_sequence);
+	void doReset();
+	void startShaderReload();
+	void shaderReloadThread();
+	void applyShaderReload();
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	GLuint renderDenoisePass(GLuint texture);
+	GLuint renderSharpenPasses(GLuint texture, ColourSource source);
+	void drawSharpenCombine(bool edge, GLuint original);
+	void updateSharpenBudget(double time_taken_ms);
+	unsigned int sharpenLevel() const;
+	void updateFreeze();
+	void captureFreezeFrame(GLuint texture, ColourSource source);
+	void getView(float view[4]) const;
+	void setView(GLint location);
+	void drawReadingLine();
+	void updateOverview(PreviewFrameData const &data);
+	void drawOverview();
+	void updateZoom();
 	::Display *display_;
 	EGLDisplay egl_display_;
 	Window window_;
 	EGLContext egl_context_;
 	EGLSurface egl_surface_;
 	std::map<int, Buffer> buffers_; // map the DMABUF's fd to the Buffer
+	// Imported dmabufs, identified by inode, as fds get reused. Each import pins its buffer,
+	// so they all go at Reset(), and there are never more than MAX_IMPORTS.
+	struct ImportKey
+	{
+		dev_t dev;
+		ino_t ino;
+		size_t size;
+		unsigned int width;
+		unsigned int height;
+		unsigned int stride;
+		uint32_t fourcc;
+		EGLint encoding;
+		EGLint range;
+		bool operator<(ImportKey const &other) const
+		{
+			return std::tie(dev, ino, size, width, height, stride, fourcc, encoding, range) <
+				   std::tie(other.dev, other.ino, other.size, other.width, other.height, other.stride, other.fourcc,
+							other.encoding, other.range);
+		}
+	};
+	struct Import
+	{
+		GLuint texture;
+		GLuint luma_texture;
+		uint64_t last_used;
+	};
+	std::map<ImportKey, Import> imports_;
+	uint64_t import_clock_;
+	void evictImports(unsigned int keep);
 	int last_fd_;
 	bool first_time_;
 	Atom wm_delete_window_;
@@ -155,6 +417,107 @@ private:
 	int height_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
+	// For the sharpen and edge outline modes. The strength is set from the application's thread.
+	std::atomic<float> sharpen_strength_;
+	unsigned int sharpen_level_;
+	std::atomic<unsigned int> reduced_features_;
+	double sharpen_time_ms_;
+	unsigned int sharpen_headroom_frames_;
+	GLuint sharpen_queries_[3] = {};
+	unsigned int sharpen_query_count_;
+	bool have_timer_query_;
+	// For the temporal denoise, which ping-pongs between the two history targets.
+	unsigned int history_index_;
+	bool history_valid_;
+	// For freeze-frame. The ring holds the most recent frames, and while frozen we show
+	// the one freeze_age_ frames back from the newest. The application's thread asks for
+	// changes, and the render thread takes them up (adding on the steps it has been asked
+	// for) so that only it changes the age.
+	unsigned int ring_head_;
+	unsigned int ring_count_;
+	std::atomic<bool> freeze_requested_;
+	std::atomic<bool> frozen_;
+	std::atomic<int> freeze_steps_;
+	int freeze_age_;
+	mutable std::mutex freeze_view_mutex_;
+	float freeze_zoom_;
+	float freeze_x_;
+	float freeze_y_;
+	// The render thread, and the "mailbox" holding the newest frame for it to draw.
+	std::thread render_thread_;
+	std::mutex mailbox_mutex_;
+	std::condition_variable mailbox_cond_;
+	Frame pending_;
+	PreviewFrameData next_frame_data_;
+	bool abort_;
+	bool reset_requested_;
+	// Other work that has to happen on the render thread, such as drawing test images.
+	std::function<void()> job_;
+	// What we draw from when there's no new camera frame.
+	GLuint source_texture_;
+	ColourSource source_;
+	float luma_range_[2];
+	// The overview inset of the whole field of view.
+	unsigned int overview_frames_;
+	bool overview_valid_;
+	// The crop of the frame being shown, and the zoom animation towards the target crop. The
+	// application sets the target from its own thread, so zoom_mutex_ protects all of these
+	// but the stabilisation crop.
+	float frame_crop_[4];
+	float stabilise_crop_[4];
+	// The lines of text found in the frame, and the band around the one being read.
+	std::vector<float> reading_lines_;
+	int reading_lines_age_;
+	float reading_band_[2];
+	bool reading_band_valid_;
+	mutable std::mutex zoom_mutex_;
+	bool zoom_active_;
+	float zoom_target_[4];
+	float zoom_shown_[4];
+	float zoom_velocity_[4];
+	std::chrono::steady_clock::time_point zoom_time_;
+	mutable std::mutex stats_mutex_;
+	PreviewStats stats_;
+	unsigned int stats_presents_;
+	std::chrono::steady_clock::time_point last_present_;
+	// Test images are drawn from here, and must all be the same size.
+	GLuint image_texture_;
+	unsigned int image_width_;
+	unsigned int image_height_;
+	// Shader files are watched, and rebuilt, by another thread with its own shared context.
+	EGLConfig config_;
+	EGLContext reload_context_;
+	std::thread reload_thread_;
+	std::atomic<bool> reload_abort_;
+	std::atomic<bool> reload_on_render_thread_;
+	std::mutex reload_mutex_;
+	std::unique_ptr<ProgramSet> reloaded_programs_;
+#if LIBGBM_PRESENT
+	// Direct KMS output, with no X server.
+	struct KmsProperties
+	{
+		uint32_t connector_crtc_id;
+		uint32_t crtc_mode_id;
+		uint32_t crtc_active;
+		uint32_t crtc_out_fence_ptr;
+		uint32_t plane_fb_id;
+		uint32_t plane_crtc_id;
+		uint32_t plane_src[4];
+		uint32_t plane_crtc[4];
+	};
+	int drm_fd_;
+	gbm_device *gbm_device_;
+	gbm_surface *gbm_surface_;
+	uint32_t kms_connector_id_;
+	uint32_t kms_crtc_id_;
+	uint32_t kms_plane_id_;
+	uint32_t kms_mode_blob_;
+	KmsProperties kms_props_;
+	bool kms_modeset_;
+	int kms_out_fence_;
+	gbm_bo *kms_front_bo_; // last buffer committed
+	gbm_bo *kms_old_bo_; // the one before, until it's off the screen
+#endif
 };
 
 
@@ -215,22 +578,346 @@ static GLint link_program(GLint vs, GLint fs)
 	return prog;
 }
 
+// Linked programs are cached on disk when the driver lets us read them back, to save
+// compiling them all at every start-up. They're keyed by the driver and the sources, so
+// a driver upgrade or an edited shader simply misses.
+static std::string programCacheDir;
+static std::string programCachePrefix;
+static bool haveProgramBinary = false;
+
+// The file names have to be the same from one run to the next, which std::hash needn't be.
+static uint64_t fnv1a_64(std::string const &data)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c : data)
+		hash = (hash ^ c) * 0x100000001b3ULL;
+	return hash;
+}
+
+static std::string default_cache_dir()
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	if (xdg && *xdg == '/')
+		return std::string(xdg) + "/rpicam-apps/shaders";
+	const char *home = getenv("HOME");
+	if (home && *home == '/')
+		return std::string(home) + "/.cache/rpicam-apps/shaders";
+	return "";
+}
+
+static bool make_dirs(std::string const &dir)
+{
+	for (size_t pos = dir.find('/', 1); pos != std::string::npos; pos = dir.find('/', pos + 1))
+	{
+		if (mkdir(dir.substr(0, pos).c_str(), 0755) && errno != EEXIST)
+			return false;
+	}
+	return !mkdir(dir.c_str(), 0755) || errno == EEXIST;
+}
+
+static void program_cache_setup(std::string const &dir)
+{
+	GLint formats = 0;
+	if (epoxy_has_gl_extension("GL_OES_get_program_binary"))
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	haveProgramBinary = formats > 0;
+	programCacheDir = haveProgramBinary ? (dir == "auto" ? default_cache_dir() : dir) : "";
+	if (!programCacheDir.empty() && !make_dirs(programCacheDir))
+	{
+		LOG(1, "EglPreview: can't create shader cache " << programCacheDir);
+		programCacheDir.clear();
+	}
+	if (programCacheDir.empty())
+		return;
+
+	// Name the files after the driver too, so that it's clear whose they are.
+	programCachePrefix = std::string((const char *)glGetString(GL_RENDERER)) + ' ' +
+						 (const char *)glGetString(GL_VERSION);
+	for (char &c : programCachePrefix)
+	{
+		if (!isalnum((unsigned char)c) && c != '.')
+			c = '_';
+	}
+	programCachePrefix.resize(std::min<size_t>(programCachePrefix.size(), 48));
+	LOG(2, "EglPreview: shader cache " << programCacheDir);
+}
+
+static GLint build_program(std::string const &vs, std::string const &fs)
+{
+	std::string filename;
+	if (!programCacheDir.empty())
+	{
+		std::string key = std::string((const char *)glGetString(GL_RENDERER)) + '\n' +
+						  (const char *)glGetString(GL_VERSION) + '\n' + vs + '\n' + fs;
+		char digest[20];
+		snprintf(digest, sizeof(digest), "-%016" PRIx64, fnv1a_64(key));
+		filename = programCacheDir + "/" + programCachePrefix + digest + ".bin";
+
+		std::ifstream file(filename, std::ios::binary);
+		GLenum format;
+		if (file.read(reinterpret_cast<char *>(&format), sizeof(format)))
+		{
+			std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			GLint prog = glCreateProgram();
+			glProgramBinaryOES(prog, format, binary.data(), binary.size());
+			GLint ok = 0;
+			glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+			if (ok)
+				return prog;
+			// Drivers may refuse old binaries, in which case we just build it again.
+			glDeleteProgram(prog);
+		}
+	}
+
+	GLint vs_s = compile_shader(GL_VERTEX_SHADER, vs.c_str());
+	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs.c_str());
+	GLint prog = link_program(vs_s, fs_s);
+	glDeleteShader(vs_s);
+	glDeleteShader(fs_s);
 
+	if (!filename.empty())
+	{
+		GLint length = 0;
+		glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinaryOES(prog, length, &length, &format, binary.data());
+
+		// Write it under another name first so that no one can read half a file.
+		std::string tmp = filename + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+		std::ofstream file(tmp, std::ios::binary);
+		file.write(reinterpret_cast<const char *>(&format), sizeof(format));
+		file.write(binary.data(), length);
+		file.close();
+		if (!file || rename(tmp.c_str(), filename.c_str()))
+		{
+			LOG(1, "EglPreview: failed to write shader cache file " << filename);
+			unlink(tmp.c_str());
+		}
+	}
 
-static GLint vs_s;
+	return prog;
+}
 
-static GLint rectShader;
-static GLint textShader;
-static GLint textVertexShader;
-static GLint textFragmentShader;
+// These shaders can be replaced by files of the same name in the --shader-dir directory.
+static std::string shader_source(std::string const &dir, const char *name, std::string const &embedded)
+{
+	if (dir.empty())
+		return embedded;
+	std::ifstream file(dir + "/" + name);
+	if (!file)
+		return embedded;
+	LOG(2, "EglPreview: using shader " << dir << "/" << name);
+	std::stringstream source;
+	source << file.rdbuf();
+	return source.str();
+}
 
 static GLuint VAO, VBO;
+// The image quad's half height in normalised device coordinates.
+static float quadHeight = 1;
 static GLuint textVAO, textVBO, rectVAO;
 
-static GLuint testImage;
-static GLuint testImage2;
 
-static GLint prog;
+struct ColourProgram
+{
+	GLint prog;
+	GLint viewLocation;
+	GLint shaderIndexLocation;
+	GLint contrastALocation, contrastBLocation, contrastCLocation, contrastLocation;
+	GLint lumaRangeLocation;
+};
+
+static void make_colour_program(ColourProgram &colour, std::string const &vs, std::string const &fs)
+{
+	colour.prog = build_program(vs, fs);
+	colour.contrastALocation = glGetUniformLocation(colour.prog, "u_ContrastA");
+	colour.contrastBLocation = glGetUniformLocation(colour.prog, "u_ContrastB");
+	colour.contrastCLocation = glGetUniformLocation(colour.prog, "u_ContrastC");
+	colour.contrastLocation = glGetUniformLocation(colour.prog, "u_Contrast");
+	colour.shaderIndexLocation = glGetUniformLocation(colour.prog, "shaderIndex");
+	colour.viewLocation = glGetUniformLocation(colour.prog, "u_View");
+	colour.lumaRangeLocation = glGetUniformLocation(colour.prog, "u_LumaRange");
+}
+
+// The vertex shaders depend on the image and window sizes, so are made at setup time.
+struct VertexSources
+{
+	std::string image; // letterboxed into the window
+	std::string offscreen; // covering the whole of an offscreen target
+	std::string overview; // drawing an offscreen target the right way up
+	std::string text;
+	std::string rect;
+};
+static VertexSources vertexSources;
+
+// Everything built from the replaceable shaders. It's kept together so that the whole lot
+// can be swapped over at once when the shader files change.
+struct ProgramSet
+{
+	ColourProgram colour[NUM_COLOUR_SOURCES];
+	GLint copy[NUM_COLOUR_SOURCES];
+	GLint copyLumaRangeLocation;
+	GLint overview;
+	GLint denoise;
+	GLint denoiseStrengthLocation;
+	GLint text;
+	GLint rect;
+};
+static ProgramSet programs;
+
+static void delete_program_set(ProgramSet &set)
+{
+	for (auto &colour : set.colour)
+		glDeleteProgram(colour.prog);
+	for (GLint prog : set.copy)
+		glDeleteProgram(prog);
+	glDeleteProgram(set.overview);
+	glDeleteProgram(set.denoise);
+	glDeleteProgram(set.text);
+	glDeleteProgram(set.rect);
+	set = ProgramSet();
+}
+
+// If anything fails to build this throws, and leaves nothing behind.
+static ProgramSet build_program_set(VertexSources const &vs, std::string const &dir)
+{
+	ProgramSet set = {};
+	try
+	{
+		std::string megashader = shader_source(dir, "megashader.frag", SC_MEGASHADER);
+		make_colour_program(set.colour[CAMERA_SOURCE], vs.image, megashader);
+		make_colour_program(set.colour[OFFSCREEN_SOURCE], vs.image, with_sampler_2d(megashader));
+		make_colour_program(set.colour[LUMA_SOURCE], vs.image, with_luma_sampler(megashader));
+
+		std::string copy = shader_source(dir, "copy.frag", SC_COPY_SHADER);
+		set.copy[CAMERA_SOURCE] = build_program(vs.offscreen, copy);
+		set.copy[OFFSCREEN_SOURCE] = build_program(vs.offscreen, with_sampler_2d(copy));
+		set.copy[LUMA_SOURCE] = build_program(vs.offscreen, with_luma_sampler(copy));
+		set.copyLumaRangeLocation = glGetUniformLocation(set.copy[LUMA_SOURCE], "u_LumaRange");
+		set.overview = build_program(vs.overview, with_sampler_2d(copy));
+
+		set.denoise = build_program(vs.offscreen, shader_source(dir, "denoise.frag", SC_DENOISE_SHADER));
+		glUseProgram(set.denoise);
+		glUniform1i(glGetUniformLocation(set.denoise, "s"), 0);
+		glUniform1i(glGetUniformLocation(set.denoise, "history"), 1);
+		set.denoiseStrengthLocation = glGetUniformLocation(set.denoise, "u_Strength");
+
+		set.text = build_program(vs.text, shader_source(dir, "text.frag", SC_TEXT_SHADER));
+		set.rect = build_program(vs.rect, shader_source(dir, "rect.frag", SC_RECT_SHADER));
+	}
+	catch (...)
+	{
+		delete_program_set(set);
+		throw;
+	}
+	return set;
+}
+
+// Render targets for the sharpen, edge outline and denoise passes.
+struct RenderTarget
+{
+	GLuint framebuffer = 0;
+	GLuint texture = 0;
+	int width = 0;
+	int height = 0;
+};
+
+// Where the final image goes. This is the window, except in headless mode where there's
+// no window and we draw into an offscreen target instead.
+static GLuint screenFramebuffer = 0;
+static RenderTarget outputTarget;
+
+static GLint sharpenBlurProg[NUM_SHARPEN_LEVELS];
+static GLint sharpenCombineProg[NUM_SHARPEN_LEVELS];
+static GLuint fboVAO;
+static RenderTarget sharpenTargets[2];
+static RenderTarget historyTargets[2];
+static std::vector<RenderTarget> freezeRing;
+static RenderTarget overviewTarget;
+
+static void make_render_target(RenderTarget &target, int width, int height)
+{
+	if (target.framebuffer && target.width == width && target.height == height)
+		return;
+	if (target.framebuffer)
+	{
+		glDeleteFramebuffers(1, &target.framebuffer);
+		glDeleteTextures(1, &target.texture);
+	}
+
+	glGenTextures(1, &target.texture);
+	glBindTexture(GL_TEXTURE_2D, target.texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	glGenFramebuffers(1, &target.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		throw std::runtime_error("EglPreview: incomplete framebuffer for render target");
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+
+	target.width = width;
+	target.height = height;
+}
+
+// The offscreen passes draw the whole target, and keep the image the same way up as the
+// camera textures so that every pass can use the same texture coordinates.
+static void offscreen_setup(int width, int height, int ring_width, int ring_height, unsigned int freeze_frames)
+{
+	static const char fbo_vs[] =
+		"attribute vec4 pos;\n"
+		"varying vec2 texcoord;\n"
+		"\n"
+		"void main() {\n"
+		"  gl_Position = pos;\n"
+		"  texcoord = pos.xy * 0.5 + 0.5;\n"
+		"}\n";
+	vertexSources.offscreen = fbo_vs;
+
+	// Offscreen targets hold the image upside down by GL's reckoning, so drawing one on the
+	// screen means flipping it back.
+	static const char overview_vs[] =
+		"attribute vec4 pos;\n"
+		"varying vec2 texcoord;\n"
+		"\n"
+		"void main() {\n"
+		"  gl_Position = pos;\n"
+		"  texcoord = vec2(pos.x, -pos.y) * 0.5 + 0.5;\n"
+		"}\n";
+	vertexSources.overview = overview_vs;
+
+	// This runs again whenever the camera restarts, and the image's shape may have changed.
+	for (unsigned int i = 0; i < NUM_SHARPEN_LEVELS; i++)
+	{
+		glDeleteProgram(sharpenBlurProg[i]);
+		glDeleteProgram(sharpenCombineProg[i]);
+		sharpenBlurProg[i] = build_program(vertexSources.offscreen, make_blur_shader(sharpenRadius[i]));
+		sharpenCombineProg[i] = build_program(vertexSources.image, make_combine_shader(sharpenRadius[i]));
+		glUseProgram(sharpenCombineProg[i]);
+		glUniform1i(glGetUniformLocation(sharpenCombineProg[i], "s"), 0);
+		glUniform1i(glGetUniformLocation(sharpenCombineProg[i], "original"), 1);
+	}
+
+	glDeleteVertexArrays(1, &fboVAO);
+	glGenVertexArrays(1, &fboVAO);
+	glBindVertexArray(fboVAO);
+	static const float verts[] = { -1, -1, 1, 1, 1, -1, 1, 1, 1, 1, 1, 1, -1, 1, 1, 1 };
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, verts);
+
+	for (auto &target : sharpenTargets)
+		make_render_target(target, width, height);
+	for (auto &target : historyTargets)
+		make_render_target(target, width, height);
+	freezeRing.resize(freeze_frames);
+	for (auto &target : freezeRing)
+		make_render_target(target, ring_width, ring_height);
+}
 
 // Followed this tutorial to add all of the text rendering stuff https://learnopengl.com/In-Practice/Text-Rendering
 // Adapted it a bit to work with this 
@@ -288,8 +975,6 @@ static void loadFont() {
 	}
 }
 
-static GLint shaderIndexLocation;
-static GLint contrastALocation, contrastBLocation, contrastCLocation, contrastLocation;
 static void gl_setup(int width, int height, int window_width, int window_height)
 {
 	glEnable(GL_BLEND);
@@ -300,41 +985,26 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 	float max_dimension = std::max(w_factor, h_factor);
 	w_factor /= max_dimension;
 	h_factor /= max_dimension;
-	char vs[256];
+	quadHeight = h_factor;
+	char vs[512];
 	
+	// u_View scales (xy) and then offsets (zw) the image coordinates about the centre, so
+	// that a frozen frame can be zoomed and panned on the GPU.
 	snprintf(vs, sizeof(vs),
 			 "attribute vec4 pos;\n"
+			 "uniform vec4 u_View;\n"
 			 "varying vec2 texcoord;\n"
 			 "\n"
 			 "void main() {\n"
 			 "  gl_Position = pos;\n"
-			 "  texcoord.x = pos.x / %f + 0.5;\n"
-			 "  texcoord.y = 0.5 - pos.y / %f;\n"
+			 "  texcoord.x = pos.x / %f;\n"
+			 "  texcoord.y = -pos.y / %f;\n"
+			 "  texcoord = texcoord * u_View.xy + u_View.zw + 0.5;\n"
 			 "}\n",
 			 2.0 * w_factor, 2.0 * h_factor);
 	vs[sizeof(vs) - 1] = 0;
-	vs_s = compile_shader(GL_VERTEX_SHADER, vs);
+	vertexSources.image = vs;
 	std::cout << "SELECT SHADER " << shaderIndex << std::endl;
-	const char *fs;
-	//fs = shaders[shaderIndex].c_str();
-	fs = SC_MEGASHADER.c_str();
-
-	 
-	GLint fs_s = compile_shader(GL_FRAGMENT_SHADER, fs);
-	prog = link_program(vs_s, fs_s);
-
-	glUseProgram(prog);
-
-	
-	contrastALocation = glGetUniformLocation(prog, "u_ContrastA");
-	contrastBLocation = glGetUniformLocation(prog, "u_ContrastB");
-	contrastCLocation = glGetUniformLocation(prog, "u_ContrastC");
-	contrastLocation = glGetUniformLocation(prog, "u_Contrast");
-	shaderIndexLocation = glGetUniformLocation(prog, "shaderIndex");
-	glUniform1f(contrastALocation, contrastA);
-	glUniform1f(contrastBLocation, contrastB);
-	glUniform1f(contrastCLocation, contrastC);
-	glUniform1f(contrastLocation, contrast);
 
 	glGenVertexArrays(1, &VAO);
 
@@ -345,7 +1015,7 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, verts);
 
 	char textVertexShaderCode[256];
-	snprintf(textVertexShaderCode, sizeof(vs),
+	snprintf(textVertexShaderCode, sizeof(textVertexShaderCode),
 		"attribute vec4 vertex;\n"
 		"varying vec2 TexCoords;\n"
 
@@ -358,32 +1028,15 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 		"  	TexCoords = vertex.wz;\n"
 		"}\n", width, height);
 
-	std::string textFragmentShaderCode = "#extension GL_OES_EGL_image_external : enable\n"
-		"precision mediump float;\n"
-		"varying vec2 TexCoords;\n"
-
-		"uniform sampler2D text;\n"
-		"uniform vec3 textColor;\n"
-		"uniform float opacity;\n"
+	vertexSources.text = textVertexShaderCode;
 
-		"void main() {\n"    
-		"	vec4 sampled = vec4(1.0, 1.0, 1.0, texture2D(text, TexCoords).r);\n"
-		"	gl_FragColor = vec4(textColor, opacity) * sampled;\n"
-		"}\n"
-		"";
-		
-	GLint textVertexShader = compile_shader(GL_VERTEX_SHADER, textVertexShaderCode);
-	GLint textFragmentShader = compile_shader(GL_FRAGMENT_SHADER, textFragmentShaderCode.c_str());
-	textShader = link_program(textVertexShader, textFragmentShader);
-
-	glUseProgram(textShader);
 	glGenVertexArrays(1, &textVAO);
 	loadFont();
 
 
 
 	char rectVertexShaderCode[256];
-	snprintf(rectVertexShaderCode, sizeof(vs),
+	snprintf(rectVertexShaderCode, sizeof(rectVertexShaderCode),
 		"attribute vec4 vertex;\n"
 
 		"void main() {\n"
@@ -394,21 +1047,8 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 		"	gl_Position = newPos;\n"
 		"}\n", width, height);
 
-	std::string rectFragmentShaderCode = "#extension GL_OES_EGL_image_external : enable\n"
-		"precision mediump float;\n"
-		"uniform vec3 color;\n"
-		"uniform float opacity;\n"
-
-		"void main() {\n"    
-		"	gl_FragColor = vec4(color.xyz, opacity);\n"
-		"}\n"
-		"";
-		
-	GLint rectVertexShader = compile_shader(GL_VERTEX_SHADER, rectVertexShaderCode);
-	GLint rectFragmentShader = compile_shader(GL_FRAGMENT_SHADER, rectFragmentShaderCode.c_str());
-	rectShader = link_program(rectVertexShader, rectFragmentShader);
+	vertexSources.rect = rectVertexShaderCode;
 
-	glUseProgram(rectShader);
 	glGenVertexArrays(1, &rectVAO);
 }
 
@@ -422,11 +1062,16 @@ int EglPreview::getShaderIndex() {
 	return shaderIndex;
 }
 
+void EglPreview::setShaderIndex(int index) {
+	if(index >= 0 && (uint)index < NUM_SHADERS)
+		shaderIndex = index;
+}
+
 void EglPreview::glRenderText(std::string text, float x, float y, float scale, float r, float g, float b, float opacity) {
-	glUseProgram(textShader);
-	auto textLocation = glGetUniformLocation(textShader, "text");
-	auto textColorLocation = glGetUniformLocation(textShader, "textColor");
-	auto opacityLocation = glGetUniformLocation(textShader, "opacity");
+	glUseProgram(programs.text);
+	auto textLocation = glGetUniformLocation(programs.text, "text");
+	auto textColorLocation = glGetUniformLocation(programs.text, "textColor");
+	auto opacityLocation = glGetUniformLocation(programs.text, "opacity");
 
 	glUniform1f(opacityLocation, opacity);
 	glUniform3f(textColorLocation, r, g, b);
@@ -466,9 +1111,9 @@ void EglPreview::glRenderText(std::string text, float x, float y, float scale, f
 
 
 void EglPreview::glRenderRect(float x, float y, float w, float h, float r, float g, float b, float opacity) {
-	glUseProgram(rectShader);
-	auto colorLocation = glGetUniformLocation(rectShader, "color");
-	auto opacityLocation = glGetUniformLocation(rectShader, "opacity");
+	glUseProgram(programs.rect);
+	auto colorLocation = glGetUniformLocation(programs.rect, "color");
+	auto opacityLocation = glGetUniformLocation(programs.rect, "opacity");
 
 	glUniform1f(opacityLocation, opacity);
 	glUniform3f(colorLocation, r, g, b);
@@ -482,31 +1127,80 @@ void EglPreview::glRenderRect(float x, float y, float w, float h, float r, float
 
 
 
-EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+EglPreview::EglPreview(Options const *options)
+	: Preview(options), display_(nullptr), egl_surface_(EGL_NO_SURFACE), import_clock_(0), last_fd_(-1), first_time_(true), sharpen_strength_(options->sharpen_strength),
+	  sharpen_level_(0), reduced_features_(0), sharpen_time_ms_(0), sharpen_headroom_frames_(0),
+	  sharpen_query_count_(0), have_timer_query_(false), history_index_(0), history_valid_(false), ring_head_(0), ring_count_(0),
+	  freeze_requested_(false), frozen_(false), freeze_steps_(0), freeze_age_(0), freeze_zoom_(1), freeze_x_(0), freeze_y_(0),
+	  abort_(false), reset_requested_(false), source_texture_(0), source_(CAMERA_SOURCE), luma_range_{ 0, 1 }, overview_frames_(0), overview_valid_(false),
+	  frame_crop_{ 0, 0, 1, 1 }, stabilise_crop_{ 0, 0, 1, 1 }, reading_lines_age_(-1),
+	  reading_band_{ 0, 0 }, reading_band_valid_(false), zoom_active_(false), zoom_target_{ 0, 0, 1, 1 }, zoom_shown_{ 0, 0, 1, 1 },
+	  zoom_velocity_{ 0, 0, 0, 0 }, stats_presents_(0),
+	  image_texture_(0), image_width_(0), image_height_(0), reload_context_(EGL_NO_CONTEXT), reload_abort_(false),
+	  reload_on_render_thread_(false)
+#if LIBGBM_PRESENT
+	  ,
+	  drm_fd_(-1), gbm_device_(nullptr), gbm_surface_(nullptr), kms_connector_id_(0), kms_crtc_id_(0),
+	  kms_plane_id_(0), kms_mode_blob_(0), kms_props_(), kms_modeset_(false), kms_out_fence_(-1),
+	  kms_front_bo_(nullptr), kms_old_bo_(nullptr)
+#endif
 {
-	display_ = XOpenDisplay(NULL);
-	if (!display_)
-		throw std::runtime_error("Couldn't open X display");
-
-	egl_display_ = eglGetDisplay(display_);
-	if (!egl_display_)
-		throw std::runtime_error("eglGetDisplay() failed");
-
-	EGLint egl_major, egl_minor;
-
-	if (!eglInitialize(egl_display_, &egl_major, &egl_minor))
-		throw std::runtime_error("eglInitialize() failed");
-
 	x_ = options_->preview_x;
 	y_ = options_->preview_y;
 	width_ = options_->preview_width;
 	height_ = options_->preview_height;
-	makeWindow("rpicam-app");
+
+	if (options_->headless_preview)
+		makeHeadless();
+	else if (options_->kms_preview)
+	{
+#if LIBGBM_PRESENT
+		makeKms();
+#else
+		throw std::runtime_error("KMS preview needs GBM, which is unavailable");
+#endif
+	}
+	else
+	{
+		// The render thread presents while the preview thread polls for window events.
+		XInitThreads();
+		display_ = XOpenDisplay(NULL);
+		if (!display_)
+			throw std::runtime_error("Couldn't open X display");
+
+		egl_display_ = eglGetDisplay(display_);
+		if (!egl_display_)
+			throw std::runtime_error("eglGetDisplay() failed");
+
+		EGLint egl_major, egl_minor;
+
+		if (!eglInitialize(egl_display_, &egl_major, &egl_minor))
+			throw std::runtime_error("eglInitialize() failed");
+
+		makeWindow("rpicam-app");
+	}
 	// gl_setup() has to happen later, once we're sure we're in the display thread.
+	render_thread_ = std::thread(&EglPreview::renderThread, this);
 }
 
 EglPreview::~EglPreview()
 {
+	reload_abort_ = true;
+	if (reload_thread_.joinable())
+		reload_thread_.join();
+	if (reload_context_ != EGL_NO_CONTEXT)
+		eglDestroyContext(egl_display_, reload_context_);
+	{
+		std::lock_guard<std::mutex> lock(mailbox_mutex_);
+		abort_ = true;
+		mailbox_cond_.notify_all();
+	}
+	render_thread_.join();
+
+#if LIBGBM_PRESENT
+	if (drm_fd_ >= 0)
+		releaseKms();
+#endif
 }
 
 static void no_border(Display *display, Window window)
@@ -586,6 +1280,7 @@ void EglPreview::makeWindow(char const *name)
 	EGLint num_configs;
 	if (!eglChooseConfig(egl_display_, attribs, &config, 1, &num_configs))
 		throw std::runtime_error("couldn't get an EGL visual config");
+	config_ = config;
 
 	EGLint vid;
 	if (!eglGetConfigAttrib(egl_display_, config, EGL_NATIVE_VISUAL_ID, &vid))
@@ -654,147 +1349,1561 @@ void EglPreview::makeWindow(char const *name)
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 }
 
-void EglPreview::cycleShader(int amount) {
-	if(shaderIndex == 0 && amount < 0) {
-		shaderIndex = NUM_SHADERS - 1;
-	}else{
-		shaderIndex = (shaderIndex+amount) % NUM_SHADERS;
-	}
-}
-
-void EglPreview::swapOriginalAndActiveShader() {
-	if(shaderIndex != 0) {
-		lastShaderIndex = shaderIndex;
-		shaderIndex = 0;
-	} else {
-		shaderIndex = lastShaderIndex;
-	}
-	
-	//glUniform1f(shaderIndexLocation, shaderIndex);
-}
-
-static void get_colour_space_info(std::optional<libcamera::ColorSpace> const &cs, EGLint &encoding, EGLint &range)
+// Headless mode uses Mesa's surfaceless platform, so it needs neither a display server nor
+// a display, and draws into an offscreen target that can be read back.
+void EglPreview::makeHeadless()
 {
-	encoding = EGL_ITU_REC601_EXT;
-	range = EGL_YUV_NARROW_RANGE_EXT;
+	if (!epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+		throw std::runtime_error("EGL_MESA_platform_surfaceless not available");
+	egl_display_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (egl_display_ == EGL_NO_DISPLAY)
+		throw std::runtime_error("eglGetPlatformDisplayEXT() failed");
 
-	if (cs == libcamera::ColorSpace::Sycc)
-		range = EGL_YUV_FULL_RANGE_EXT;
-	else if (cs == libcamera::ColorSpace::Smpte170m)
-		/* all good */;
-	else if (cs == libcamera::ColorSpace::Rec709)
-		encoding = EGL_ITU_REC709_EXT;
-	else
-		LOG(1, "EglPreview: unexpected colour space " << libcamera::ColorSpace::toString(cs));
-}
+	EGLint egl_major, egl_minor;
+	if (!eglInitialize(egl_display_, &egl_major, &egl_minor))
+		throw std::runtime_error("eglInitialize() failed");
+	if (!epoxy_has_egl_extension(egl_display_, "EGL_KHR_surfaceless_context"))
+		throw std::runtime_error("EGL_KHR_surfaceless_context not available");
 
-void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
-{
-	if (first_time_)
+	if (width_ == 0 || height_ == 0)
 	{
-		// This stuff has to be delayed until we know we're in the thread doing the display.
-		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
-			throw std::runtime_error("eglMakeCurrent failed");
-		gl_setup(info.width, info.height, width_, height_);
-		first_time_ = false;
+		width_ = 1024;
+		height_ = 768;
 	}
 
-	buffer.fd = fd;
-	buffer.size = size;
-	buffer.info = info;
+	// We never make a surface, and the default of EGL_WINDOW_BIT finds no configs at all on
+	// the surfaceless platform.
+	static const EGLint attribs[] =
+		{
+			EGL_SURFACE_TYPE, EGL_DONT_CARE,
+			EGL_RED_SIZE, 8,
+			EGL_GREEN_SIZE, 8,
+			EGL_BLUE_SIZE, 8,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+			EGL_NONE
+		};
+	EGLConfig config;
+	EGLint num_configs;
+	if (!eglChooseConfig(egl_display_, attribs, &config, 1, &num_configs) || !num_configs)
+		throw std::runtime_error("couldn't get an EGL config");
+	config_ = config;
 
-	EGLint encoding, range;
-	get_colour_space_info(info.colour_space, encoding, range);
+	eglBindAPI(EGL_OPENGL_ES_API);
 
-	EGLint attribs[] = {
-		EGL_WIDTH, static_cast<EGLint>(info.width),
-		EGL_HEIGHT, static_cast<EGLint>(info.height),
-		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_YUV420,
-		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
-		EGL_DMA_BUF_PLANE1_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE1_OFFSET_EXT, static_cast<EGLint>(info.stride * info.height),
-		EGL_DMA_BUF_PLANE1_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
-		EGL_DMA_BUF_PLANE2_FD_EXT, fd,
-		EGL_DMA_BUF_PLANE2_OFFSET_EXT, static_cast<EGLint>(info.stride * info.height + (info.stride / 2) * (info.height / 2)),
-		EGL_DMA_BUF_PLANE2_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
-		EGL_YUV_COLOR_SPACE_HINT_EXT, encoding,
-		EGL_SAMPLE_RANGE_HINT_EXT, range,
+	static const EGLint ctx_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
 		EGL_NONE
 	};
+	egl_context_ = eglCreateContext(egl_display_, config, EGL_NO_CONTEXT, ctx_attribs);
+	if (!egl_context_)
+		throw std::runtime_error("eglCreateContext failed");
 
-	EGLImage image = eglCreateImageKHR(egl_display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
-	if (!image)
-		throw std::runtime_error("failed to import fd " + std::to_string(fd));
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context_);
+	int max_texture_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	max_image_width_ = max_image_height_ = max_texture_size;
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
 
-	glGenTextures(1, &buffer.texture);
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+#if LIBGBM_PRESENT
 
+// Returns the id of the named property of a KMS object (0 if there isn't one), and its value.
+static uint32_t kms_property(int fd, uint32_t object, uint32_t type, char const *name, uint64_t *value = nullptr)
+{
+	drmModeObjectProperties *props = drmModeObjectGetProperties(fd, object, type);
+	uint32_t id = 0;
+	for (uint32_t i = 0; props && i < props->count_props && !id; i++)
+	{
+		drmModePropertyRes *prop = drmModeGetProperty(fd, props->props[i]);
+		if (prop && !strcmp(prop->name, name))
+		{
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+	return id;
+}
 
-	glGenTextures(1, &testImage);
-	glBindTexture(GL_TEXTURE_EXTERNAL_OES, testImage);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+static uint32_t kms_primary_plane(int fd, int crtc_index)
+{
+	drmModePlaneRes *planes = drmModeGetPlaneResources(fd);
+	uint32_t id = 0;
+	for (uint32_t i = 0; planes && i < planes->count_planes && !id; i++)
+	{
+		drmModePlane *plane = drmModeGetPlane(fd, planes->planes[i]);
+		uint64_t type = 0;
+		if (plane && (plane->possible_crtcs & (1 << crtc_index)) &&
+			kms_property(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) && type == DRM_PLANE_TYPE_PRIMARY)
+			id = plane->plane_id;
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+	return id;
+}
 
-	eglDestroyImageKHR(egl_display_, image);
+static void destroy_kms_framebuffer(gbm_bo *bo, void *data)
+{
+	drmModeRmFB(gbm_device_get_fd(gbm_bo_get_device(bo)), static_cast<uint32_t>(reinterpret_cast<uintptr_t>(data)));
 }
 
-void EglPreview::SetInfoText(const std::string &text)
+// GBM cycles through a few buffers, so each one keeps its KMS framebuffer for as long as it lives.
+static uint32_t kms_framebuffer(gbm_bo *bo)
 {
-	if (!text.empty())
-		XStoreName(display_, window_, text.c_str());
+	if (void *data = gbm_bo_get_user_data(bo))
+		return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(data));
+
+	uint32_t handles[4] = { gbm_bo_get_handle(bo).u32 };
+	uint32_t pitches[4] = { gbm_bo_get_stride(bo) };
+	uint32_t offsets[4] = {};
+	uint32_t fb = 0;
+	if (drmModeAddFB2(gbm_device_get_fd(gbm_bo_get_device(bo)), gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+					  gbm_bo_get_format(bo), handles, pitches, offsets, &fb, 0))
+		return 0;
+	gbm_bo_set_user_data(bo, reinterpret_cast<void *>(static_cast<uintptr_t>(fb)), destroy_kms_framebuffer);
+	return fb;
+}
+
+// Finds a connected display and a CRTC and primary plane to drive it with.
+bool EglPreview::findKmsOutput(drmModeModeInfo &mode)
+{
+	drmModeRes *res = drmModeGetResources(drm_fd_);
+	if (!res)
+		return false;
+
+	bool found = false;
+	for (int i = 0; i < res->count_connectors && !found; i++)
+	{
+		drmModeConnector *connector = drmModeGetConnector(drm_fd_, res->connectors[i]);
+		if (connector && connector->connection == DRM_MODE_CONNECTED && connector->count_modes)
+		{
+			mode = connector->modes[0];
+			for (int m = 0; m < connector->count_modes; m++)
+			{
+				if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+				{
+					mode = connector->modes[m];
+					break;
+				}
+			}
+
+			for (int e = 0; e < connector->count_encoders && !found; e++)
+			{
+				drmModeEncoder *encoder = drmModeGetEncoder(drm_fd_, connector->encoders[e]);
+				for (int c = 0; encoder && c < res->count_crtcs && !found; c++)
+				{
+					if (!(encoder->possible_crtcs & (1 << c)))
+						continue;
+					kms_plane_id_ = kms_primary_plane(drm_fd_, c);
+					if (kms_plane_id_)
+					{
+						kms_connector_id_ = connector->connector_id;
+						kms_crtc_id_ = res->crtcs[c];
+						found = true;
+					}
+				}
+				drmModeFreeEncoder(encoder);
+			}
+		}
+		drmModeFreeConnector(connector);
+	}
+
+	drmModeFreeResources(res);
+	return found;
+}
+
+// KMS mode drives a display directly through GBM, with atomic commits, so no X server is
+// needed. It takes over the whole display, and works with vkms and llvmpipe for testing.
+void EglPreview::makeKms()
+{
+	std::vector<std::string> devices;
+	if (!options_->kms_device.empty())
+		devices.push_back(options_->kms_device);
+	else
+	{
+		for (int i = 0; i < 8; i++)
+			devices.push_back("/dev/dri/card" + std::to_string(i));
+	}
+
+	drmModeModeInfo mode = {};
+	for (auto const &device : devices)
+	{
+		drm_fd_ = open(device.c_str(), O_RDWR | O_CLOEXEC);
+		if (drm_fd_ < 0)
+			continue;
+		if (!drmSetClientCap(drm_fd_, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) &&
+			!drmSetClientCap(drm_fd_, DRM_CLIENT_CAP_ATOMIC, 1) && findKmsOutput(mode))
+		{
+			LOG(2, "EglPreview: using KMS device " << device << ", mode " << mode.name);
+			break;
+		}
+		close(drm_fd_);
+		drm_fd_ = -1;
+	}
+	if (drm_fd_ < 0)
+		throw std::runtime_error("no KMS device with atomic modesetting and a connected display");
+
+	// The destructor won't run if the constructor throws, so tidy up here.
+	egl_display_ = EGL_NO_DISPLAY;
+	try
+	{
+		setupKms(mode);
+	}
+	catch (...)
+	{
+		releaseKms();
+		throw;
+	}
+}
+
+void EglPreview::setupKms(drmModeModeInfo const &mode)
+{
+	kms_props_.connector_crtc_id = kms_property(drm_fd_, kms_connector_id_, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	kms_props_.crtc_mode_id = kms_property(drm_fd_, kms_crtc_id_, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+	kms_props_.crtc_active = kms_property(drm_fd_, kms_crtc_id_, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+	kms_props_.crtc_out_fence_ptr = kms_property(drm_fd_, kms_crtc_id_, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+	kms_props_.plane_fb_id = kms_property(drm_fd_, kms_plane_id_, DRM_MODE_OBJECT_PLANE, "FB_ID");
+	kms_props_.plane_crtc_id = kms_property(drm_fd_, kms_plane_id_, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+	char const *src_names[] = { "SRC_X", "SRC_Y", "SRC_W", "SRC_H" };
+	char const *crtc_names[] = { "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H" };
+	for (int i = 0; i < 4; i++)
+	{
+		kms_props_.plane_src[i] = kms_property(drm_fd_, kms_plane_id_, DRM_MODE_OBJECT_PLANE, src_names[i]);
+		kms_props_.plane_crtc[i] = kms_property(drm_fd_, kms_plane_id_, DRM_MODE_OBJECT_PLANE, crtc_names[i]);
+	}
+	if (drmModeCreatePropertyBlob(drm_fd_, &mode, sizeof(mode), &kms_mode_blob_))
+		throw std::runtime_error("failed to create KMS mode blob");
+
+	// The whole display is ours, and the image gets letterboxed into it.
+	width_ = mode.hdisplay;
+	height_ = mode.vdisplay;
+
+	gbm_device_ = gbm_create_device(drm_fd_);
+	if (!gbm_device_)
+		throw std::runtime_error("gbm_create_device() failed");
+	gbm_surface_ = gbm_surface_create(gbm_device_, width_, height_, GBM_FORMAT_XRGB8888,
+									  GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	if (!gbm_surface_)
+		throw std::runtime_error("gbm_surface_create() failed");
+
+	egl_display_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_GBM_KHR, gbm_device_, NULL);
+	if (egl_display_ == EGL_NO_DISPLAY)
+		throw std::runtime_error("eglGetPlatformDisplayEXT() failed");
+	EGLint egl_major, egl_minor;
+	if (!eglInitialize(egl_display_, &egl_major, &egl_minor))
+		throw std::runtime_error("eglInitialize() failed");
+
+	// The config has to match the GBM surface format exactly.
+	static const EGLint attribs[] =
+		{
+			EGL_RED_SIZE, 8,
+			EGL_GREEN_SIZE, 8,
+			EGL_BLUE_SIZE, 8,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+			EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+			EGL_NONE
+		};
+	EGLint num_configs = 0;
+	if (!eglChooseConfig(egl_display_, attribs, NULL, 0, &num_configs) || !num_configs)
+		throw std::runtime_error("couldn't get an EGL config");
+	std::vector<EGLConfig> configs(num_configs);
+	eglChooseConfig(egl_display_, attribs, configs.data(), num_configs, &num_configs);
+	auto config = std::find_if(configs.begin(), configs.begin() + num_configs, [this](EGLConfig c) {
+		EGLint id;
+		return eglGetConfigAttrib(egl_display_, c, EGL_NATIVE_VISUAL_ID, &id) && id == GBM_FORMAT_XRGB8888;
+	});
+	if (config == configs.begin() + num_configs)
+		throw std::runtime_error("no EGL config matches the GBM surface");
+	config_ = *config;
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+
+	static const EGLint ctx_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	egl_context_ = eglCreateContext(egl_display_, config_, EGL_NO_CONTEXT, ctx_attribs);
+	if (!egl_context_)
+		throw std::runtime_error("eglCreateContext failed");
+
+	egl_surface_ = eglCreatePlatformWindowSurfaceEXT(egl_display_, config_, gbm_surface_, NULL);
+	if (egl_surface_ == EGL_NO_SURFACE)
+		throw std::runtime_error("eglCreatePlatformWindowSurfaceEXT failed");
+
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context_);
+	int max_texture_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+	max_image_width_ = max_image_height_ = max_texture_size;
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+// Releases whatever makeKms got as far as making.
+void EglPreview::releaseKms()
+{
+	if (kms_out_fence_ >= 0)
+		close(kms_out_fence_);
+	kms_out_fence_ = -1;
+	for (gbm_bo *bo : { kms_old_bo_, kms_front_bo_ })
+	{
+		if (bo)
+			gbm_surface_release_buffer(gbm_surface_, bo);
+	}
+	kms_old_bo_ = kms_front_bo_ = nullptr;
+	if (egl_display_ != EGL_NO_DISPLAY)
+		eglTerminate(egl_display_);
+	egl_display_ = EGL_NO_DISPLAY;
+	if (gbm_surface_)
+		gbm_surface_destroy(gbm_surface_);
+	gbm_surface_ = nullptr;
+	if (gbm_device_)
+		gbm_device_destroy(gbm_device_);
+	gbm_device_ = nullptr;
+	if (kms_mode_blob_)
+		drmModeDestroyPropertyBlob(drm_fd_, kms_mode_blob_);
+	kms_mode_blob_ = 0;
+	close(drm_fd_);
+	drm_fd_ = -1;
+}
+
+// Each new buffer goes to the display in an atomic commit. We wait for the previous commit's
+// out-fence first, which keeps only one flip in flight, paces us to the display, and tells us
+// that the buffer before that one is off the screen and can go back to GBM.
+void EglPreview::presentKms()
+{
+	gbm_bo *bo = gbm_surface_lock_front_buffer(gbm_surface_);
+	if (!bo)
+	{
+		LOG_ERROR("EglPreview: no GBM front buffer");
+		return;
+	}
+	uint32_t fb = kms_framebuffer(bo);
+	if (!fb)
+	{
+		LOG_ERROR("EglPreview: failed to make KMS framebuffer");
+		gbm_surface_release_buffer(gbm_surface_, bo);
+		return;
+	}
+
+	if (kms_out_fence_ >= 0)
+	{
+		pollfd pfd = { kms_out_fence_, POLLIN, 0 };
+		poll(&pfd, 1, 1000);
+		close(kms_out_fence_);
+		kms_out_fence_ = -1;
+	}
+	// The previous flip has happened, so the buffer before it is off the screen.
+	if (kms_old_bo_)
+		gbm_surface_release_buffer(gbm_surface_, kms_old_bo_);
+	kms_old_bo_ = nullptr;
+
+	drmModeAtomicReq *req = drmModeAtomicAlloc();
+	// Without out-fences, blocking commits are how we know a buffer is finished with.
+	uint32_t flags = kms_props_.crtc_out_fence_ptr ? DRM_MODE_ATOMIC_NONBLOCK : 0;
+	if (!kms_modeset_)
+	{
+		drmModeAtomicAddProperty(req, kms_connector_id_, kms_props_.connector_crtc_id, kms_crtc_id_);
+		drmModeAtomicAddProperty(req, kms_crtc_id_, kms_props_.crtc_mode_id, kms_mode_blob_);
+		drmModeAtomicAddProperty(req, kms_crtc_id_, kms_props_.crtc_active, 1);
+		flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+	drmModeAtomicAddProperty(req, kms_plane_id_, kms_props_.plane_fb_id, fb);
+	drmModeAtomicAddProperty(req, kms_plane_id_, kms_props_.plane_crtc_id, kms_crtc_id_);
+	uint64_t const src[4] = { 0, 0, (uint64_t)width_ << 16, (uint64_t)height_ << 16 }; // 16.16 fixed point
+	uint64_t const crtc[4] = { 0, 0, (uint64_t)width_, (uint64_t)height_ };
+	for (int i = 0; i < 4; i++)
+	{
+		drmModeAtomicAddProperty(req, kms_plane_id_, kms_props_.plane_src[i], src[i]);
+		drmModeAtomicAddProperty(req, kms_plane_id_, kms_props_.plane_crtc[i], crtc[i]);
+	}
+	if (kms_props_.crtc_out_fence_ptr)
+		drmModeAtomicAddProperty(req, kms_crtc_id_, kms_props_.crtc_out_fence_ptr,
+								 reinterpret_cast<uintptr_t>(&kms_out_fence_));
+
+	// If the commit fails, the front buffer is still the one on the screen, and this one
+	// can go straight back.
+	if (drmModeAtomicCommit(drm_fd_, req, flags, nullptr))
+	{
+		LOG_ERROR("EglPreview: KMS atomic commit failed: " << strerror(errno));
+		kms_out_fence_ = -1;
+		gbm_surface_release_buffer(gbm_surface_, bo);
+	}
+	else
+	{
+		kms_modeset_ = true;
+		kms_old_bo_ = kms_front_bo_;
+		kms_front_bo_ = bo;
+	}
+	drmModeAtomicFree(req);
+}
+
+#endif
+
+void EglPreview::cycleShader(int amount) {
+	if(shaderIndex == 0 && amount < 0) {
+		shaderIndex = NUM_SHADERS - 1;
+	}else{
+		shaderIndex = (shaderIndex+amount) % NUM_SHADERS;
+	}
+}
+
+void EglPreview::swapOriginalAndActiveShader() {
+	if(shaderIndex != 0) {
+		lastShaderIndex = shaderIndex;
+		shaderIndex = 0;
+	} else {
+		shaderIndex = lastShaderIndex;
+	}
+	
+	//glUniform1f(shaderIndexLocation, shaderIndex);
+}
+
+static void get_colour_space_info(std::optional<libcamera::ColorSpace> const &cs, EGLint &encoding, EGLint &range)
+{
+	encoding = EGL_ITU_REC601_EXT;
+	range = EGL_YUV_NARROW_RANGE_EXT;
+
+	if (cs == libcamera::ColorSpace::Sycc)
+		range = EGL_YUV_FULL_RANGE_EXT;
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		/* all good */;
+	else if (cs == libcamera::ColorSpace::Rec709)
+		encoding = EGL_ITU_REC709_EXT;
+	else
+		LOG(1, "EglPreview: unexpected colour space " << libcamera::ColorSpace::toString(cs));
+}
+
+void EglPreview::setup(unsigned int width, unsigned int height)
+{
+	// This stuff has to be delayed until we know we're in the thread doing the display.
+	if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
+		throw std::runtime_error("eglMakeCurrent failed");
+	if (egl_surface_ != EGL_NO_SURFACE)
+		eglSwapInterval(egl_display_, options_->swap_interval);
+	else
+	{
+		make_render_target(outputTarget, width_, height_);
+		screenFramebuffer = outputTarget.framebuffer;
+		glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+		glViewport(0, 0, width_, height_);
+	}
+	program_cache_setup(options_->shader_cache);
+	{
+		std::lock_guard<std::mutex> lock(reload_mutex_);
+		gl_setup(width, height, width_, height_);
+		// Every frame goes into the freeze ring, and they're only ever shown as big as they fit
+		// on the screen, so there's no point keeping more than that.
+		float ring_scale = std::min(1.0f, std::min(width_ / (float)width, height_ / (float)height));
+		offscreen_setup(width, height, std::max(1, (int)(width * ring_scale)), std::max(1, (int)(height * ring_scale)),
+						options_->freeze_frames);
+	}
+	delete_program_set(programs);
+	try
+	{
+		programs = build_program_set(vertexSources, options_->shader_dir);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("EglPreview: shaders in " << options_->shader_dir << " failed, using built-in ones: " << e.what());
+		programs = build_program_set(vertexSources, "");
+	}
+	if (options_->shader_reload && !reload_thread_.joinable())
+		startShaderReload();
+	have_timer_query_ = epoxy_has_gl_extension("GL_EXT_disjoint_timer_query");
+	if (have_timer_query_ && !sharpen_queries_[0])
+		glGenQueriesEXT(3, sharpen_queries_);
+	sharpen_query_count_ = 0;
+	first_time_ = false;
+}
+
+// Beyond this many, the least recently used imports get dropped.
+static constexpr unsigned int MAX_IMPORTS = 16;
+
+void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer)
+{
+	if (first_time_)
+		setup(info.width, info.height);
+
+	buffer.fd = fd;
+	buffer.size = size;
+	buffer.info = info;
+
+	EGLint encoding, range;
+	get_colour_space_info(info.colour_space, encoding, range);
+	buffer.luma_range[0] = range == EGL_YUV_NARROW_RANGE_EXT ? 16.0 / 255 : 0;
+	buffer.luma_range[1] = range == EGL_YUV_NARROW_RANGE_EXT ? 255.0 / 219 : 1;
+
+	struct stat st;
+	if (fstat(fd, &st))
+		throw std::runtime_error("failed to stat fd " + std::to_string(fd));
+	ImportKey key = { st.st_dev, st.st_ino, size, info.width, info.height, info.stride, info.pixel_format.fourcc(),
+					  encoding, range };
+
+	auto it = imports_.find(key);
+	if (it != imports_.end())
+	{
+		it->second.last_used = ++import_clock_;
+		buffer.texture = it->second.texture;
+		buffer.luma_texture = it->second.luma_texture;
+		std::lock_guard<std::mutex> lock(stats_mutex_);
+		stats_.import_hits++;
+		return;
+	}
+
+	EGLint attribs[] = {
+		EGL_WIDTH, static_cast<EGLint>(info.width),
+		EGL_HEIGHT, static_cast<EGLint>(info.height),
+		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_YUV420,
+		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
+		EGL_DMA_BUF_PLANE1_FD_EXT, fd,
+		EGL_DMA_BUF_PLANE1_OFFSET_EXT, static_cast<EGLint>(info.stride * info.height),
+		EGL_DMA_BUF_PLANE1_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
+		EGL_DMA_BUF_PLANE2_FD_EXT, fd,
+		EGL_DMA_BUF_PLANE2_OFFSET_EXT, static_cast<EGLint>(info.stride * info.height + (info.stride / 2) * (info.height / 2)),
+		EGL_DMA_BUF_PLANE2_PITCH_EXT, static_cast<EGLint>(info.stride / 2),
+		EGL_YUV_COLOR_SPACE_HINT_EXT, encoding,
+		EGL_SAMPLE_RANGE_HINT_EXT, range,
+		EGL_NONE
+	};
+
+	EGLImage image = eglCreateImageKHR(egl_display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	if (!image)
+		throw std::runtime_error("failed to import fd " + std::to_string(fd));
+
+	glGenTextures(1, &buffer.texture);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
+
+	// The texture keeps the buffer alive, so we no longer need the image.
+	eglDestroyImageKHR(egl_display_, image);
+
+	// The binarised modes can use the Y plane alone, as a plain single channel texture. That's
+	// only the same grey as the other shaders' 0.299/0.587/0.114 when the camera encoded it
+	// with Rec.601 weights; Rec.709 Y weights green more heavily, so those go through RGB.
+	EGLint luma_attribs[] = {
+		EGL_WIDTH, static_cast<EGLint>(info.width),
+		EGL_HEIGHT, static_cast<EGLint>(info.height),
+		EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_R8,
+		EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(info.stride),
+		EGL_NONE
+	};
+	buffer.luma_texture = 0;
+	image = encoding == EGL_ITU_REC601_EXT
+				? eglCreateImageKHR(egl_display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, luma_attribs)
+				: EGL_NO_IMAGE_KHR;
+	if (image)
+	{
+		glGenTextures(1, &buffer.luma_texture);
+		glBindTexture(GL_TEXTURE_2D, buffer.luma_texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+		eglDestroyImageKHR(egl_display_, image);
+	}
+	else if (encoding == EGL_ITU_REC601_EXT)
+		LOG(2, "EglPreview: can't import luma plane on its own, using the full image in all modes");
+
+	imports_[key] = { buffer.texture, buffer.luma_texture, ++import_clock_ };
+	{
+		std::lock_guard<std::mutex> lock(stats_mutex_);
+		stats_.imports++;
+	}
+	evictImports(MAX_IMPORTS);
+}
+
+// Drops the least recently used imports until there are no more than keep. A buffer whose
+// import goes is forgotten too, so it gets imported again if it comes back.
+void EglPreview::evictImports(unsigned int keep)
+{
+	unsigned int evicted = 0;
+	while (imports_.size() > keep)
+	{
+		auto victim = std::min_element(imports_.begin(), imports_.end(), [](auto const &a, auto const &b) {
+			return a.second.last_used < b.second.last_used;
+		});
+		for (auto it = buffers_.begin(); it != buffers_.end();)
+		{
+			bool uses_victim = it->second.fd != -1 && it->second.texture == victim->second.texture;
+			it = uses_victim ? buffers_.erase(it) : std::next(it);
+		}
+		glDeleteTextures(1, &victim->second.texture);
+		glDeleteTextures(1, &victim->second.luma_texture);
+		imports_.erase(victim);
+		evicted++;
+	}
+
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	stats_.import_evictions += evicted;
+}
+
+void EglPreview::SetInfoText(const std::string &text)
+{
+	if (!text.empty() && display_)
+		XStoreName(display_, window_, text.c_str());
 }
 
 
 void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
-	Buffer &buffer = buffers_[fd];
-	if (buffer.fd == -1)
-		makeBuffer(fd, span.size(), info, buffer);
+	// Hand the frame over to the render thread. If the last one we gave it hasn't been
+	// drawn yet it never will be, so it can go straight back, once we've let go of the lock.
+	int superseded;
+	{
+		std::lock_guard<std::mutex> lock(mailbox_mutex_);
+		superseded = pending_.fd;
+		pending_.fd = fd;
+		pending_.size = span.size();
+		pending_.info = info;
+		pending_.data = next_frame_data_;
+		mailbox_cond_.notify_all();
+	}
+	if (superseded >= 0)
+	{
+		done_callback_(superseded);
+		std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+		stats_.frames_superseded++;
+	}
+}
 
+void EglPreview::SetFrameData(PreviewFrameData const &data)
+{
+	next_frame_data_ = data;
+}
 
-	glUniform1f(contrastALocation, contrastA);
-	glUniform1f(contrastBLocation, contrastB);
-	glUniform1f(contrastCLocation, contrastC);
-	glUniform1f(contrastLocation, contrast);
+PreviewStats EglPreview::GetStats() const
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	return stats_;
+}
 
-	glUniform1f(shaderIndexLocation, shaderIndex);
+void EglPreview::renderThread()
+{
+	bool drawn = true;
+	while (true)
+	{
+		Frame frame;
+		{
+			// When vsync is pacing us we redraw straight away, otherwise we wait for a new
+			// frame, but still redraw at about the display rate for the overlays.
+			std::unique_lock<std::mutex> lock(mailbox_mutex_);
+			auto ready = [this] { return abort_ || reset_requested_ || job_ || pending_.fd >= 0; };
+			if (first_time_)
+				mailbox_cond_.wait(lock, ready);
+			else if (options_->swap_interval == 0 || egl_surface_ == EGL_NO_SURFACE || !drawn)
+				mailbox_cond_.wait_for(lock, std::chrono::milliseconds(16), ready);
+
+			if (abort_)
+				return;
+			else if (job_)
+			{
+				// Jobs draw, and drawing calls back into the application, so no locks are held.
+				// Whoever gave us the job waits for it to be cleared, so it stays put meanwhile.
+				lock.unlock();
+				job_();
+				lock.lock();
+				job_ = nullptr;
+				mailbox_cond_.notify_all();
+				continue;
+			}
+			else if (reset_requested_)
+			{
+				doReset();
+				reset_requested_ = false;
+				mailbox_cond_.notify_all();
+				continue;
+			}
+			std::swap(frame, pending_);
+		}
 
+		drawn = render(frame.fd >= 0 ? &frame : nullptr);
+	}
+}
+
+static int64_t boottime_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+bool EglPreview::render(Frame const *frame)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	if (!first_time_)
+		applyShaderReload();
+
+	// A frozen display doesn't need the camera buffers, so they go straight back.
+	updateFreeze();
+	if (frame && frozen_)
+	{
+		done_callback_(frame->fd);
+		frame = nullptr;
+	}
+
+	// With the temporal denoise on, everything downstream reads the denoised history
+	// rather than the camera image, and the binarised modes read just the luma. When
+	// frozen, it all comes from the freeze ring instead.
+	if (frame)
+	{
+		Buffer &buffer = buffers_[frame->fd];
+		if (buffer.fd == -1)
+			makeBuffer(frame->fd, frame->size, frame->info, buffer);
+
+		// If the governor turns the denoise off, it mustn't pick up an old history when it resumes.
+		bool denoise = options_->temporal_denoise > 0 && !(reduced_features_ & REDUCE_DENOISE);
+		history_valid_ = history_valid_ && denoise;
+		if (denoise)
+		{
+			source_texture_ = renderDenoisePass(buffer.texture);
+			source_ = OFFSCREEN_SOURCE;
+		}
+		else if (buffer.luma_texture && shaderIndex >= 1 && shaderIndex <= 8)
+		{
+			source_texture_ = buffer.luma_texture;
+			source_ = LUMA_SOURCE;
+			std::copy_n(buffer.luma_range, 2, luma_range_);
+		}
+		else
+		{
+			source_texture_ = buffer.texture;
+			source_ = CAMERA_SOURCE;
+		}
+		// Keep the colour, even when only grey is shown now, for reviewing in any mode later.
+		if (!freezeRing.empty())
+			captureFreezeFrame(source_ == LUMA_SOURCE ? buffer.texture : source_texture_,
+							   source_ == LUMA_SOURCE ? CAMERA_SOURCE : source_);
+		if (frame->data.overview_fd >= 0)
+			updateOverview(frame->data);
+		{
+			std::lock_guard<std::mutex> lock(zoom_mutex_);
+			std::copy_n(frame->data.crop, 4, frame_crop_);
+		}
+		std::copy_n(frame->data.stabilise_crop, 4, stabilise_crop_);
+		reading_lines_ = frame->data.reading_lines;
+		reading_lines_age_ = frame->data.reading_lines_age;
+	}
+	updateZoom();
+
+	GLuint texture = source_texture_;
+	ColourSource source = source_;
+	if (frozen_)
+	{
+		unsigned int n = freezeRing.size();
+		texture = freezeRing[(ring_head_ + n - 1 - freeze_age_) % n].texture;
+		source = OFFSCREEN_SOURCE;
+	}
+	else if (!texture)
+		return false;
+
+	draw(texture, source, true);
+
+	auto render_time = std::chrono::steady_clock::now();
+	if (egl_surface_ != EGL_NO_SURFACE)
+	{
+		EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
+#if LIBGBM_PRESENT
+		if (gbm_surface_)
+			presentKms();
+#endif
+	}
+	else
+		glFlush();
+	auto swap_time = std::chrono::steady_clock::now();
+
+	double render_ms = std::chrono::duration<double, std::milli>(render_time - start_time).count();
+
+	double age_ms = -1;
+	uint64_t input_sequence = 0;
+	if (frame)
+	{
+		if (last_fd_ >= 0)
+			done_callback_(last_fd_);
+		last_fd_ = frame->fd;
+		if (frame->data.timestamp_ns)
+			age_ms = (boottime_ns() - frame->data.timestamp_ns) / 1e6;
+		input_sequence = frame->data.input_sequence;
+	}
+	updateStats(render_ms, std::chrono::duration<double, std::milli>(swap_time - render_time).count(), age_ms,
+				input_sequence);
+	return true;
+}
+
+// Draw the image in the current display mode, followed by the overlays. With time_sharpen,
+// the sharpen passes feed the sharpen budget.
+void EglPreview::draw(GLuint texture, ColourSource source, bool time_sharpen)
+{
+	bool sharpen = shaderIndex == SHARPEN_SHADER || shaderIndex == EDGE_SHADER;
 	glClearColor(0, 0, 0, 0);
-	glClear(GL_COLOR_BUFFER_BIT);
 
-	glUseProgram(prog);
-    glBindVertexArray(VAO);
+	// Without timer queries the best we can do is to time the sharpen passes on the CPU. The
+	// screen is cleared and the GPU allowed to catch up first, so that neither earlier work nor
+	// waiting for a buffer to draw into (which can mean waiting for vsync) gets counted.
+	bool cpu_timing = time_sharpen && sharpen && !have_timer_query_;
+	std::chrono::steady_clock::time_point sharpen_start;
+	if (cpu_timing)
+	{
+		glClear(GL_COLOR_BUFFER_BIT);
+		glFinish();
+		sharpen_start = std::chrono::steady_clock::now();
+	}
+
+	GLuint original = 0;
+	if (sharpen)
+		original = renderSharpenPasses(texture, source);
+
+	if (!cpu_timing)
+		glClear(GL_COLOR_BUFFER_BIT);
+
+	if (sharpen)
+	{
+		drawSharpenCombine(shaderIndex == EDGE_SHADER, original);
+		if (cpu_timing)
+		{
+			glFinish();
+			auto sharpen_end = std::chrono::steady_clock::now();
+			updateSharpenBudget(std::chrono::duration<double, std::milli>(sharpen_end - sharpen_start).count());
+		}
+	}
+	else
+	{
+		ColourProgram &colour = programs.colour[source];
+		glUseProgram(colour.prog);
+		glUniform1f(colour.contrastALocation, contrastA);
+		glUniform1f(colour.contrastBLocation, contrastB);
+		glUniform1f(colour.contrastCLocation, contrastC);
+		glUniform1f(colour.contrastLocation, contrast);
+		glUniform1f(colour.shaderIndexLocation, shaderIndex);
+		glUniform2f(colour.lumaRangeLocation, luma_range_[0], luma_range_[1]);
+		setView(colour.viewLocation);
+
+		glBindVertexArray(VAO);
+		glBindTexture(source_target(source), texture);
+		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	}
+
+	if (options_->reading_line_index != READING_LINE_OFF && !frozen_)
+		drawReadingLine();
+	if (overview_valid_)
+		drawOverview();
+	if (textDrawCallback)
+		textDrawCallback();
+}
+
+double EglPreview::RenderImage(RgbImage const &input, int mode, unsigned int repeat, RgbImage &output)
+{
+	double time_taken = -1;
+	std::exception_ptr error;
+	std::unique_lock<std::mutex> lock(mailbox_mutex_);
+	job_ = [&]() {
+		try
+		{
+			time_taken = renderImage(input, mode, repeat, output);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+	};
+	mailbox_cond_.notify_all();
+	mailbox_cond_.wait(lock, [this] { return !job_; });
+	if (error)
+		std::rethrow_exception(error);
+	return time_taken;
+}
+
+double EglPreview::renderImage(RgbImage const &input, int mode, unsigned int repeat, RgbImage &output)
+{
+	if (input.data.size() < input.width * input.height * 3)
+		throw std::runtime_error("EglPreview: test image too small");
+	if (first_time_)
+	{
+		setup(input.width, input.height);
+		glGenTextures(1, &image_texture_);
+		glBindTexture(GL_TEXTURE_2D, image_texture_);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		image_width_ = input.width;
+		image_height_ = input.height;
+	}
+	else if (!image_texture_ || input.width != image_width_ || input.height != image_height_)
+		throw std::runtime_error("EglPreview: test images must all be the same size");
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glBindTexture(GL_TEXTURE_2D, image_texture_);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, input.width, input.height, 0, GL_RGB, GL_UNSIGNED_BYTE, input.data.data());
+
+	// Use the biggest sharpen kernel and keep its timer queries out of the way, so that the
+	// results are repeatable and can be timed as a whole.
+	int old_shader_index = shaderIndex;
+	unsigned int old_sharpen_level = sharpen_level_;
+	bool timer_query = have_timer_query_;
+	shaderIndex = mode;
+	sharpen_level_ = 0;
+	have_timer_query_ = false;
+
+	GLuint query = 0;
+	if (timer_query)
+	{
+		glGenQueriesEXT(1, &query);
+		glBeginQueryEXT(GL_TIME_ELAPSED_EXT, query);
+	}
+	for (unsigned int i = 0; i < std::max(repeat, 1u); i++)
+		draw(image_texture_, OFFSCREEN_SOURCE, false);
+
+	double time_taken = -1;
+	if (timer_query)
+	{
+		glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+		GLuint64 time_ns = 0;
+		glGetQueryObjectui64vEXT(query, GL_QUERY_RESULT_EXT, &time_ns);
+		GLint disjoint = 0;
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		if (!disjoint)
+			time_taken = time_ns / 1e6 / std::max(repeat, 1u);
+		glDeleteQueriesEXT(1, &query);
+	}
+
+	shaderIndex = old_shader_index;
+	sharpen_level_ = old_sharpen_level;
+	have_timer_query_ = timer_query;
+
+	// GL puts the origin at the bottom, so flip the rows as we go.
+	std::vector<uint8_t> rgba(width_ * height_ * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, rgba.data());
+	output.width = width_;
+	output.height = height_;
+	output.data.resize(width_ * height_ * 3);
+	for (int y = 0; y < height_; y++)
+	{
+		uint8_t const *src = &rgba[(height_ - 1 - y) * width_ * 4];
+		uint8_t *dst = &output.data[y * width_ * 3];
+		for (int x = 0; x < width_; x++, src += 4, dst += 3)
+			dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+	}
+
+	return time_taken;
+}
 
+void EglPreview::updateStats(double render_ms, double slack_ms, double age_ms, uint64_t input_sequence)
+{
+	std::lock_guard<std::mutex> lock(stats_mutex_);
+	auto smooth = [](double &value, double sample) { value = value ? 0.9 * value + 0.1 * sample : sample; };
+	smooth(stats_.render_ms, render_ms);
+	smooth(stats_.swap_slack_ms, slack_ms);
+	if (age_ms >= 0)
+		smooth(stats_.frame_age_ms, age_ms);
+
+	auto now = std::chrono::steady_clock::now();
+	if (stats_presents_++)
+		smooth(stats_.display_fps, 1000.0 / std::chrono::duration<double, std::milli>(now - last_present_).count());
+	last_present_ = now;
+	if (input_sequence > stats_.input_sequence)
+	{
+		stats_.input_sequence = input_sequence;
+		stats_.input_present_time = now;
+	}
+
+	if (stats_presents_ % 300 == 0)
+		LOG(2, "EglPreview: " << stats_.display_fps << "fps, render " << stats_.render_ms << "ms, swap slack "
+							  << stats_.swap_slack_ms << "ms, frame age " << stats_.frame_age_ms << "ms, "
+							  << stats_.frames_superseded << " frames superseded, " << stats_.imports << " buffer imports, "
+							  << stats_.import_hits << " reused, " << stats_.import_evictions << " evicted");
+}
+
+void EglPreview::setSharpenStrength(float strength)
+{
+	sharpen_strength_ = strength;
+}
+
+GLuint EglPreview::renderDenoisePass(GLuint texture)
+{
+	RenderTarget &previous = historyTargets[history_index_];
+	RenderTarget &current = historyTargets[history_index_ ^ 1];
+	glDisable(GL_BLEND);
+	glViewport(0, 0, current.width, current.height);
+	glBindVertexArray(fboVAO);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, current.framebuffer);
+	glUseProgram(programs.denoise);
+	// The first frame after a reset has nothing to blend with.
+	glUniform1f(programs.denoiseStrengthLocation, history_valid_ ? options_->temporal_denoise : 0.0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, previous.texture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+	glViewport(0, 0, width_, height_);
+	glEnable(GL_BLEND);
+
+	history_index_ ^= 1;
+	history_valid_ = true;
+	return current.texture;
+}
+
+void EglPreview::setFreeze(bool freeze)
+{
+	freeze_requested_ = freeze;
+}
+
+void EglPreview::stepFreezeFrame(int amount)
+{
+	freeze_steps_ += amount;
+}
+
+void EglPreview::setFreezeView(float zoom, float x, float y)
+{
+	std::lock_guard<std::mutex> lock(freeze_view_mutex_);
+	freeze_zoom_ = std::max(zoom, 1.0f);
+	freeze_x_ = std::clamp(x, -1.0f, 1.0f);
+	freeze_y_ = std::clamp(y, -1.0f, 1.0f);
+}
+
+void EglPreview::updateFreeze()
+{
+	if (freeze_requested_ && !frozen_ && ring_count_)
+	{
+		frozen_ = true;
+		freeze_age_ = 0;
+		// Steps asked for before we froze don't count.
+		freeze_steps_ = 0;
+		// The frame we were holding on to is in the ring now.
+		if (last_fd_ >= 0)
+			done_callback_(last_fd_);
+		last_fd_ = -1;
+		LOG(1, "EglPreview: frozen, " << ring_count_ << " frames to review");
+	}
+	else if (!freeze_requested_ && frozen_)
+	{
+		frozen_ = false;
+		history_valid_ = false;
+		// Wait for a new frame, as the one we were showing before has gone back.
+		source_texture_ = 0;
+		LOG(1, "EglPreview: unfrozen");
+	}
+
+	if (frozen_)
+		freeze_age_ = std::clamp(freeze_age_ + freeze_steps_.exchange(0), 0, (int)ring_count_ - 1);
+}
+
+void EglPreview::captureFreezeFrame(GLuint texture, ColourSource source)
+{
+	RenderTarget &target = freezeRing[ring_head_];
+	glDisable(GL_BLEND);
+	glViewport(0, 0, target.width, target.height);
+	glBindVertexArray(fboVAO);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, target.framebuffer);
+	glUseProgram(programs.copy[source]);
+	glBindTexture(source_target(source), texture);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+	glViewport(0, 0, width_, height_);
+	glEnable(GL_BLEND);
+
+	ring_head_ = (ring_head_ + 1) % freezeRing.size();
+	ring_count_ = std::min<unsigned int>(ring_count_ + 1, freezeRing.size());
+}
+
+// The overview is copied out of the lores buffer only every few frames, which keeps the cost
+// down, and means it needn't hold on to any camera buffers.
+void EglPreview::updateOverview(PreviewFrameData const &data)
+{
+	unsigned int interval = options_->overview_interval * (reduced_features_ & REDUCE_OVERLAYS ? 4 : 1);
+	if (overview_frames_++ % interval)
+		return;
+
+	Buffer &buffer = buffers_[data.overview_fd];
+	if (buffer.fd == -1)
+		makeBuffer(data.overview_fd, data.overview_size, data.overview_info, buffer);
+	make_render_target(overviewTarget, data.overview_info.width, data.overview_info.height);
+
+	glDisable(GL_BLEND);
+	glViewport(0, 0, overviewTarget.width, overviewTarget.height);
+	glBindVertexArray(fboVAO);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, overviewTarget.framebuffer);
+	glUseProgram(programs.copy[CAMERA_SOURCE]);
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
 
-	
-	textDrawCallback();
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+	glViewport(0, 0, width_, height_);
+	glEnable(GL_BLEND);
+	overview_valid_ = true;
+}
+
+// Draw the overview as an inset in the top right corner, framed in black, with the region
+// that the main image shows outlined in yellow.
+void EglPreview::drawOverview()
+{
+	int w = width_ * options_->overview_size;
+	int h = w * overviewTarget.height / overviewTarget.width;
+	int border = std::max(2, w / 100);
+	int x = width_ - w - 2 * border, y = height_ - h - 2 * border; // GL counts y from the bottom
+
+	auto fill = [](int x, int y, int w, int h) {
+		glScissor(x, y, w, h);
+		glClear(GL_COLOR_BUFFER_BIT);
+	};
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(0, 0, 0, 1);
+	fill(x - border, y - border, w + 2 * border, h + 2 * border);
+	glDisable(GL_SCISSOR_TEST);
+
+	glViewport(x, y, w, h);
+	glUseProgram(programs.overview);
+	glBindVertexArray(fboVAO);
+	glBindTexture(GL_TEXTURE_2D, overviewTarget.texture);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	glViewport(0, 0, width_, height_);
+
+	// The crop is measured from the top left of the image.
+	float crop[4];
+	{
+		std::lock_guard<std::mutex> lock(zoom_mutex_);
+		std::copy_n(zoom_active_ ? zoom_shown_ : frame_crop_, 4, crop);
+	}
+	int crop_w = std::max<int>(crop[2] * w, 2 * border);
+	int crop_h = std::max<int>(crop[3] * h, 2 * border);
+	int crop_x = x + crop[0] * w;
+	int crop_y = y + h - crop[1] * h - crop_h;
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(1, 1, 0, 1);
+	fill(crop_x, crop_y, crop_w, border);
+	fill(crop_x, crop_y + crop_h - border, crop_w, border);
+	fill(crop_x, crop_y, border, crop_h);
+	fill(crop_x + crop_w - border, crop_y, border, crop_h);
+	glDisable(GL_SCISSOR_TEST);
+	glClearColor(0, 0, 0, 0);
+}
+
+// The part of the frame on the screen, as the scale (first two) and then offset (last two)
+// applied to screen coordinates about the centre, which is how u_View takes it.
+void EglPreview::getView(float view[4]) const
+{
+	// Panning moves the zoomed-in view at most to the edges of the image.
+	if (frozen_)
+	{
+		std::lock_guard<std::mutex> lock(freeze_view_mutex_);
+		float scale = 1.0 / freeze_zoom_;
+		float range = (1.0 - scale) / 2;
+		view[0] = view[1] = scale;
+		view[2] = freeze_x_ * range;
+		view[3] = freeze_y_ * range;
+		return;
+	}
+
+	float scale_x = 1, scale_y = 1, offset_x = 0, offset_y = 0;
+	std::unique_lock<std::mutex> lock(zoom_mutex_);
+	if (zoom_active_)
+	{
+		// The camera lags behind the zoom animation, so we show the rest of the way by
+		// cropping the frame we have.
+		scale_x = zoom_shown_[2] / frame_crop_[2];
+		scale_y = zoom_shown_[3] / frame_crop_[3];
+		offset_x = (zoom_shown_[0] + zoom_shown_[2] / 2 - frame_crop_[0] - frame_crop_[2] / 2) / frame_crop_[2];
+		offset_y = (zoom_shown_[1] + zoom_shown_[3] / 2 - frame_crop_[1] - frame_crop_[3] / 2) / frame_crop_[3];
+	}
+	lock.unlock();
+
+	// The stabilisation crop then moves that view around inside the frame.
+	float const *crop = stabilise_crop_;
+	view[0] = scale_x * crop[2];
+	view[1] = scale_y * crop[3];
+	view[2] = offset_x * crop[2] + crop[0] + crop[2] / 2 - 0.5;
+	view[3] = offset_y * crop[3] + crop[1] + crop[3] / 2 - 0.5;
+}
+
+void EglPreview::setView(GLint location)
+{
+	float view[4];
+	getView(view);
+	glUniform4f(location, view[0], view[1], view[2], view[3]);
+}
+
+// Dim everything except the line of text nearest the middle of the screen. The band glides
+// over to whichever line that is, rather than jumping, and lines too old to trust are
+// ignored.
+void EglPreview::drawReadingLine()
+{
+	static constexpr int MAX_AGE = 30;
+	float view[4];
+	getView(view);
+
+	float centre = 0.5 + view[3]; // in the frame
+	int best = -1;
+	float best_distance = 2;
+	if (reading_lines_age_ >= 0 && reading_lines_age_ <= MAX_AGE)
+	{
+		for (unsigned int i = 0; i + 1 < reading_lines_.size(); i += 2)
+		{
+			float distance = fabs((reading_lines_[i] + reading_lines_[i + 1]) / 2 - centre);
+			if (distance < best_distance)
+				best_distance = distance, best = i;
+		}
+	}
+	if (best < 0)
+	{
+		reading_band_valid_ = false;
+		return;
+	}
+
+	// Leave room for ascenders and descenders, which don't count for much in the search.
+	float padding = (reading_lines_[best + 1] - reading_lines_[best]) * 0.3;
+	float top = reading_lines_[best] - padding, bottom = reading_lines_[best + 1] + padding;
+	if (!reading_band_valid_)
+	{
+		reading_band_[0] = top;
+		reading_band_[1] = bottom;
+		reading_band_valid_ = true;
+	}
+	reading_band_[0] += (top - reading_band_[0]) * 0.3;
+	reading_band_[1] += (bottom - reading_band_[1]) * 0.3;
+
+	// Find the rows of the screen (which GL counts from the bottom) at the band's edges.
+	auto screen_row = [&](float y) {
+		float u = (y - 0.5 - view[3]) / view[1];
+		return std::clamp<int>((1 - 2 * quadHeight * u) * height_ / 2, 0, height_);
+	};
+	int band_top = screen_row(reading_band_[0]), band_bottom = screen_row(reading_band_[1]);
+	float opacity = options_->reading_line_index == READING_LINE_MASK ? 1.0 : 0.5;
+
+	// The rectangle covers the whole screen, and the scissor trims it.
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(0, 0, width_, band_bottom);
+	glRenderRect(-1e5, -1e5, 2e5, 2e5, 0, 0, 0, opacity);
+	glScissor(0, band_top, width_, height_ - band_top);
+	glRenderRect(-1e5, -1e5, 2e5, 2e5, 0, 0, 0, opacity);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+bool EglPreview::setZoomTarget(float const crop[4])
+{
+	if (options_->zoom_smoothing <= 0)
+		return false;
+	std::lock_guard<std::mutex> lock(zoom_mutex_);
+	std::copy_n(crop, 4, zoom_target_);
+	// Start from wherever the camera is now.
+	if (!zoom_active_)
+	{
+		std::copy_n(frame_crop_, 4, zoom_shown_);
+		std::fill_n(zoom_velocity_, 4, 0);
+		zoom_time_ = std::chrono::steady_clock::now();
+		zoom_active_ = true;
+	}
+	return true;
+}
+
+bool EglPreview::getZoomCrop(float shown[4], float target[4]) const
+{
+	std::lock_guard<std::mutex> lock(zoom_mutex_);
+	if (!zoom_active_)
+		return false;
+	std::copy_n(zoom_shown_, 4, shown);
+	std::copy_n(zoom_target_, 4, target);
+	return true;
+}
+
+// Step the zoom animation on to the current time. Each part of the crop follows its target
+// like a critically damped spring, solved exactly so that it never overshoots whatever the
+// time between frames. The spring's time constant, 1 / omega, is the --zoom-smoothing. The
+// animation stops once it has arrived and the frames have the target crop, which the
+// application sends on arrival. They only differ by the camera's rounding, a pixel or two,
+// so until then we keep making up the difference.
+void EglPreview::updateZoom()
+{
+	static constexpr double ARRIVED = 1e-4;
+	static constexpr double CAUGHT_UP = 5e-4;
+	std::lock_guard<std::mutex> lock(zoom_mutex_);
+	if (!zoom_active_)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	double dt = std::min(std::chrono::duration<double>(now - zoom_time_).count(), 0.1);
+	zoom_time_ = now;
+
+	double omega = 1000.0 / options_->zoom_smoothing;
+	double decay = exp(-omega * dt);
+	bool arrived = true;
+	for (int i = 0; i < 4; i++)
+	{
+		double offset = zoom_shown_[i] - zoom_target_[i];
+		double temp = (zoom_velocity_[i] + omega * offset) * dt;
+		zoom_velocity_[i] = (zoom_velocity_[i] - omega * temp) * decay;
+		zoom_shown_[i] = zoom_target_[i] + (offset + temp) * decay;
+		arrived &= std::abs(zoom_shown_[i] - zoom_target_[i]) < ARRIVED &&
+				   std::abs(frame_crop_[i] - zoom_target_[i]) < CAUGHT_UP;
+	}
+	if (arrived)
+	{
+		std::copy_n(zoom_target_, 4, zoom_shown_);
+		zoom_active_ = false;
+	}
+}
+
+GLuint EglPreview::renderSharpenPasses(GLuint texture, ColourSource source)
+{
+	// Collect any timer query results that have become available, oldest first, without
+	// stalling to wait for them.
+	if (have_timer_query_)
+	{
+		GLint disjoint = 0;
+		glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+		while (sharpen_query_count_)
+		{
+			GLuint query = sharpen_queries_[0];
+			GLuint available = 0;
+			glGetQueryObjectuivEXT(query, GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+			if (!available)
+				break;
+			GLuint64 time_ns = 0;
+			glGetQueryObjectui64vEXT(query, GL_QUERY_RESULT_EXT, &time_ns);
+			if (!disjoint)
+				updateSharpenBudget(time_ns / 1e6);
+			std::rotate(sharpen_queries_, sharpen_queries_ + 1, sharpen_queries_ + 3);
+			sharpen_query_count_--;
+		}
+		if (sharpen_query_count_ < 3)
+			glBeginQueryEXT(GL_TIME_ELAPSED_EXT, sharpen_queries_[sharpen_query_count_]);
+	}
+
+	RenderTarget &copy = sharpenTargets[0], &blurred = sharpenTargets[1];
+	glDisable(GL_BLEND);
+	glViewport(0, 0, blurred.width, blurred.height);
+	glBindVertexArray(fboVAO);
 
-	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
-	if (last_fd_ >= 0)
-		done_callback_(last_fd_);
-	last_fd_ = fd;
+	// An image that's already in one of our targets can be blurred directly; the camera
+	// image has to be copied into one first.
+	GLuint original = texture;
+	if (source != OFFSCREEN_SOURCE)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, copy.framebuffer);
+		glUseProgram(programs.copy[source]);
+		if (source == LUMA_SOURCE)
+			glUniform2f(programs.copyLumaRangeLocation, luma_range_[0], luma_range_[1]);
+		glBindTexture(source_target(source), texture);
+		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+		original = copy.texture;
+	}
+
+	GLint blur_prog = sharpenBlurProg[sharpenLevel()];
+	glBindFramebuffer(GL_FRAMEBUFFER, blurred.framebuffer);
+	glUseProgram(blur_prog);
+	glUniform2f(glGetUniformLocation(blur_prog, "u_Step"), 1.0 / blurred.width, 0);
+	glBindTexture(GL_TEXTURE_2D, original);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, screenFramebuffer);
+	glViewport(0, 0, width_, height_);
+	glEnable(GL_BLEND);
+	return original;
+}
+
+void EglPreview::drawSharpenCombine(bool edge, GLuint original)
+{
+	GLint combine_prog = sharpenCombineProg[sharpenLevel()];
+	glUseProgram(combine_prog);
+	glUniform2f(glGetUniformLocation(combine_prog, "u_Step"), 0, 1.0 / sharpenTargets[1].height);
+	glUniform1f(glGetUniformLocation(combine_prog, "u_Strength"), sharpen_strength_);
+	glUniform1f(glGetUniformLocation(combine_prog, "u_Edge"), edge ? 1.0 : 0.0);
+	glUniform1f(glGetUniformLocation(combine_prog, "u_Contrast"), contrast);
+	setView(glGetUniformLocation(combine_prog, "u_View"));
+
+	glBindVertexArray(VAO);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, original);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, sharpenTargets[1].texture);
+	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+	if (have_timer_query_ && sharpen_query_count_ < 3)
+	{
+		glEndQueryEXT(GL_TIME_ELAPSED_EXT);
+		sharpen_query_count_++;
+	}
+}
+
+// The governor can hold the sharpen passes at the cheapest kernel, whatever the budget allows.
+unsigned int EglPreview::sharpenLevel() const
+{
+	return reduced_features_ & REDUCE_SHARPEN ? NUM_SHARPEN_LEVELS - 1 : sharpen_level_;
+}
+
+void EglPreview::updateSharpenBudget(double time_taken_ms)
+{
+	float budget = options_->sharpen_budget;
+	if (budget <= 0)
+		return;
+
+	// Drop to a cheaper kernel as soon as the (smoothed) time goes over budget. Only go back
+	// up once the bigger kernel, scaled by its number of taps, looks like it would fit with
+	// some room to spare, and has done so for a good while, so that we don't oscillate.
+	sharpen_time_ms_ = sharpen_time_ms_ ? 0.9 * sharpen_time_ms_ + 0.1 * time_taken_ms : time_taken_ms;
+	if (sharpen_time_ms_ > budget && sharpen_level_ + 1 < NUM_SHARPEN_LEVELS)
+	{
+		sharpen_level_++;
+		LOG(1, "EglPreview: sharpen passes took " << sharpen_time_ms_ << "ms, dropping to "
+												  << 2 * sharpenRadius[sharpen_level_] + 1 << "-tap kernel");
+		sharpen_time_ms_ = 0;
+		sharpen_headroom_frames_ = 0;
+	}
+	else if (sharpen_level_ > 0 &&
+			 sharpen_time_ms_ * sharpenRadius[sharpen_level_ - 1] / sharpenRadius[sharpen_level_] < 0.75 * budget)
+	{
+		if (++sharpen_headroom_frames_ >= 300)
+		{
+			sharpen_level_--;
+			LOG(1, "EglPreview: sharpen passes back up to " << 2 * sharpenRadius[sharpen_level_] + 1 << "-tap kernel");
+			sharpen_time_ms_ = 0;
+			sharpen_headroom_frames_ = 0;
+		}
+	}
+	else
+		sharpen_headroom_frames_ = 0;
 }
 
 void EglPreview::Reset()
 {
-	for (auto &it : buffers_)
-		glDeleteTextures(1, &it.second.texture);
+	// The GL state belongs to the render thread, so it has to do the work.
+	std::unique_lock<std::mutex> lock(mailbox_mutex_);
+	reset_requested_ = true;
+	mailbox_cond_.notify_all();
+	mailbox_cond_.wait(lock, [this] { return !reset_requested_; });
+}
+
+void EglPreview::doReset()
+{
+	// The imports would keep the old buffers alive, and new ones may need the memory.
+	evictImports(0);
 	buffers_.clear();
+	// The application is forgetting all its buffers, so we don't return these.
+	pending_.fd = -1;
 	last_fd_ = -1;
+	source_texture_ = 0;
+	history_valid_ = false;
+	ring_count_ = 0;
+	frozen_ = false;
+	overview_valid_ = false;
+	overview_frames_ = 0;
+	reading_lines_.clear();
+	reading_band_valid_ = false;
 	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	first_time_ = true;
 }
 
+void EglPreview::startShaderReload()
+{
+	// Shaders get built on a second context sharing our objects, so that the display doesn't
+	// stall for them. If we can't have a context with no surface, the render thread has to.
+	static const EGLint ctx_attribs[] = { EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE };
+	if (epoxy_has_egl_extension(egl_display_, "EGL_KHR_surfaceless_context"))
+		reload_context_ = eglCreateContext(egl_display_, config_, egl_context_, ctx_attribs);
+	reload_thread_ = std::thread(&EglPreview::shaderReloadThread, this);
+}
+
+void EglPreview::shaderReloadThread()
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, options_->shader_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		LOG_ERROR("EglPreview: can't watch shader directory " << options_->shader_dir);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	bool own_context = reload_context_ != EGL_NO_CONTEXT &&
+					   eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, reload_context_);
+
+	alignas(inotify_event) char events[4096];
+	while (!reload_abort_)
+	{
+		pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		// Editors may write a file in several goes, or save several files together, so let
+		// things settle and then rebuild everything once.
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		while (read(fd, events, sizeof(events)) > 0)
+			;
+
+		if (!own_context)
+		{
+			reload_on_render_thread_ = true;
+			continue;
+		}
+
+		try
+		{
+			VertexSources sources;
+			{
+				std::lock_guard<std::mutex> lock(reload_mutex_);
+				sources = vertexSources;
+			}
+			auto set = std::make_unique<ProgramSet>(build_program_set(sources, options_->shader_dir));
+			// The render thread mustn't use them until they're really finished.
+			glFinish();
+
+			std::lock_guard<std::mutex> lock(reload_mutex_);
+			if (reloaded_programs_)
+				delete_program_set(*reloaded_programs_);
+			reloaded_programs_ = std::move(set);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("EglPreview: shader reload failed, keeping the old shaders: " << e.what());
+		}
+	}
+
+	if (own_context)
+		eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	close(fd);
+}
+
+void EglPreview::applyShaderReload()
+{
+	std::unique_ptr<ProgramSet> set;
+	{
+		std::lock_guard<std::mutex> lock(reload_mutex_);
+		set = std::move(reloaded_programs_);
+	}
+	if (!set && reload_on_render_thread_.exchange(false))
+	{
+		try
+		{
+			set = std::make_unique<ProgramSet>(build_program_set(vertexSources, options_->shader_dir));
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("EglPreview: shader reload failed, keeping the old shaders: " << e.what());
+		}
+	}
+	if (set)
+	{
+		delete_program_set(programs);
+		programs = *set;
+		LOG(1, "EglPreview: shaders reloaded");
+	}
+}
+
 bool EglPreview::Quit()
 {
+	if (!display_)
+		return false;
 	XEvent event;
 	while (XCheckTypedWindowEvent(display_, window_, ClientMessage, &event))
 	{
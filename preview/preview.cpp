@@ -33,7 +33,11 @@ Preview *make_preview(Options const *options)
 		{
 #if LIBEGL_PRESENT
 			Preview *p = make_egl_preview(options);
-			if (p)
+			if (p && options->headless_preview)
+				LOG(1, "Made headless EGL preview");
+			else if (p && options->kms_preview)
+				LOG(1, "Made KMS/EGL preview");
+			else if (p)
 				LOG(1, "Made X/EGL preview window");
 			return p;
 #else
@@ -42,6 +46,12 @@ Preview *make_preview(Options const *options)
 		}
 		catch (std::exception const &e)
 		{
+			// A headless preview must never end up on the display.
+			if (options->headless_preview)
+			{
+				LOG(1, "Headless preview unavailable: " << e.what());
+				return make_null_preview(options);
+			}
 			try
 			{
 #if LIBDRM_PRESENT
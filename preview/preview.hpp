@@ -7,9 +7,13 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <libcamera/base/span.h>
 
@@ -17,11 +21,58 @@
 
 struct Options;
 
+// Details of the next frame to be shown, for previews that can make use of them.
+struct PreviewFrameData
+{
+	int64_t timestamp_ns = 0; // sensor timestamp (CLOCK_BOOTTIME), 0 if unknown
+	float crop[4] = { 0, 0, 1, 1 }; // the frame's ScalerCrop within the full field of view, as x, y, w, h
+	float stabilise_crop[4] = { 0, 0, 1, 1 }; // the part of the frame to show to cancel camera shake
+	std::vector<float> reading_lines; // top and bottom of each line of text, as fractions of the frame height
+	int reading_lines_age = -1; // frames since the reading lines were found, -1 if there are none
+	uint64_t input_sequence = 0; // input events the application had dealt with before this frame
+	// A full field of view image from the same request for the overview inset, if enabled.
+	int overview_fd = -1;
+	size_t overview_size = 0;
+	StreamInfo overview_info;
+};
+
+// A packed 8-bit RGB image, for drawing test images and reading back the results.
+struct RgbImage
+{
+	std::vector<uint8_t> data;
+	unsigned int width = 0;
+	unsigned int height = 0;
+};
+
+// Display timings reported by the preview, smoothed over recent frames.
+struct PreviewStats
+{
+	double render_ms = 0; // CPU time to draw the frame
+	double swap_slack_ms = 0; // time spent waiting for the display in the buffer swap
+	double frame_age_ms = 0; // from the sensor timestamp to the frame being presented
+	double display_fps = 0;
+	unsigned int frames_superseded = 0; // camera frames replaced before they could be drawn
+	unsigned int imports = 0; // camera buffers imported into the GPU
+	unsigned int import_hits = 0; // buffers found already imported under another fd
+	unsigned int import_evictions = 0;
+	uint64_t input_sequence = 0; // the latest PreviewFrameData::input_sequence to be presented
+	std::chrono::steady_clock::time_point input_present_time; // and when it first was
+};
+
 class Preview
 {
 public:
 	typedef std::function<void(int fd)> DoneCallback;
 
+	// Features that setReducedFeatures() can ask the preview to cut back on.
+	static constexpr unsigned int REDUCE_SHARPEN = 1; // use the cheapest sharpen kernel
+	static constexpr unsigned int REDUCE_DENOISE = 2; // skip the temporal denoise
+	static constexpr unsigned int REDUCE_OVERLAYS = 4; // update the overlays less often
+
+	// Display modes that sit after the colour mappings in the cycleShader rotation.
+	static constexpr int SHARPEN_SHADER = 9;
+	static constexpr int EDGE_SHADER = 10;
+
 	Preview(Options const *options) : options_(options) {}
 	virtual ~Preview() {}
 	// This is where the application sets the callback it gets whenever the viewfinder
@@ -34,6 +85,15 @@ public:
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Called just before Show() with the details of that frame.
+	virtual void SetFrameData(PreviewFrameData const &data) {}
+	virtual PreviewStats GetStats() const { return PreviewStats(); }
+	// Draw a test image in the given display mode, repeat times, and read back what would be
+	// displayed. Returns the GPU time per draw in ms, or a negative value if unavailable.
+	virtual double RenderImage(RgbImage const &input, int mode, unsigned int repeat, RgbImage &output)
+	{
+		throw std::runtime_error("this preview can't render test images");
+	}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
@@ -50,7 +110,24 @@ public:
 	virtual void glRenderText(std::string = "", float x = 0, float y = 0, float scale = 1, float r = 255, float g = 255, float b = 255, float opacity = 1) {}
 	virtual void setShaderValues(float a, float b, float c, float d) {}
 	virtual int getShaderIndex() { return 0; }
+	virtual void setShaderIndex(int index) {}
 	virtual void glRenderRect(float x, float y, float w, float h, float r, float g, float b, float opacity) {}
+	virtual void setSharpenStrength(float strength) {}
+	// Freeze on the most recent frame. Camera buffers are still returned as normal.
+	virtual void setFreeze(bool freeze) {}
+	// Whether a frame is actually being held, which may lag setFreeze or never happen at all.
+	virtual bool isFrozen() const { return false; }
+	// Move through the frozen frames, positive amounts going further back in time.
+	virtual void stepFreezeFrame(int amount) {}
+	// Zoom factor (1 = whole image) and pan (-1 to 1 in each direction) for the frozen frame.
+	virtual void setFreezeView(float zoom, float x, float y) {}
+	// Animate the view towards a crop (x, y, w, h as fractions of the full field of view).
+	// Returns false if the preview can't, in which case the crop should be applied directly.
+	virtual bool setZoomTarget(float const crop[4]) { return false; }
+	// Get the crop being shown part way through the animation, and the one it's heading for.
+	virtual bool getZoomCrop(float shown[4], float target[4]) const { return false; }
+	// Cut back on the REDUCE_* features given, to save time when the preview can't keep up.
+	virtual void setReducedFeatures(unsigned int features) {}
 protected:
 	DoneCallback done_callback_;
 	Options const *options_;
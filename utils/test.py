@@ -13,12 +13,16 @@
 
 import argparse
 from enum import Enum
+import errno
 import fcntl
+import glob
 import json
 import os
 import os.path
+import re
 import subprocess
 import sys
+import time
 from timeit import default_timer as timer
 import v4l2
 import numpy as np
@@ -97,7 +101,7 @@ def check_jpeg(file, preamble):
         raise TestFailure(preamble + "- bad EXIF data")
 
 
-def test_hello(exe_dir, output_dir):
+def test_hello(exe_dir, output_dir, json_dir):
     executable = os.path.join(exe_dir, 'rpicam-hello')
     logfile = os.path.join(output_dir, 'log.txt')
     print("Testing", executable)
@@ -138,6 +142,84 @@ def test_hello(exe_dir, output_dir):
     check_retcode(retcode, "test_hello: no-raw test")
     check_time(time_taken, 1.8, 6, "test_hello: no-raw test")
 
+    # "governor test". Pretend the device is too hot, and check that the governor steps the
+    # preview down, including restarting the camera at a lower resolution.
+    print("    governor test")
+    thermal_file = os.path.join(output_dir, 'thermal.txt')
+    metrics_file = os.path.join(output_dir, 'metrics.json')
+    with open(thermal_file, 'w') as f:
+        f.write('95000\n')
+    retcode, time_taken = run_executable(
+        [executable, '-t', '6000', '--governor', '--governor-thermal-path', thermal_file,
+         '--metrics-file', metrics_file], logfile)
+    check_retcode(retcode, "test_hello: governor test")
+    check_time(time_taken, 5.8, 12, "test_hello: governor test")
+    check_exists(metrics_file, "test_hello: governor test")
+    metrics = [json.loads(line) for line in open(metrics_file, 'r')]
+    levels = [m['level'] for m in metrics if m['event'] == 'governor']
+    if len(levels) < 4 or levels != sorted(levels):
+        raise TestFailure("test_hello: governor test - expected the governor to step down, got levels " + str(levels))
+    if not any(m['event'] == 'stats' for m in metrics):
+        raise TestFailure("test_hello: governor test - no preview timings in metrics file")
+
+    # The restart at a lower resolution mustn't lose the zoom. Zoom in with the knob before
+    # the governor gets that far, and check that roi_metering, which reports the part of the
+    # field of view it meters (starting afresh with the restart), sees the same crop after.
+    json_file = os.path.join(json_dir, 'roi_metering.json')
+    check_exists(json_file, "test_hello: governor test")
+    script_file = os.path.join(output_dir, 'script.txt')
+    with open(script_file, 'w') as f:
+        f.write('300 turn 1 -2\n400 turn 1 -2\n500 turn 1 -2  # zoom in\n')
+    retcode, time_taken = run_executable(
+        [executable, '-t', '8000', '--governor', '--governor-thermal-path', thermal_file,
+         '--headless-preview', '--input-script', script_file, '--lores-width', '320', '--lores-height', '240',
+         '--post-process-file', json_file], logfile)
+    check_retcode(retcode, "test_hello: governor test")
+    lines = open(logfile, 'r').readlines()
+    restarts = [i for i, line in enumerate(lines) if 'restarting camera at half resolution' in line]
+    if not restarts:
+        raise TestFailure("test_hello: governor test - camera not restarted at half resolution")
+    regions = [(i, [float(v) for v in line.split()[-1].split(',')]) for i, line in enumerate(lines)
+               if line.startswith('RoiMetering: metering region')]
+    before = [r for i, r in regions if i < restarts[0]]
+    if not before or before[-1][2] > 0.9:
+        raise TestFailure("test_hello: governor test - not zoomed in before the restart")
+    after = [r for i, r in regions if i > restarts[0]]
+    if not after:
+        raise TestFailure("test_hello: governor test - nothing metered after the restart")
+    if any(abs(a - b) > 0.02 for a, b in zip(after[-1], before[-1])):
+        raise TestFailure("test_hello: governor test - zoom lost in the restart, crop went from " +
+                          str(before[-1]) + " to " + str(after[-1]))
+
+    # "input script test". Play some knob turns and presses through the event loop, with an
+    # offscreen preview, and check that each one is seen on the display. Nothing here needs
+    # the real hardware, so it can also run against libcamera's virtual camera. The user's
+    # saved settings must be left as they were.
+    print("    input script test")
+    script_file = os.path.join(output_dir, 'script.txt')
+    report_file = os.path.join(output_dir, 'report.json')
+    with open(script_file, 'w') as f:
+        f.write('500 turn 1 -2\n600 turn 1 -2\n700 turn 1 -2  # zoom in\n1000 turn 1 6\n'
+                '1500 press 0\n1600 release 0\n2000 press 0\n2100 release 0\n')
+    settings_before = open('shaderValues.txt', 'r').read() if os.path.isfile('shaderValues.txt') else None
+    retcode, time_taken = run_executable(
+        [executable, '-t', '10000', '--headless-preview', '--input-script', script_file,
+         '--input-report', report_file], logfile)
+    check_retcode(retcode, "test_hello: input script test")
+    check_time(time_taken, 2, 8, "test_hello: input script test")
+    if 'Made headless EGL preview' not in open(logfile, 'r').read():
+        raise TestFailure("test_hello: input script test - no headless preview, so nothing was drawn")
+    settings_after = open('shaderValues.txt', 'r').read() if os.path.isfile('shaderValues.txt') else None
+    if settings_after != settings_before:
+        raise TestFailure("test_hello: input script test - the script changed the saved settings")
+    check_exists(report_file, "test_hello: input script test")
+    report = [json.loads(line) for line in open(report_file, 'r')]
+    summary = report[-1]['summary']
+    if summary['events'] != 8 or summary['seen'] != 8:
+        raise TestFailure("test_hello: input script test - expected all 8 events to be seen, got " + str(summary))
+    if not all(0 < r['latency'] < 1000 for r in report[:-1]):
+        raise TestFailure("test_hello: input script test - unlikely latencies " + str(report[:-1]))
+
     print("rpicam-hello tests passed")
 
 
@@ -532,6 +614,53 @@ def test_raw(exe_dir, output_dir):
     print("rpicam-raw tests passed")
 
 
+def test_preview(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-preview-test')
+    logfile = os.path.join(output_dir, 'log.txt')
+    print("Testing", executable)
+    if not os.path.isfile(executable):
+        print("WARNING: test_preview - no EGL preview in this build, skipping test")
+        return
+    clean_dir(output_dir, exts=('.ppm', 'log.txt'))
+
+    # Black text-like bars on a grey ramp, so that the binarised modes have edges to find.
+    image = np.tile(np.linspace(64, 224, 640, dtype=np.uint8), (480, 1))
+    image[100:380:40, 80:560] = 16
+    input_file = os.path.join(output_dir, 'input.ppm')
+    with open(input_file, 'wb') as f:
+        f.write(b'P6\n640 480\n255\n')
+        f.write(np.repeat(image[:, :, np.newaxis], 3, axis=2).tobytes())
+
+    # "headless test". Draw every display mode without a display, and read them all back.
+    print("    headless test")
+    retcode, time_taken = run_executable([executable, '--headless-preview', '--input', input_file,
+                                          '--output-dir', output_dir, '--repeat', '5'], logfile)
+    check_retcode(retcode, "test_preview: headless test")
+    if 'Made headless EGL preview' not in open(logfile, 'r').read():
+        raise TestFailure("test_preview: headless test - fell back to the null preview")
+    for mode in range(11):
+        check_exists(os.path.join(output_dir, 'mode' + str(mode) + '.ppm'), "test_preview: headless test")
+    black_on_white = open(os.path.join(output_dir, 'mode3.ppm'), 'rb').read()
+    white_on_black = open(os.path.join(output_dir, 'mode4.ppm'), 'rb').read()
+    if black_on_white == white_on_black:
+        raise TestFailure("test_preview: headless test - display modes all look the same")
+
+    # "kms test". The same through KMS, when the vkms virtual display driver is loaded.
+    vkms = [card for card in glob.glob('/sys/class/drm/card[0-9]')
+            if os.path.basename(os.path.realpath(os.path.join(card, 'device', 'driver'))) == 'vkms']
+    if vkms:
+        print("    kms test")
+        device = os.path.join('/dev/dri', os.path.basename(vkms[0]))
+        retcode, time_taken = run_executable([executable, '--kms-preview', '--kms-device', device,
+                                              '--input', input_file, '--output-dir', output_dir,
+                                              '--repeat', '5'], logfile)
+        check_retcode(retcode, "test_preview: kms test")
+    else:
+        print("    kms test skipped - vkms not loaded")
+
+    print("preview tests passed")
+
+
 def test_post_processing(exe_dir, output_dir, json_dir):
     logfile = os.path.join(output_dir, 'log.txt')
     print("Testing post-processing")
@@ -579,6 +708,202 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     if open(logfile, 'r').read().find('No post processing stage found') >= 0:
         print("WARNING: test_post_processing: sobel test - missing stages, test incomplete")
 
+    # "auto threshold test". See if the automatic threshold stage appears to run.
+    print("    auto threshold test")
+    executable = os.path.join(exe_dir, 'rpicam-hello')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'auto_threshold.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000',
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: auto threshold test")
+    check_time(time_taken, 2, 8, "test_post_processing: auto threshold test")
+    # Then find the threshold in a page whose left half is grey stripes on black and right half
+    # white stripes on grey. Under --overview, zooming in on either half must only look at that
+    # half. Without it the lores image is already cropped to the zoom, so it's all used.
+    executable = os.path.join(exe_dir, 'rpicam-reading-bench')
+    check_exists(executable, 'post-processing')
+    stripes = (np.arange(240) // 4 % 2).astype(bool)[:, None]
+    page = np.hstack([np.where(stripes, 30, 90) * np.ones((1, 160)), np.where(stripes, 150, 230) * np.ones((1, 160))])
+    frame_file = os.path.join(output_dir, 'page.yuv')
+    with open(frame_file, 'wb') as f:
+        f.write(page.astype(np.uint8).tobytes())
+        f.write(np.full(320 * 240 // 2, 128, dtype=np.uint8).tobytes())
+    for args, low, high in [([], 90, 150), (['--roi', '0,0,0.5,1', '--overview'], 30, 90),
+                            (['--roi', '0.5,0,0.5,1', '--overview'], 150, 230), (['--roi', '0,0,0.5,1'], 90, 150)]:
+        retcode, time_taken = run_executable([executable, '--input', frame_file,
+                                              '--width', '320', '--height', '240'] + args, logfile)
+        check_retcode(retcode, "test_post_processing: auto threshold test")
+        thresholds = [float(line.split()[1]) for line in open(logfile, 'r') if line.startswith('Threshold: ')]
+        if len(thresholds) != 1 or not low < thresholds[0] <= high:
+            raise TestFailure("test_post_processing: auto threshold test - threshold " + str(thresholds) +
+                              " with " + ' '.join(args) + " should be between " + str(low) + " and " + str(high))
+    os.remove(frame_file)
+
+    # "reading line test". Run the text line search alongside the preview's reading line.
+    print("    reading line test")
+    executable = os.path.join(exe_dir, 'rpicam-hello')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'reading_line.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--reading-line', 'mask',
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: reading line test")
+    check_time(time_taken, 2, 8, "test_post_processing: reading line test")
+    # It gets its copies of the image through the request's image cache, which reports on them.
+    if 'PostProcessor: images made' not in open(logfile, 'r').read():
+        raise TestFailure("test_post_processing: reading line test - no image cache report")
+    # Then search a page with two lines of text. Under --overview, zooming onto the bottom half
+    # must find just the second line, and give its position in the zoomed image.
+    executable = os.path.join(exe_dir, 'rpicam-reading-bench')
+    check_exists(executable, 'post-processing')
+    rng = np.random.default_rng(0)
+    page = np.full((240, 320), 200)
+    page[60:80] = page[140:160] = np.where(rng.integers(0, 2, (20, 320)), 30, 200)
+    frame_file = os.path.join(output_dir, 'page.yuv')
+    with open(frame_file, 'wb') as f:
+        f.write(page.astype(np.uint8).tobytes())
+        f.write(np.full(320 * 240 // 2, 128, dtype=np.uint8).tobytes())
+    for args, expected in [([], [60 / 240, 80 / 240, 140 / 240, 160 / 240]),
+                           (['--roi', '0,0.5,1,0.5', '--overview'], [20 / 120, 40 / 120])]:
+        retcode, time_taken = run_executable([executable, '--input', frame_file,
+                                              '--width', '320', '--height', '240'] + args, logfile)
+        check_retcode(retcode, "test_post_processing: reading line test")
+        lines = [[float(x) for x in line.split()[1:]] for line in open(logfile, 'r') if line.startswith('Lines:')]
+        if len(lines) != 1 or len(lines[0]) != len(expected) or \
+           any(abs(x - y) > 0.02 for x, y in zip(lines[0], expected)):
+            raise TestFailure("test_post_processing: reading line test - lines " + str(lines) +
+                              " with " + ' '.join(args) + " should be " + str(expected))
+    os.remove(frame_file)
+    # Finally run it with the face detector, which wants the same copy of the lores image, and
+    # check that the copy gets shared.
+    face_json = json.load(open(os.path.join(json_dir, 'face_detect_cv.json'), 'r'))
+    if not os.path.isfile(face_json['face_detect_cv']['cascade_name']):
+        print("WARNING: test_post_processing: reading line test - no face cascade, skipping sharing test")
+    else:
+        json_file = os.path.join(output_dir, 'shared_copy.json')
+        with open(json_file, 'w') as f:
+            json.dump({**face_json, 'reading_line': {'refresh_rate': 1}}, f)
+        executable = os.path.join(exe_dir, 'rpicam-hello')
+        retcode, time_taken = run_executable([executable, '-t', '2000',
+                                              '--lores-width', '320', '--lores-height', '240',
+                                              '--post-process-file', json_file],
+                                             logfile)
+        check_retcode(retcode, "test_post_processing: reading line test")
+        log_text = open(logfile, 'r').read()
+        if log_text.find('No post processing stage found') >= 0:
+            print("WARNING: test_post_processing: reading line test - missing stages, sharing test incomplete")
+        else:
+            reused = re.findall(r'reused (\d+) times', log_text)
+            if not reused or int(reused[-1]) == 0:
+                raise TestFailure("test_post_processing: reading line test - lores copy never shared")
+        os.remove(json_file)
+
+    # "stage dag test". Run two rendezvous stages side by side, as neither needs the other. Each
+    # waits for the other to start on the same request, so they only ever meet if they really do
+    # overlap, whatever the number of cores. (Both have the same name, so the file is written by
+    # hand.) Then check that depending on a stage that doesn't come first is an error.
+    print("    stage dag test")
+    executable = os.path.join(exe_dir, 'rpicam-hello')
+    json_file = os.path.join(output_dir, 'stage_dag.json')
+    with open(json_file, 'w') as f:
+        f.write('{ "rendezvous": {}, "rendezvous": { "depends_on": [] } }')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '2',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: stage dag test")
+    check_time(time_taken, 2, 8, "test_post_processing: stage dag test")
+    log_text = open(logfile, 'r').read()
+    if not re.search(r'critical path [\d.e+-]+ms', log_text):
+        raise TestFailure("test_post_processing: stage dag test - no critical path reported")
+    meetings = re.findall(r'Rendezvous: met on (\d+) requests, timed out on (\d+)', log_text)
+    if len(meetings) != 2:
+        raise TestFailure("test_post_processing: stage dag test - rendezvous stages didn't report")
+    if any(int(met) == 0 or int(timed_out) > 0 for met, timed_out in meetings):
+        raise TestFailure("test_post_processing: stage dag test - stages didn't overlap " + str(meetings))
+    with open(json_file, 'w') as f:
+        json.dump({'reading_line': {'depends_on': ['roi_metering']}, 'roi_metering': {}}, f)
+    retcode, time_taken = run_executable([executable, '-t', '2000',
+                                          '--post-process-file', json_file], logfile)
+    if retcode == 0:
+        raise TestFailure("test_post_processing: stage dag test - bad dependency accepted")
+    os.remove(json_file)
+
+    # "roi metering test". Meter just the middle of the image, zoomed in. The metered region,
+    # as part of the full field of view, must be the zoomed crop. See too if the exposure
+    # settles, which it can't in every scene (say, when it's too dark to get any brighter).
+    print("    roi metering test")
+    json_file = os.path.join(json_dir, 'roi_metering.json')
+    check_exists(json_file, 'post-processing')
+    metrics_file = os.path.join(output_dir, 'metrics.json')
+    retcode, time_taken = run_executable([executable, '-t', '4000', '--roi', '0.25,0.25,0.5,0.5',
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file, '--metrics-file', metrics_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: roi metering test")
+    check_time(time_taken, 4, 10, "test_post_processing: roi metering test")
+    regions = [line.split()[-1] for line in open(logfile, 'r') if line.startswith('RoiMetering: metering region')]
+    if not regions:
+        raise TestFailure("test_post_processing: roi metering test - no metered region reported")
+    region = [float(v) for v in regions[-1].split(',')]
+    if len(region) != 4 or any(abs(v - e) > 0.02 for v, e in zip(region, (0.25, 0.25, 0.5, 0.5))):
+        raise TestFailure("test_post_processing: roi metering test - metered " + regions[-1] +
+                          " rather than the zoomed crop 0.25,0.25,0.5,0.5")
+    if not os.path.isfile(metrics_file) or \
+       not any(json.loads(line)['event'] == 'exposure' for line in open(metrics_file, 'r')):
+        print("WARNING: test_post_processing: roi metering test - exposure didn't settle")
+
+    # "stabilise test". Run the stabiliser on the camera, and then time its motion estimation
+    # on frames cut from a random texture at known offsets.
+    print("    stabilise test")
+    executable = os.path.join(exe_dir, 'rpicam-hello')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'stabilise.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '2000',
+                                          '--lores-width', '320', '--lores-height', '240',
+                                          '--post-process-file', json_file],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: stabilise test")
+    check_time(time_taken, 2, 8, "test_post_processing: stabilise test")
+    executable = os.path.join(exe_dir, 'rpicam-stabilise-bench')
+    check_exists(executable, 'post-processing')
+    rng = np.random.default_rng(0)
+    texture = rng.integers(0, 256, (300, 400)).astype(np.uint16)
+    texture = ((texture + np.roll(texture, 1, 0) + np.roll(texture, 1, 1) + np.roll(texture, 1, (0, 1))) // 4)
+    offsets = [(40, 30), (43, 28), (38, 33), (38, 30), (45, 30), (41, 26), (36, 31), (40, 35)]
+    frames_file = os.path.join(output_dir, 'frames.yuv')
+    with open(frames_file, 'wb') as f:
+        for x, y in offsets:
+            f.write(texture[y:y + 240, x:x + 320].astype(np.uint8).tobytes())
+            f.write(np.full(320 * 240 // 2, 128, dtype=np.uint8).tobytes())
+    retcode, time_taken = run_executable([executable, '--input', frames_file,
+                                          '--width', '320', '--height', '240'], logfile)
+    check_retcode(retcode, "test_post_processing: stabilise test")
+    estimates = [line.split()[2:] for line in open(logfile, 'r') if line.startswith('Frame ')]
+    if len(estimates) != len(offsets) - 1:
+        raise TestFailure("test_post_processing: stabilise test - wrong number of estimates")
+    for (x0, y0), (x1, y1), estimate in zip(offsets, offsets[1:], estimates):
+        if len(estimate) != 2 or abs(float(estimate[0]) + x1 - x0) > 0.5 or abs(float(estimate[1]) + y1 - y0) > 0.5:
+            raise TestFailure("test_post_processing: stabilise test - motion estimate " + ' '.join(estimate) +
+                              " should be " + str(x0 - x1) + " " + str(y0 - y1))
+    os.remove(frames_file)
+
+    # "yuv to rgb test". Time the fixed point YUV420 to RGB conversion, which fails if it is
+    # ever more than one away from the original.
+    print("    yuv to rgb test")
+    executable = os.path.join(exe_dir, 'rpicam-yuv-bench')
+    check_exists(executable, 'post-processing')
+    retcode, time_taken = run_executable([executable, '--width', '1536', '--height', '864', '--repeat', '5'], logfile)
+    check_retcode(retcode, "test_post_processing: yuv to rgb test")
+    results = [line for line in open(logfile, 'r') if 'max difference' in line]
+    if len(results) != 4:
+        raise TestFailure("test_post_processing: yuv to rgb test - wrong number of results")
+
     # "detect test". Try to run a stage that uses TFLite.
     print("    detect test")
     executable = os.path.join(exe_dir, 'rpicam-hello')
@@ -611,10 +936,126 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     print("post-processing tests passed")
 
 
+def test_gpio(exe_dir, output_dir):
+    executable = os.path.join(exe_dir, 'rpicam-gpio-test')
+    logfile = os.path.join(output_dir, 'log.txt')
+    print("Testing", executable)
+    check_exists(executable, 'test_gpio')
+
+    # "queue test". The queues the knobs post to keep each one's events in order as they go
+    # round, drop events once full, and hand out several sources' events in time order.
+    print("    queue test")
+    with open(logfile, 'w') as log:
+        retcode = subprocess.run([executable, '--queue-test'], stdout=log, stderr=subprocess.STDOUT).returncode
+    check_retcode(retcode, "test_gpio: queue test")
+    if 'queue test passed' not in open(logfile, 'r').read():
+        raise TestFailure("test_gpio: queue test - checks did not complete")
+
+    # "replay test". Feed recorded edges through the decoder: a slow turn of one cycle, with
+    # a quarter of a second between edges, then three quick cycles 5ms apart. The ticks
+    # wrap round part way through, as pigpio's do. The slow turn should move half a detent
+    # for each edge, and once the quick ones get going they should get the full gain.
+    print("    replay test")
+    edge_file = os.path.join(output_dir, 'edges.txt')
+    cycle = (('a', 0), ('b', 0), ('a', 1), ('b', 1))
+    tick = 2**32 - 400000
+    with open(edge_file, 'w') as edges:
+        for pin, level in cycle:
+            edges.write(f"{tick % 2**32} {pin} {level}\n")
+            tick += 250000
+        tick += 50000
+        for pin, level in cycle * 3:
+            edges.write(f"{tick % 2**32} {pin} {level}\n")
+            tick += 5000
+    with open(logfile, 'w') as log:
+        retcode = subprocess.run([executable, '--replay', edge_file, '--acceleration', '6,3,15'],
+                                 stdout=log, stderr=subprocess.STDOUT).returncode
+    check_retcode(retcode, "test_gpio: replay test")
+    amounts = [float(line.split()[3]) for line in open(logfile, 'r') if line.startswith('turn')]
+    if len(amounts) != 16:
+        raise TestFailure("test_gpio: replay test - expected 16 turns, got " + str(len(amounts)))
+    if amounts[:5] != [0.5] * 5:
+        raise TestFailure("test_gpio: replay test - slow turn not half a detent per edge: " + str(amounts[:5]))
+    if amounts[-4:] != [3.0] * 4:
+        raise TestFailure("test_gpio: replay test - quick turn not accelerated: " + str(amounts[-4:]))
+
+    # Make a simulated GPIO chip with the gpio-sim module, and turn and press a knob on it.
+    configfs = '/sys/kernel/config/gpio-sim'
+    if not os.path.isdir(configfs):
+        try:
+            subprocess.run(['modprobe', 'gpio-sim'], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        except OSError:
+            pass
+    if not os.path.isdir(configfs):
+        print("WARNING: test_gpio: knob test - gpio-sim not available, skipping test")
+        return
+
+    # Making the chip needs root, so without it there's nothing more to be done.
+    chip_dir = os.path.join(configfs, 'rpicam-test')
+    bank_dir = os.path.join(chip_dir, 'bank0')
+
+    def remove_chip():
+        if os.path.isdir(chip_dir):
+            try:
+                open(os.path.join(chip_dir, 'live'), 'w').write('0')
+            except OSError:
+                pass
+            for directory in (bank_dir, chip_dir):
+                if os.path.isdir(directory):
+                    os.rmdir(directory)
+
+    try:
+        os.mkdir(chip_dir)
+        os.mkdir(bank_dir)
+        open(os.path.join(bank_dir, 'num_lines'), 'w').write('3')
+        open(os.path.join(chip_dir, 'live'), 'w').write('1')
+        chip_name = open(os.path.join(bank_dir, 'chip_name')).read().strip()
+        dev_name = open(os.path.join(chip_dir, 'dev_name')).read().strip()
+        if not os.access('/dev/' + chip_name, os.R_OK | os.W_OK):
+            raise PermissionError(errno.EACCES, 'no access to /dev/' + chip_name)
+    except OSError as e:
+        print("WARNING: test_gpio: knob test - can't make a gpio-sim chip (" + str(e) + "), skipping test")
+        try:
+            remove_chip()
+        except OSError:
+            pass
+        return
+
+    try:
+        sim_dir = os.path.join('/sys/devices/platform', dev_name, chip_name)
+
+        def set_line(line, level):
+            open(os.path.join(sim_dir, 'sim_gpio' + str(line), 'pull'), 'w').write(
+                'pull-up' if level else 'pull-down')
+            time.sleep(0.02)
+
+        # "knob test". One full cycle of the encoder each way is four counts (two detents),
+        # followed by a press of the button.
+        print("    knob test")
+        with open(logfile, 'w') as log:
+            p = subprocess.Popen([executable, '--gpio-chip', '/dev/' + chip_name, '--knob', '0,1,2',
+                                  '-t', '2000'], stdout=log, stderr=subprocess.STDOUT)
+            time.sleep(0.5)
+            for line, level in ((0, 0), (1, 0), (0, 1), (1, 1), (1, 0), (0, 0), (1, 1), (0, 1), (2, 0), (2, 1)):
+                set_line(line, level)
+            retcode = p.wait()
+        check_retcode(retcode, "test_gpio: knob test")
+        events = [line.split() for line in open(logfile, 'r')]
+        turns = [int(e[2]) for e in events if e[0] == 'turn']
+        if turns != [1] * 4 + [-1] * 4:
+            raise TestFailure("test_gpio: knob test - expected four counts each way, got " + str(turns))
+        if [e[0] for e in events if e[0] != 'turn'] != ['press', 'release']:
+            raise TestFailure("test_gpio: knob test - button press not seen")
+    finally:
+        remove_chip()
+
+    print("rpicam-gpio-test tests passed")
+
+
 def test_all(apps, exe_dir, output_dir, json_dir):
     try:
         if 'hello' in apps:
-            test_hello(exe_dir, output_dir)
+            test_hello(exe_dir, output_dir, json_dir)
         if 'still' in apps:
             test_still(exe_dir, output_dir)
         if 'jpeg' in apps:
@@ -625,6 +1066,10 @@ def test_all(apps, exe_dir, output_dir, json_dir):
             test_raw(exe_dir, output_dir)
         if 'post-processing' in apps:
             test_post_processing(exe_dir, output_dir, json_dir)
+        if 'preview' in apps:
+            test_preview(exe_dir, output_dir)
+        if 'gpio' in apps:
+            test_gpio(exe_dir, output_dir)
 
         print("All tests passed")
         clean_dir(output_dir)
@@ -638,7 +1083,7 @@ def test_all(apps, exe_dir, output_dir, json_dir):
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description = 'rpicam-apps automated tests')
-    parser.add_argument('--apps', '-a', action='store', default='hello,still,vid,jpeg,raw,post-processing',
+    parser.add_argument('--apps', '-a', action='store', default='hello,still,vid,jpeg,raw,post-processing,preview,gpio',
                         help='List of apps to test')
     parser.add_argument('--exe-dir', '-d', action='store', default='build',
                         help='Directory name for executables to test')